@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "accesslog.h"
+
+#define RING_SIZE (1 << 16) // bytes per thread, must be a power of two
+
+/*
+  Single producer/single consumer byte ring. Only the owning thread moves
+  head and only the logger thread moves tail, so neither needs a lock.
+*/
+struct LogRing {
+  char data[RING_SIZE];
+  _Alignas(64) atomic_size_t head;  // bytes ever queued
+  _Alignas(64) atomic_size_t tail;  // bytes ever written out
+  atomic_uint_fast64_t entries;
+  struct LogRing* next;
+};
+
+static int logFile = -1;
+static size_t maxBatchBytes;
+static int maxBatchMs;
+
+// every thread's ring, only ever added to
+static pthread_mutex_t m_rings = PTHREAD_MUTEX_INITIALIZER;
+static struct LogRing* _Atomic rings = NULL;
+static __thread struct LogRing* threadRing = NULL;
+
+// wakes the logger and lets writers wait for a flush
+static pthread_mutex_t m_logger = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t c_logger = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t c_flushed = PTHREAD_COND_INITIALIZER;
+static atomic_size_t pendingBytes;
+static uint64_t flushesRequested = 0;  // protected by m_logger
+static uint64_t flushesDone = 0;       // protected by m_logger
+
+static atomic_uint_fast64_t bytesWritten, batches, stalls;
+
+// the two hex digits of every byte value, in order
+static const char hexPairs[513] =
+  "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+  "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+  "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+  "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+  "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+  "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+  "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+  "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static struct LogRing* get_thread_ring() {
+  if (threadRing != NULL) {
+    return threadRing;
+  }
+
+  struct LogRing* ring = malloc(sizeof *ring);
+  if (ring == NULL) {
+    err(EXIT_FAILURE, "cannot allocate log ring");
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->entries, 0);
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&m_rings);
+  ring->next = rings;
+  rings = ring;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&m_rings);
+
+  threadRing = ring;
+  return ring;
+}
+
+// wakes the logger if it is asleep or waiting to fill a batch
+static void wake_logger() {
+  pthread_mutex_lock(&m_logger);
+  pthread_cond_signal(&c_logger);
+  pthread_mutex_unlock(&m_logger);
+}
+
+void accesslog_flush() {
+  // START CRITICAL REGION
+  pthread_mutex_lock(&m_logger);
+  uint64_t flush = ++flushesRequested;
+  pthread_cond_signal(&c_logger);
+  while (flushesDone < flush) {
+    pthread_cond_wait(&c_flushed, &m_logger);
+  }
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&m_logger);
+}
+
+void accesslog_write(const char* entry, size_t len) {
+  if (len > RING_SIZE) {
+    warnx("log entry of %zu bytes is too long, dropping it", len);
+    return;
+  }
+  struct LogRing* ring = get_thread_ring();
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  while (RING_SIZE - (head - atomic_load_explicit(&ring->tail, memory_order_acquire)) < len) {
+    atomic_fetch_add_explicit(&stalls, 1, memory_order_relaxed);
+    accesslog_flush();
+  }
+
+  // copy the entry in, wrapping around the end of the ring if needed
+  size_t offset = head & (RING_SIZE - 1);
+  size_t firstPart = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+  memcpy(ring->data + offset, entry, firstPart);
+  memcpy(ring->data, entry + firstPart, len - firstPart);
+
+  // count it before publishing it, so the logger never drains bytes it hasn't been told about
+  size_t pending = atomic_fetch_add(&pendingBytes, len);
+  atomic_store_explicit(&ring->head, head + len, memory_order_release);
+  atomic_fetch_add_explicit(&ring->entries, 1, memory_order_relaxed);
+
+  // only the first entry of a batch and the one that fills it need to wake the logger
+  if (pending == 0 || (pending < maxBatchBytes && pending + len >= maxBatchBytes)) {
+    wake_logger();
+  }
+}
+
+static void write_batch(struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t bytes = writev(logFile, iov, iovcnt);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      warn("cannot write to the log file");
+      return;
+    }
+    atomic_fetch_add_explicit(&batches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bytesWritten, bytes, memory_order_relaxed);
+
+    // skip past whatever made it out on a short write
+    while (iovcnt > 0 && (size_t) bytes >= iov->iov_len) {
+      bytes -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + bytes;
+      iov->iov_len -= bytes;
+    }
+  }
+}
+
+// writes out everything queued in the rings so far
+static void drain_rings() {
+  struct iovec iov[IOV_MAX];
+  struct LogRing* drained[IOV_MAX / 2];
+  size_t drainedTo[IOV_MAX / 2];
+
+  struct LogRing* ring = rings;
+  while (ring != NULL) {
+    int iovcnt = 0;
+    int numOfDrained = 0;
+    size_t total = 0;
+
+    // fill one writev with as many rings as fit
+    for (; ring != NULL && numOfDrained < IOV_MAX / 2; ring = ring->next) {
+      size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+      if (head == tail)
+        continue;
+
+      size_t len = head - tail;
+      size_t offset = tail & (RING_SIZE - 1);
+      size_t firstPart = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+      iov[iovcnt].iov_base = ring->data + offset;
+      iov[iovcnt++].iov_len = firstPart;
+      if (firstPart < len) {
+        iov[iovcnt].iov_base = ring->data;
+        iov[iovcnt++].iov_len = len - firstPart;
+      }
+      drained[numOfDrained] = ring;
+      drainedTo[numOfDrained++] = head;
+      total += len;
+    }
+    if (numOfDrained == 0)
+      break;
+
+    write_batch(iov, iovcnt);
+
+    // hand the space back to the writers
+    for (int i = 0; i < numOfDrained; ++i) {
+      atomic_store_explicit(&drained[i]->tail, drainedTo[i], memory_order_release);
+    }
+    atomic_fetch_sub(&pendingBytes, total);
+  }
+}
+
+static void deadline_after(struct timespec* deadline, int ms) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+// logger thread function
+static void* t_logger(void* arg) {
+  (void) arg;
+  while (1) {
+    // START CRITICAL REGION
+    pthread_mutex_lock(&m_logger);
+
+    // sleep until the first entry of a batch shows up
+    while (atomic_load(&pendingBytes) == 0 && flushesDone == flushesRequested) {
+      pthread_cond_wait(&c_logger, &m_logger);
+    }
+
+    // give the batch time to fill up unless it is already big enough or someone is waiting on it
+    struct timespec deadline;
+    deadline_after(&deadline, maxBatchMs);
+    while (atomic_load(&pendingBytes) < maxBatchBytes && flushesDone == flushesRequested) {
+      if (pthread_cond_timedwait(&c_logger, &m_logger, &deadline) == ETIMEDOUT)
+        break;
+    }
+    uint64_t flush = flushesRequested;
+
+    // END CRITICAL REGION
+    pthread_mutex_unlock(&m_logger);
+
+    drain_rings();
+
+    // START CRITICAL REGION
+    pthread_mutex_lock(&m_logger);
+    flushesDone = flush;
+    pthread_cond_broadcast(&c_flushed);
+    // END CRITICAL REGION
+    pthread_mutex_unlock(&m_logger);
+  }
+  return NULL;
+}
+
+void accesslog_start(int logFileDesc, size_t flushBytes, int flushMs) {
+  logFile = logFileDesc;
+  maxBatchBytes = flushBytes;
+  maxBatchMs = flushMs;
+  atomic_init(&pendingBytes, 0);
+
+  pthread_t loggerThread;
+  if (pthread_create(&loggerThread, NULL, &t_logger, NULL) != 0) {
+    err(EXIT_FAILURE, "cannot create logger thread");
+  }
+  pthread_detach(loggerThread);
+}
+
+void accesslog_get_stats(struct AccessLogStats* stats) {
+  stats->entries = 0;
+  stats->pending = 0;
+  for (struct LogRing* ring = rings; ring != NULL; ring = ring->next) {
+    stats->entries += atomic_load(&ring->entries);
+    // tail first, so it can't have passed a head read after it
+    size_t tail = atomic_load(&ring->tail);
+    stats->pending += atomic_load(&ring->head) - tail;
+  }
+  stats->bytes = atomic_load(&bytesWritten);
+  stats->batches = atomic_load(&batches);
+  stats->stalls = atomic_load(&stalls);
+}
+
+#ifdef __SSE2__
+// turns 16 nibbles into their hex digits
+static inline __m128i hex_digits(__m128i nibbles) {
+  __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+  return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+#endif
+
+size_t accesslog_hex(char* out, const void* data, size_t len) {
+  const unsigned char* bytes = data;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // 16 bytes at a time, splitting them into nibbles and interleaving high before low
+  const __m128i lowNibble = _mm_set1_epi8(0x0f);
+  for (; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*) (bytes + i));
+    __m128i high = _mm_and_si128(_mm_srli_epi16(block, 4), lowNibble);
+    __m128i low = _mm_and_si128(block, lowNibble);
+    _mm_storeu_si128((__m128i*) (out + 2 * i), hex_digits(_mm_unpacklo_epi8(high, low)));
+    _mm_storeu_si128((__m128i*) (out + 2 * i + 16), hex_digits(_mm_unpackhi_epi8(high, low)));
+  }
+#endif
+
+  for (; i < len; ++i) {
+    memcpy(out + 2 * i, hexPairs + 2 * bytes[i], 2);
+  }
+  return 2 * len;
+}
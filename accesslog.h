@@ -0,0 +1,39 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+   Asynchronous access log. Each thread appends entries to its own ring
+   buffer without taking a lock, and a single logger thread drains all
+   of the rings into the log file with one writev per batch. A batch is
+   written once flushBytes are pending or flushMs after its first entry
+   arrived, whichever comes first. Entries are written whole, so lines
+   from different threads never interleave.
+ */
+void accesslog_start(int logFileDesc, size_t flushBytes, int flushMs);
+
+// queues one complete entry, blocking only while the thread's ring is full
+void accesslog_write(const char* entry, size_t len);
+
+// blocks until every entry queued before the call is in the log file
+void accesslog_flush();
+
+/**
+   Writes the lowercase hex encoding of len bytes of data to out, which
+   needs room for 2 * len characters. No terminator is added.
+   Returns the number of characters written.
+ */
+size_t accesslog_hex(char* out, const void* data, size_t len);
+
+struct AccessLogStats {
+  uint64_t entries;   // entries queued
+  uint64_t bytes;     // bytes written to the log file
+  uint64_t batches;   // writev calls it took
+  uint64_t stalls;    // times a thread found its ring full and had to wait
+  uint64_t pending;   // bytes queued that the logger hasn't written yet
+};
+void accesslog_get_stats(struct AccessLogStats* stats);
+
+#endif
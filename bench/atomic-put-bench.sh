@@ -0,0 +1,46 @@
+#!/bin/bash
+# GET latency on a hot file while it is being re-uploaded over and over,
+# with PUTs that truncate and rewrite it in place under the file's write
+# lock, against -a, where every PUT writes a file of its own and renames
+# it over the old one. Uploads are rate limited so each one takes a while.
+#
+# usage: bench/atomic-put-bench.sh [seconds per run] [upload rate]   (from the repository root)
+
+seconds=${1:-5}
+rate=${2:-20M}
+root=$(pwd)
+make -s httpserver load-bench || exit 1
+
+dir=$(mktemp -d)
+trap '[ -n "$server" ] && kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+head -c $((4 << 20)) /dev/urandom > "$dir/upload.bin"
+
+run () {
+	local name=$1 flags=$2
+	# valid_host rejects ports above 32767
+	local port=$((20000 + RANDOM % 10000))
+	(cd "$dir" && exec "$root/httpserver" -n 16 -r 1000000 $flags $port) &
+	server=$!
+	sleep 0.3
+	curl -s -T "$dir/upload.bin" "localhost:$port/hot.bin" > /dev/null
+
+	# keep re-uploading the file the GETs ask for until the run is over
+	(
+		end=$((SECONDS + seconds))
+		while [ $SECONDS -lt $end ]; do
+			curl -s --limit-rate $rate -T "$dir/upload.bin" "localhost:$port/hot.bin" > /dev/null
+		done
+	) &
+	local uploader=$!
+
+	printf "%-10s " "$name"
+	bench/load-bench -p $port -f hot.bin -c 8 -d $seconds
+	wait $uploader
+	kill $server
+	wait $server 2>/dev/null
+	server=
+}
+
+run "in place" ""
+run "atomic" "-a"
+exit 0
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Upload throughput of PUTs with a Content-Length, whose body is spliced
+# straight into the file, against the same bodies sent with
+# "Transfer-Encoding: chunked", whose framing is decoded as it arrives.
+# Each size is uploaded count times over one kept-alive connection.
+#
+# usage: bench/chunked-bench.sh   (from the repository root)
+
+root=$(pwd)
+make -s httpserver || exit 1
+
+dir=$(mktemp -d)
+trap '[ -n "$server" ] && kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+
+# valid_host rejects ports above 32767
+port=$((20000 + RANDOM % 10000))
+(cd "$dir" && exec "$root/httpserver" -n 4 -r 1000000 $port) &
+server=$!
+sleep 0.3
+
+now_ns () {
+	date +%s%N
+}
+
+# uploads body count times in one curl, and prints the throughput
+measure () {
+	local name=$1 body=$2 count=$3 header=$4
+	local size=$(stat -c %s "$body")
+	local urls=()
+	for i in $(seq $count); do
+		urls+=(-T "$body" "localhost:$port/up$i.bin")
+	done
+	local start=$(now_ns)
+	curl -s ${header:+-H "$header"} "${urls[@]}" > /dev/null || echo "upload failed"
+	local elapsed=$(( $(now_ns) - start ))
+	awk -v name=$name -v count=$count -v size=$5 -v bytes=$((size * count)) -v ns=$elapsed \
+		'BEGIN { printf "%-10s %5d x %-6s %8.1f MB/s\n", name, count, size, bytes * 1000 / ns }'
+}
+
+for spec in "256K 200" "4M 50" "64M 8" "256M 2"; do
+	set -- $spec
+	head -c $1 /dev/urandom > "$dir/body.bin"
+	measure "length" "$dir/body.bin" $2 "" $1
+	measure "chunked" "$dir/body.bin" $2 "Transfer-Encoding: chunked" $1
+done
+
+kill $server
+wait $server 2>/dev/null
+server=
+exit 0
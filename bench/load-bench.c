@@ -0,0 +1,211 @@
+/*
+  Closed-loop load generator for comparing the server's connection
+  engines. Each of the connections sends a GET for the file, waits for
+  the whole response and sends the next one, either on the same
+  kept-alive connection or, with -x, on a new connection every time.
+  Runs in a single epoll thread so it takes as little CPU as possible
+  away from the server. Reports requests and bytes per second and the
+  median and 99th percentile latency.
+
+  usage: ./load-bench -p port [-f file] [-c connections] [-d seconds] [-x]
+*/
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_CONNECTIONS 1024
+#define MAX_LATENCY_US 1000000 // latencies above a second are counted as a second
+
+struct Client {
+  int fd;
+  char head[1024];      // response head read so far
+  size_t headLen;
+  long bodyLeft;        // -1 while the head is still incomplete
+  double sentAt;
+};
+
+uint16_t port = 0;
+const char* fileName = "small.txt";
+int newConnections = 0;
+char request[256];
+int requestLen;
+
+long requests = 0, errors = 0, bytes = 0;
+uint32_t latencies[MAX_LATENCY_US + 1];
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connect_to_server() {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof addr) < 0) {
+    err(EXIT_FAILURE, "cannot connect to port %d", port);
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+void send_request(int epollfd, struct Client* client) {
+  if (client->fd < 0) {
+    client->fd = connect_to_server();
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client->fd, &event) < 0) {
+      err(EXIT_FAILURE, "epoll_ctl error");
+    }
+  }
+  client->headLen = 0;
+  client->bodyLeft = -1;
+  client->sentAt = now_seconds();
+  // requests are tiny, so they always fit in the socket buffer
+  if (send(client->fd, request, requestLen, MSG_NOSIGNAL) != requestLen) {
+    err(EXIT_FAILURE, "send error");
+  }
+}
+
+void finish_response(int epollfd, struct Client* client, int failed) {
+  long us = (now_seconds() - client->sentAt) * 1e6;
+  latencies[us > MAX_LATENCY_US ? MAX_LATENCY_US : us]++;
+  requests++;
+  errors += failed;
+  if (newConnections || failed) {
+    close(client->fd);
+    client->fd = -1;
+  }
+  send_request(epollfd, client);
+}
+
+// reads what has arrived for client, returns once it would block
+void read_response(int epollfd, struct Client* client) {
+  char buffer[1 << 16];
+  while (1) {
+    ssize_t len = recv(client->fd, buffer, sizeof buffer, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (len <= 0) {
+      finish_response(epollfd, client, 1);
+      return;
+    }
+    bytes += len;
+
+    char* body = buffer;
+    if (client->bodyLeft < 0) {
+      size_t copy = (size_t) len < sizeof client->head - 1 - client->headLen ? (size_t) len : sizeof client->head - 1 - client->headLen;
+      memcpy(client->head + client->headLen, buffer, copy);
+      client->headLen += copy;
+      client->head[client->headLen] = '\0';
+      char* end = strstr(client->head, "\r\n\r\n");
+      if (end == NULL)
+        continue;
+      char* length = strstr(client->head, "Content-Length: ");
+      client->bodyLeft = length != NULL ? atol(length + 16) : 0;
+      size_t headBytes = end + 4 - client->head;
+      body = buffer + (headBytes - (client->headLen - copy));
+      if (strncmp(client->head, "HTTP/1.1 200", 12) != 0) {
+        finish_response(epollfd, client, 1);
+        return;
+      }
+    }
+    client->bodyLeft -= buffer + len - body;
+    if (client->bodyLeft <= 0) {
+      finish_response(epollfd, client, 0);
+      return;
+    }
+  }
+}
+
+long percentile(double fraction) {
+  long target = requests * fraction, seen = 0;
+  for (long us = 0; us <= MAX_LATENCY_US; ++us) {
+    seen += latencies[us];
+    if (seen > target)
+      return us;
+  }
+  return MAX_LATENCY_US;
+}
+
+int main(int argc, char* argv[]) {
+  int numOfClients = 16;
+  double seconds = 3;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:f:c:d:x")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'f':
+        fileName = optarg;
+        break;
+      case 'c':
+        numOfClients = atoi(optarg);
+        break;
+      case 'd':
+        seconds = atof(optarg);
+        break;
+      case 'x':
+        newConnections = 1;
+        break;
+      default:
+        errx(EXIT_FAILURE, "usage: %s -p port [-f file] [-c connections] [-d seconds] [-x]", argv[0]);
+    }
+  }
+  if (port == 0) {
+    errx(EXIT_FAILURE, "a port is required");
+  }
+  if (numOfClients <= 0 || numOfClients > MAX_CONNECTIONS) {
+    errx(EXIT_FAILURE, "connections have to be between 1 and %d", MAX_CONNECTIONS);
+  }
+
+  requestLen = snprintf(request, sizeof request, "GET /%s HTTP/1.1\r\nHost: localhost:%d\r\n%s\r\n",
+      fileName, port, newConnections ? "Connection: close\r\n" : "");
+
+  int epollfd = epoll_create1(0);
+  static struct Client clients[MAX_CONNECTIONS];
+  for (int i = 0; i < numOfClients; ++i) {
+    clients[i].fd = -1;
+    send_request(epollfd, &clients[i]);
+  }
+
+  double start = now_seconds(), end = start + seconds;
+  struct epoll_event events[MAX_CONNECTIONS];
+  while (now_seconds() < end) {
+    int numOfEvents = epoll_wait(epollfd, events, MAX_CONNECTIONS, 100);
+    for (int i = 0; i < numOfEvents; ++i) {
+      read_response(epollfd, events[i].data.ptr);
+    }
+  }
+  double elapsed = now_seconds() - start;
+
+  printf("%9.0f req/s %9.1f MB/s   p50 %6ld us   p99 %6ld us   %ld errors\n",
+      requests / elapsed,
+      bytes / elapsed / 1e6,
+      percentile(0.5),
+      percentile(0.99),
+      errors
+  );
+  return errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+/*
+  Microbenchmark for building GET log entries.
+
+  "legacy" is what logRequest used to do for every GET: reopen the file
+  by name, read its first 1000 bytes and hex encode them with one sprintf
+  per byte. "current" reads the same bytes through the descriptor the
+  server already has open and encodes them with accesslog_hex. The hex
+  encoding alone is timed both ways as well. Reports nanoseconds per
+  entry on one core.
+
+  usage: ./logentry-bench [-o operations per run]
+*/
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../accesslog.h"
+
+#define LOG_BODY_BYTES 1000
+
+const char* fileName = "logentry-bench.tmp";
+
+// keeps the compiler from optimizing the work away
+volatile size_t sink;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t legacy_hex(char* out, const unsigned char* bytes, int len) {
+  out[0] = '\0';
+  for (int i = 0; i < len; ++i) {
+    sprintf(&out[i*2], "%02x", bytes[i]);
+  }
+  return 2 * len;
+}
+
+// the GET branch of logRequest before accesslog_hex
+size_t legacy_entry(char* log) {
+  char asciiBuf[LOG_BODY_BYTES];
+  int file = open(fileName, O_RDONLY);
+  int bytesRead = read(file, asciiBuf, LOG_BODY_BYTES);
+  close(file);
+
+  char firstThouBytesHex[bytesRead*2 + 1];
+  legacy_hex(firstThouBytesHex, (unsigned char*) asciiBuf, bytesRead);
+  return sprintf(log, "%s\t/%s\tlocalhost:%d\t%d\t%s\n", "GET", fileName, 8080, 4096, firstThouBytesHex);
+}
+
+size_t current_entry(char* log, int file) {
+  char firstBytes[LOG_BODY_BYTES];
+  int firstBytesLen = pread(file, firstBytes, LOG_BODY_BYTES, 0);
+  int len = sprintf(log, "%s\t/%s\tlocalhost:%d\t%d\t", "GET", fileName, 8080, 4096);
+  len += accesslog_hex(log + len, firstBytes, firstBytesLen);
+  log[len++] = '\n';
+  return len;
+}
+
+void report(const char* name, double seconds, long operations) {
+  printf("%-16s %10.0f ns\n", name, seconds / operations * 1e9);
+}
+
+int main(int argc, char* argv[]) {
+  long operations = 200000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+      case 'o':
+        operations = atol(optarg);
+        break;
+      default:
+        errx(EXIT_FAILURE, "usage: %s [-o operations]", argv[0]);
+    }
+  }
+  if (operations <= 0) {
+    errx(EXIT_FAILURE, "operations have to be positive");
+  }
+
+  // a file of every byte value, so bytes >= 0x80 are covered
+  unsigned char bytes[4096];
+  for (size_t i = 0; i < sizeof bytes; ++i) {
+    bytes[i] = i * 7;
+  }
+  int file = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (file < 0 || write(file, bytes, sizeof bytes) != (ssize_t) sizeof bytes) {
+    err(EXIT_FAILURE, "cannot write %s", fileName);
+  }
+
+  char legacyLog[2 * LOG_BODY_BYTES + 100], log[2 * LOG_BODY_BYTES + 100];
+  size_t legacyLen = legacy_entry(legacyLog);
+  if (current_entry(log, file) != legacyLen || memcmp(log, legacyLog, legacyLen) != 0) {
+    errx(EXIT_FAILURE, "the entries differ");
+  }
+
+  printf("%ld operations per run, %d bytes hex encoded, time per entry on one core\n", operations, LOG_BODY_BYTES);
+  double start = now_seconds();
+  for (long i = 0; i < operations; ++i) {
+    sink += legacy_hex(log, bytes, LOG_BODY_BYTES);
+  }
+  report("hex, sprintf", now_seconds() - start, operations);
+
+  start = now_seconds();
+  for (long i = 0; i < operations; ++i) {
+    sink += accesslog_hex(log, bytes, LOG_BODY_BYTES);
+  }
+  report("hex, current", now_seconds() - start, operations);
+
+  start = now_seconds();
+  for (long i = 0; i < operations; ++i) {
+    sink += legacy_entry(log);
+  }
+  report("entry, legacy", now_seconds() - start, operations);
+
+  start = now_seconds();
+  for (long i = 0; i < operations; ++i) {
+    sink += current_entry(log, file);
+  }
+  report("entry, current", now_seconds() - start, operations);
+
+  close(file);
+  unlink(fileName);
+  return EXIT_SUCCESS;
+}
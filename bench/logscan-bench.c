@@ -0,0 +1,213 @@
+/*
+  Startup benchmark for log validation in logscan.c.
+
+  Writes a log of the requested size made of entries like the ones
+  httpserver logs (unless the file is already there with that size), then
+  times validating it the way openLogFile used to, with 512 byte reads and
+  a byte at a time loop, against the mmapped SIMD scan on one thread and
+  on all of them. Every run has to agree on the entry and error counts.
+
+  The first run over a log bigger than memory reads it from disk, later
+  ones may find part of it in the page cache.
+
+  usage: ./logscan-bench [-f log file] [-s size in MiB] [-t threads] [-l]
+    -l skips the legacy read loop, which takes minutes on a 10 GiB log
+*/
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "../logscan.h"
+
+#define BUFFER_SIZE 512
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a GET, HEAD, PUT or FAIL entry with up to 1000 bytes of hex like the real log
+size_t make_entry(char* line, unsigned int* seed) {
+  const char* names[] = { "r1.txt", "index.html", "big_file.bin", "a" };
+  const char* name = names[rand_r(seed) % 4];
+  int kind = rand_r(seed) % 10;
+
+  if (kind == 0) {
+    return sprintf(line, "FAIL\tGET /%s HTTP/1.1\t404\n", name);
+  }
+  if (kind < 3) {
+    return sprintf(line, "HEAD\t/%s\tlocalhost:8080\t%d\n", name, rand_r(seed) % 100000);
+  }
+
+  int length = rand_r(seed) % 1001;
+  size_t len = sprintf(line, "%s\t/%s\tlocalhost:8080\t%d\t", kind < 8 ? "GET" : "PUT", name, length);
+  for (int i = 0; i < length; ++i) {
+    line[len++] = "0123456789abcdef"[rand_r(seed) % 16];
+    line[len++] = "0123456789abcdef"[rand_r(seed) % 16];
+  }
+  line[len++] = '\n';
+  return len;
+}
+
+void generate_log(const char* path, off_t size) {
+  printf("writing a %.1f GiB log to %s\n", size / (double) (1 << 30), path);
+  int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file < 0) {
+    err(EXIT_FAILURE, "cannot create %s", path);
+  }
+
+  static char buffer[1 << 20];
+  unsigned int seed = 1;
+  off_t written = 0;
+  while (written < size) {
+    size_t len = 0;
+    while (len + 2200 < sizeof buffer && written + (off_t) len < size) {
+      len += make_entry(buffer + len, &seed);
+    }
+    if (write(file, buffer, len) != (ssize_t) len) {
+      err(EXIT_FAILURE, "cannot write %s", path);
+    }
+    written += len;
+  }
+  // the log ends up to one entry past the size, it has to stay whole lines
+  close(file);
+}
+
+// what openLogFile did before logscan.c
+void legacy_scan(int file, struct LogScan* scan) {
+  char buffer[BUFFER_SIZE];
+  int tabCount = 0;
+  int lineLen = 0;
+  int failPrefix = 1;
+  long offset = 0;
+  long lineStart = 0;
+
+  scan->entries = scan->errors = 0;
+  scan->badOffset = -1;
+  while (1) {
+    int bytesRead = read(file, buffer, BUFFER_SIZE);
+    if (bytesRead < 0) {
+      err(EXIT_FAILURE, "cannot read the log");
+    }
+    for (int i = 0; i < bytesRead; ++i) {
+      if (buffer[i] == '\t') {
+        tabCount++;
+      } else if (buffer[i] == '\n') {
+        if (tabCount < 2 || tabCount > 4) {
+          scan->badOffset = lineStart;
+          return;
+        }
+        tabCount = 0;
+      }
+
+      if (buffer[i] == '\n') {
+        scan->entries++;
+        if (failPrefix && lineLen >= 4)
+          scan->errors++;
+        lineLen = 0;
+        failPrefix = 1;
+        lineStart = offset + i + 1;
+      } else {
+        if (lineLen < 4 && buffer[i] != "FAIL"[lineLen])
+          failPrefix = 0;
+        lineLen++;
+      }
+    }
+    offset += bytesRead;
+    if (bytesRead < BUFFER_SIZE) {
+      break;
+    }
+  }
+}
+
+void report(const char* name, double seconds, off_t size, struct LogScan* scan, struct LogScan* expected) {
+  printf("%-22s %8.2f s %8.2f GiB/s %12ld entries %10ld errors\n",
+      name, seconds, size / seconds / (1 << 30), scan->entries, scan->errors);
+  if (scan->badOffset != -1) {
+    errx(EXIT_FAILURE, "%s found a malformed line at %ld", name, scan->badOffset);
+  }
+  if (expected != NULL && (scan->entries != expected->entries || scan->errors != expected->errors)) {
+    errx(EXIT_FAILURE, "%s disagrees with the first run", name);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  const char* path = "/tmp/logscan-bench.log";
+  off_t size = (off_t) 10240 << 20;
+  int numOfThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int runLegacy = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:s:t:l")) != -1) {
+    switch (opt) {
+      case 'f':
+        path = optarg;
+        break;
+      case 's':
+        size = (off_t) atol(optarg) << 20;
+        break;
+      case 't':
+        numOfThreads = atoi(optarg);
+        break;
+      case 'l':
+        runLegacy = 0;
+        break;
+      default:
+        errx(EXIT_FAILURE, "usage: %s [-f log file] [-s size in MiB] [-t threads] [-l]", argv[0]);
+    }
+  }
+  if (size <= 0 || numOfThreads <= 0) {
+    errx(EXIT_FAILURE, "size and threads have to be positive");
+  }
+
+  struct stat fileStat;
+  if (stat(path, &fileStat) < 0 || fileStat.st_size < size) {
+    generate_log(path, size);
+  }
+  int file = open(path, O_RDONLY);
+  if (file < 0 || fstat(file, &fileStat) < 0) {
+    err(EXIT_FAILURE, "cannot open %s", path);
+  }
+  size = fileStat.st_size;
+  printf("%s: %.2f GiB, scanner %s, %d threads\n", path, size / (double) (1 << 30), logscan_impl(), numOfThreads);
+
+  struct LogScan first, scan;
+  struct LogScan* expected = NULL;
+  double start;
+
+  if (runLegacy) {
+    start = now_seconds();
+    legacy_scan(file, &first);
+    report("legacy 512 B reads", now_seconds() - start, size, &first, NULL);
+    expected = &first;
+  }
+
+  start = now_seconds();
+  if (logscan_file(file, 1, &scan) < 0) {
+    err(EXIT_FAILURE, "cannot map %s", path);
+  }
+  report("mmap, 1 thread", now_seconds() - start, size, &scan, expected);
+  if (expected == NULL) {
+    first = scan;
+    expected = &first;
+  }
+
+  if (numOfThreads > 1) {
+    char name[32];
+    sprintf(name, "mmap, %d threads", numOfThreads);
+    start = now_seconds();
+    logscan_file(file, numOfThreads, &scan);
+    report(name, now_seconds() - start, size, &scan, expected);
+  }
+
+  close(file);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,412 @@
+/*
+  Microbenchmarks for the CPU-bound code every request goes through.
+
+  Each benchmark is a function that does its operation a given number of
+  times. The harness first finds how many operations take about -t
+  milliseconds, runs that many once as a warmup, then times -s samples
+  of that many. It reports the median and the fastest time per
+  operation, how much the samples vary (their standard deviation as a
+  percentage of the mean), and CPU cycles per operation. Cycles come
+  from the hardware counter through perf_event_open, or from the time
+  stamp counter where that isn't allowed, which counts at a fixed rate
+  instead of the core's ("ref cycles").
+
+  httpparse.c and accesslog.c are linked in. valid_filename,
+  parseRequestHeaders, checkCache and getServerPort still live in
+  httpserver.c and httpproxy.c next to main, so they are copied here
+  until they move out, and have to be kept in sync by hand.
+
+  usage: ./micro-bench [-s samples] [-t ms per sample] [benchmark name ...]
+*/
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <err.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../accesslog.h"
+#include "../httpparse.h"
+
+#define MAX_SAMPLES 100
+#define LOG_BODY_BYTES 1000
+
+// keeps the compiler from optimizing the work away
+volatile size_t sink;
+
+/* ---------- copies of functions that can't be linked yet ---------- */
+
+// valid_filename from httpserver.c, which httpproxy.c has a copy of too
+int valid_filename(char fileName[]) {
+  int fileNameLen = strlen(fileName);
+
+  // return false if filename is too long
+  if (fileNameLen > 19) {
+    return 0;
+  }
+
+  // return false if filename contains any characters other than a-z, A-Z, 0-9, '.', or '_'
+  for (int i = 0; i < fileNameLen; ++i) {
+    if ( isalnum(fileName[i]) || fileName[i] == '.' || fileName[i] == '_')
+      continue;
+    return 0;
+  }
+
+  return 1;
+}
+
+// the benchmarked requests are all valid, so nothing is ever sent
+void send_response_fail(int connfd, int statusCode) {
+  (void) connfd;
+  (void) statusCode;
+}
+
+// parseRequestHeaders from httpproxy.c
+int parseRequestHeaders(char buffer[], int connfd, char method[], char resource[], char httpVer[], char host[]) {
+  sscanf(buffer, "%s /%s %s", method, resource, httpVer);
+	if (strstr(buffer, "Host: ") == NULL) {       // check is host field exists
+		send_response_fail(connfd, 400);
+    return 0;
+	}
+  // get host name if it exists
+	char* pHost = strstr(buffer, "Host: ") + 6;
+	memcpy(host, pHost, strcspn(pHost, "\r\n"));
+
+	if (strcmp(method, "GET") != 0) {             // is method valid
+		send_response_fail(connfd, 501);
+    return 0;
+	}
+	if (!valid_filename(resource)) {              // is filename/resource valid
+		send_response_fail(connfd, 400);
+    return 0;
+	}
+	if (strcmp(httpVer, "HTTP/1.1") != 0) {       // is http version valid (1.1)
+		send_response_fail(connfd, 400);
+    return 0;
+	}
+	int hostLen = strlen(host);
+	for (int i = 0; i < hostLen; ++i) {           // is host name valid
+		if (isspace(host[i])) {
+			send_response_fail(connfd, 400);
+      return 0;
+		}
+	}
+
+  return 1;
+}
+
+struct CachedFilesInfo {
+  char resourceName[20];
+  time_t lastModified;
+  char* content;
+  int contentLength;
+};
+struct CachedFilesInfo* cachedFiles;
+int numOfCachedFiles = 3, maxCachedBytes = 1024;
+
+// checkCache from httpproxy.c, without the m_cache lock the caller holds
+int checkCache(char resourceName[], struct CachedFilesInfo* copy) {
+  // loop through the cached files
+  for (int i = 0; i < numOfCachedFiles; ++i) {
+    if (strcmp(resourceName, cachedFiles[i].resourceName) == 0) {
+      copy->lastModified = cachedFiles[i].lastModified;
+      copy->contentLength = cachedFiles[i].contentLength;
+      memcpy(copy->content, cachedFiles[i].content, cachedFiles[i].contentLength);
+      return 1;
+    }
+  }
+
+  // else return 0
+  return 0;
+}
+
+struct HealthcheckInfo {
+  int entries;
+  int errors;
+  int isProblematic;
+};
+struct HealthcheckInfo* healthchecks;
+uint16_t* serverPorts;
+int numOfServerPorts = 4;
+
+// getServerPort from httpproxy.c, without the m_healthcheck lock the caller holds
+int getServerPort(int connfd) {
+  int serverIndex = 0;
+  int lowestEntries = INT_MAX;
+
+  for (int i = 0; i < numOfServerPorts; ++i) {
+    // save the current server if it has the lowest number of entries and is stable
+    if (healthchecks[i].entries < lowestEntries && healthchecks[i].isProblematic == 0) {
+      serverIndex = i;
+      lowestEntries = healthchecks[i].entries;
+    } else
+    // save the current server if it has the same number of entries, less errors, and is stable
+    if (healthchecks[i].entries == lowestEntries &&
+        healthchecks[i].errors < healthchecks[serverIndex].errors &&
+        healthchecks[i].isProblematic == 0
+    ) {
+      serverIndex = i;
+      lowestEntries = healthchecks[i].entries;
+    }
+  }
+
+  // all servers are down
+  if (lowestEntries == INT_MAX) {
+    send_response_fail(connfd, 500);
+  }
+
+  healthchecks[serverIndex].entries++;
+  return serverPorts[serverIndex];
+}
+
+/* ---------- benchmarks ---------- */
+
+const char* curlHead = "GET /r1.txt HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n";
+
+void bench_valid_filename(long operations) {
+  char names[][24] = { "r1.txt", "index_2023.html", "no/slashes", "a_name_that_is_too_long" };
+  for (long i = 0; i < operations; ++i) {
+    sink += valid_filename(names[i & 3]);
+  }
+}
+
+void bench_parse_request_headers(long operations) {
+  char buffer[256];
+  strcpy(buffer, curlHead);
+  for (long i = 0; i < operations; ++i) {
+    char method[8], resource[64], httpVer[16], host[64] = { 0 };
+    sink += parseRequestHeaders(buffer, -1, method, resource, httpVer, host);
+  }
+}
+
+void bench_http_parse_request(long operations) {
+  size_t len = strlen(curlHead);
+  struct HttpRequest request;
+  for (long i = 0; i < operations; ++i) {
+    size_t scanned = 0;
+    sink += http_parse_request(curlHead, len, &scanned, &request);
+    sink += http_find_header(&request, "Host")->len;
+  }
+}
+
+void bench_accesslog_hex(long operations) {
+  unsigned char bytes[LOG_BODY_BYTES];
+  char out[2 * LOG_BODY_BYTES];
+  for (size_t i = 0; i < sizeof bytes; ++i) {
+    bytes[i] = i * 7;
+  }
+  for (long i = 0; i < operations; ++i) {
+    sink += accesslog_hex(out, bytes, sizeof bytes);
+  }
+}
+
+void bench_http_parse_date(long operations) {
+  const char* text = "Tue, 14 Nov 2023 08:12:31 GMT";
+  struct HttpSlice value = { text, strlen(text) };
+  for (long i = 0; i < operations; ++i) {
+    time_t date;
+    sink += http_parse_date(value, &date) + date;
+  }
+}
+
+void bench_http_format_date(long operations) {
+  char date[HTTP_DATE_SIZE];
+  for (long i = 0; i < operations; ++i) {
+    sink += http_format_date(1699949551 + (i & 1023), date);
+  }
+}
+
+// the resource is the last of the cached files, so every entry is compared
+void bench_check_cache_hit(long operations) {
+  char content[1024];
+  struct CachedFilesInfo copy = { .content = content };
+  char resourceName[20];
+  strcpy(resourceName, cachedFiles[numOfCachedFiles - 1].resourceName);
+  for (long i = 0; i < operations; ++i) {
+    sink += checkCache(resourceName, &copy);
+  }
+}
+
+void bench_check_cache_miss(long operations) {
+  char content[1024];
+  struct CachedFilesInfo copy = { .content = content };
+  char resourceName[20] = "notcached.txt";
+  for (long i = 0; i < operations; ++i) {
+    sink += checkCache(resourceName, &copy);
+  }
+}
+
+void bench_get_server_port(long operations) {
+  for (long i = 0; i < operations; ++i) {
+    sink += getServerPort(-1);
+  }
+}
+
+struct Benchmark {
+  const char* name;
+  void (*run)(long operations);
+};
+
+struct Benchmark benchmarks[] = {
+  { "valid_filename", bench_valid_filename },
+  { "parseRequestHeaders", bench_parse_request_headers },
+  { "http_parse_request", bench_http_parse_request },
+  { "accesslog_hex/1000", bench_accesslog_hex },
+  { "http_parse_date", bench_http_parse_date },
+  { "http_format_date", bench_http_format_date },
+  { "checkCache/hit", bench_check_cache_hit },
+  { "checkCache/miss", bench_check_cache_miss },
+  { "getServerPort", bench_get_server_port },
+};
+#define NUM_OF_BENCHMARKS ((int) (sizeof benchmarks / sizeof benchmarks[0]))
+
+/* ---------- harness ---------- */
+
+int cyclesFd = -1;   // hardware cycle counter, or -1 for the time stamp counter
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// opens a counter of the cycles this thread spends in user space, if the kernel lets us
+void open_cycle_counter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof attr;
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  cyclesFd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t read_cycles() {
+  if (cyclesFd >= 0) {
+    uint64_t count;
+    if (read(cyclesFd, &count, sizeof count) == sizeof count)
+      return count;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+void run_benchmark(struct Benchmark* benchmark, int numOfSamples, double sampleSeconds) {
+  // double the operations until a run takes long enough to time
+  long operations = 1;
+  while (1) {
+    double start = now_seconds();
+    benchmark->run(operations);
+    if (now_seconds() - start >= sampleSeconds / 4 || operations > (1l << 40))
+      break;
+    operations *= 2;
+  }
+  operations *= 4;
+
+  // warm up caches and branch predictors, and let the clock speed settle
+  benchmark->run(operations);
+
+  double ns[MAX_SAMPLES], cycles[MAX_SAMPLES];
+  for (int i = 0; i < numOfSamples; ++i) {
+    uint64_t startCycles = read_cycles();
+    double start = now_seconds();
+    benchmark->run(operations);
+    double elapsed = now_seconds() - start;
+    ns[i] = elapsed * 1e9 / operations;
+    cycles[i] = (double) (read_cycles() - startCycles) / operations;
+  }
+
+  double mean = 0, variance = 0;
+  for (int i = 0; i < numOfSamples; ++i)
+    mean += ns[i] / numOfSamples;
+  for (int i = 0; i < numOfSamples; ++i)
+    variance += (ns[i] - mean) * (ns[i] - mean) / numOfSamples;
+  qsort(ns, numOfSamples, sizeof ns[0], compare_doubles);
+  qsort(cycles, numOfSamples, sizeof cycles[0], compare_doubles);
+
+  printf("%-20s %12ld %10.1f %10.1f %7.1f%% %10.1f\n",
+      benchmark->name,
+      operations,
+      ns[numOfSamples / 2],
+      ns[0],
+      mean > 0 ? 100 * sqrt(variance) / mean : 0.0,
+      cycles[numOfSamples / 2]
+  );
+}
+
+int main(int argc, char* argv[]) {
+  int numOfSamples = 10;
+  double sampleSeconds = 0.05;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+    switch (opt) {
+      case 's':
+        numOfSamples = atoi(optarg);
+        break;
+      case 't':
+        sampleSeconds = atof(optarg) / 1000;
+        break;
+      default:
+        errx(EXIT_FAILURE, "usage: %s [-s samples] [-t ms per sample] [benchmark name ...]", argv[0]);
+    }
+  }
+  if (numOfSamples <= 0 || numOfSamples > MAX_SAMPLES) {
+    errx(EXIT_FAILURE, "samples have to be between 1 and %d", MAX_SAMPLES);
+  }
+  if (sampleSeconds <= 0) {
+    errx(EXIT_FAILURE, "samples have to take a positive number of milliseconds");
+  }
+
+  // the proxy's defaults: 3 cached files of up to 1024 bytes, here behind 4 healthy servers
+  static char contents[3][1024];
+  static struct CachedFilesInfo files[3] = {
+    { "r1.txt", 1699949551, contents[0], 1024 },
+    { "index.html", 1699949551, contents[1], 512 },
+    { "small.txt", 1699949551, contents[2], 64 },
+  };
+  cachedFiles = files;
+  static struct HealthcheckInfo servers[4];
+  static uint16_t ports[4] = { 8081, 8082, 8083, 8084 };
+  healthchecks = servers;
+  serverPorts = ports;
+
+  open_cycle_counter();
+  printf("%d samples of about %.0f ms each, per operation on one core\n", numOfSamples, sampleSeconds * 1000);
+  printf("%-20s %12s %10s %10s %8s %10s\n", "benchmark", "ops/sample", "median ns", "min ns", "stddev", cyclesFd >= 0 ? "cycles" : "ref cycles");
+  for (int i = 0; i < NUM_OF_BENCHMARKS; ++i) {
+    int selected = optind == argc;
+    for (int j = optind; j < argc; ++j) {
+      if (strstr(benchmarks[i].name, argv[j]) != NULL)
+        selected = 1;
+    }
+    if (selected)
+      run_benchmark(&benchmarks[i], numOfSamples, sampleSeconds);
+  }
+
+  if (cyclesFd >= 0)
+    close(cyclesFd);
+  return EXIT_SUCCESS;
+}
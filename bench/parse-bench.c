@@ -0,0 +1,124 @@
+/*
+  Microbenchmark for the request parser in httpparse.c.
+
+  Parses a few typical request heads over and over on one thread and
+  reports requests per second per core. "whole" hands the parser the
+  complete head, "split" delivers it in two halves the way a head cut
+  across TCP segments arrives, and "legacy" is the strstr scan the
+  handlers used before, which only found the head, file name, Host and
+  Content-Length.
+
+  usage: ./parse-bench [-o operations per run]
+*/
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../httpparse.h"
+
+const char* names[] = { "minimal", "curl", "browser", "put" };
+const char* heads[] = {
+  "GET /r1.txt HTTP/1.1\r\nHost: localhost:8080\r\n\r\n",
+
+  "GET /r1.txt HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n",
+
+  "GET /index HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "Connection: keep-alive\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: en-US,en;q=0.9\r\n"
+  "If-Modified-Since: Tue, 14 Nov 2023 08:12:31 GMT\r\n\r\n",
+
+  "PUT /upload.bin HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n"
+  "Content-Length: 1048576\r\nExpect: 100-continue\r\n\r\n",
+};
+#define NUM_OF_HEADS ((int) (sizeof heads / sizeof heads[0]))
+
+// keeps the compiler from optimizing the parsing away
+volatile size_t sink;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the head scanning httpserver.c did before the parser
+size_t legacy_parse(char* buffer) {
+  char* end = strstr(buffer, "\r\n\r\n");
+  char* pFileName = strchr(buffer, '/') + 1;
+  char* pHost = strstr(buffer, "Host:");
+  char* pContentLength = strstr(buffer, "Content-Length:");
+  size_t result = (end - buffer) + strcspn(pFileName, " ") + strcspn(pHost + 16, "\r\n");
+  if (pContentLength != NULL)
+    result += atoll(pContentLength + 16);
+  return result;
+}
+
+double run_legacy(const char* head, long operations) {
+  char buffer[1024];
+  strcpy(buffer, head);
+
+  double start = now_seconds();
+  for (long i = 0; i < operations; ++i) {
+    sink += legacy_parse(buffer);
+  }
+  return operations / (now_seconds() - start);
+}
+
+double run_parser(const char* head, long operations, int split) {
+  size_t len = strlen(head);
+  struct HttpRequest request;
+
+  double start = now_seconds();
+  for (long i = 0; i < operations; ++i) {
+    size_t scanned = 0;
+    if (split && http_parse_request(head, len / 2, &scanned, &request) != HTTP_PARSE_INCOMPLETE) {
+      errx(EXIT_FAILURE, "half a head parsed as complete");
+    }
+    if (http_parse_request(head, len, &scanned, &request) < 0) {
+      errx(EXIT_FAILURE, "benchmark head failed to parse");
+    }
+    const struct HttpSlice* host = http_find_header(&request, "Host");
+    const struct HttpSlice* contentLength = http_find_header(&request, "Content-Length");
+    sink += request.headLen + request.target.len + host->len + (contentLength != NULL ? contentLength->len : 0);
+  }
+  return operations / (now_seconds() - start);
+}
+
+int main(int argc, char* argv[]) {
+  long operations = 2000000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+      case 'o':
+        operations = atol(optarg);
+        break;
+      default:
+        errx(EXIT_FAILURE, "usage: %s [-o operations]", argv[0]);
+    }
+  }
+  if (operations <= 0) {
+    errx(EXIT_FAILURE, "operations have to be positive");
+  }
+
+  printf("%ld operations per run, requests/s on one core\n", operations);
+  printf("%-10s %6s %14s %14s %14s\n", "head", "bytes", "legacy", "whole", "split");
+  for (int i = 0; i < NUM_OF_HEADS; ++i) {
+    double legacyRate = run_legacy(heads[i], operations);
+    double wholeRate = run_parser(heads[i], operations, 0);
+    double splitRate = run_parser(heads[i], operations, 1);
+    printf("%-10s %6zu %14.0f %14.0f %14.0f\n", names[i], strlen(heads[i]), legacyRate, wholeRate, splitRate);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/*
+  Contention benchmark for the connection queue.
+
+  Compares the original connQueue (array shifted on every pop under a
+  mutex, producer spinning while full, broadcast wakeups) against the
+  ticket ring in connqueue.c. Producers push connfd-sized items and
+  1-64 consumer threads pop them, like the accept loop feeding workers.
+
+  usage: ./queue-bench [-p producers] [-o operations per run]
+*/
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../connqueue.h"
+
+#define QUEUE_SIZE 512
+#define MAX_THREADS 64
+
+/* ---------- original queue from httpserver.c ---------- */
+
+pthread_mutex_t m_queue = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t c_gotRequest = PTHREAD_COND_INITIALIZER;
+int legacyQueue[QUEUE_SIZE];
+volatile int legacyQueueCount = 0;
+
+void legacy_push(int connfd) {
+  // wait if queue is full
+  while (legacyQueueCount == QUEUE_SIZE) {  }
+
+  pthread_mutex_lock(&m_queue);
+  // the original only checked outside the lock, which overflows with
+  // several producers, so recheck here to keep the benchmark honest
+  while (legacyQueueCount == QUEUE_SIZE) {
+    pthread_mutex_unlock(&m_queue);
+    pthread_mutex_lock(&m_queue);
+  }
+  legacyQueue[legacyQueueCount] = connfd;
+  legacyQueueCount++;
+  pthread_mutex_unlock(&m_queue);
+
+  pthread_cond_broadcast(&c_gotRequest);
+}
+
+int legacy_pop() {
+  pthread_mutex_lock(&m_queue);
+  while (legacyQueueCount == 0) {
+    pthread_cond_wait(&c_gotRequest, &m_queue);
+  }
+  int connfd = legacyQueue[0];
+  for (int i = 0; i < legacyQueueCount-1; ++i) {
+    legacyQueue[i] = legacyQueue[i+1];
+  }
+  legacyQueueCount--;
+  pthread_mutex_unlock(&m_queue);
+  return connfd;
+}
+
+/* ---------- ticket ring ---------- */
+
+struct ConnQueue ring;
+
+void ring_push(int connfd) {
+  connqueue_push(&ring, connfd);
+}
+
+int ring_pop() {
+  return connqueue_pop(&ring);
+}
+
+/* ---------- harness ---------- */
+
+struct BenchQueue {
+  const char* name;
+  void (*push)(int connfd);
+  int (*pop)();
+};
+
+struct ProducerArgs {
+  struct BenchQueue* queue;
+  long operations;
+};
+
+void* t_producer(void* arg) {
+  struct ProducerArgs* args = arg;
+  for (long i = 0; i < args->operations; ++i) {
+    args->queue->push(i & 0xffff);
+  }
+  return NULL;
+}
+
+void* t_consumer(void* arg) {
+  struct BenchQueue* queue = arg;
+  // -1 tells a consumer to stop
+  while (queue->pop() != -1) { }
+  return NULL;
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// returns operations per second
+double run(struct BenchQueue* queue, int numOfProducers, int numOfConsumers, long operations) {
+  pthread_t producers[numOfProducers];
+  pthread_t consumers[numOfConsumers];
+  struct ProducerArgs args = { queue, operations / numOfProducers };
+
+  double start = now_seconds();
+  for (int i = 0; i < numOfConsumers; ++i) {
+    pthread_create(&consumers[i], NULL, &t_consumer, queue);
+  }
+  for (int i = 0; i < numOfProducers; ++i) {
+    pthread_create(&producers[i], NULL, &t_producer, &args);
+  }
+  for (int i = 0; i < numOfProducers; ++i) {
+    pthread_join(producers[i], NULL);
+  }
+  for (int i = 0; i < numOfConsumers; ++i) {
+    queue->push(-1);
+  }
+  for (int i = 0; i < numOfConsumers; ++i) {
+    pthread_join(consumers[i], NULL);
+  }
+  double elapsed = now_seconds() - start;
+
+  return args.operations * numOfProducers / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+  int numOfProducers = 1;
+  long operations = 200000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:o:")) != -1) {
+    switch (opt) {
+      case 'p':
+        numOfProducers = atoi(optarg);
+        break;
+      case 'o':
+        operations = atol(optarg);
+        break;
+      default:
+        errx(EXIT_FAILURE, "usage: %s [-p producers] [-o operations]", argv[0]);
+    }
+  }
+  if (numOfProducers <= 0 || operations <= 0) {
+    errx(EXIT_FAILURE, "producers and operations have to be positive");
+  }
+
+  connqueue_init(&ring, QUEUE_SIZE);
+  struct BenchQueue legacy = { "legacy", &legacy_push, &legacy_pop };
+  struct BenchQueue ticket = { "ticket ring", &ring_push, &ring_pop };
+
+  printf("%d producer(s), %ld operations per run, %ld cpus\n",
+      numOfProducers, operations, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%-10s %16s %16s %10s\n", "consumers", "legacy ops/s", "ring ops/s", "speedup");
+  for (int consumers = 1; consumers <= MAX_THREADS; consumers *= 2) {
+    double legacyRate = run(&legacy, numOfProducers, consumers, operations);
+    double ringRate = run(&ticket, numOfProducers, consumers, operations);
+    printf("%-10d %16.0f %16.0f %9.2fx\n", consumers, legacyRate, ringRate, ringRate / legacyRate);
+  }
+
+  connqueue_destroy(&ring);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Connection rate of httpserver and httpproxy with a single accept loop
+# in main feeding connQueue, against -p, where every worker accepts on a
+# SO_REUSEPORT listener of its own. Every request opens a new connection.
+#
+# usage: bench/reuseport-bench.sh [seconds per run] [connections]   (from the repository root)
+
+seconds=${1:-3}
+connections=${2:-64}
+root=$(pwd)
+make -s httpserver httpproxy load-bench || exit 1
+
+dir=$(mktemp -d)
+pids=
+trap 'kill $pids 2>/dev/null; rm -rf "$dir"' EXIT
+head -c 1024 /dev/urandom > "$dir/small.txt"
+
+# valid_host rejects ports above 32767
+base=$((20000 + RANDOM % 10000))
+
+# connections cut off at the end of a run make the servers complain
+start () {
+	(cd "$dir" && exec "$@" 2>/dev/null) &
+	pids="$pids $!"
+	sleep 0.3
+}
+
+stop () {
+	kill $pids 2>/dev/null
+	wait $pids 2>/dev/null
+	pids=
+}
+
+measure () {
+	printf "%-22s" "$1"
+	bench/load-bench -p $2 -f small.txt -c $connections -d $seconds -x
+}
+
+start "$root/httpserver" -n 8 -r 1000000 $base
+measure "httpserver" $base
+stop
+start "$root/httpserver" -n 8 -r 1000000 -p $((base + 1))
+measure "httpserver -p" $((base + 1))
+stop
+
+# the proxy's healthchecks need the server to keep a log
+start "$root/httpserver" -n 8 -r 1000000 -l log2 $((base + 2))
+start "$root/httpproxy" -N 8 -R 1000 $((base + 3)) $((base + 2))
+measure "httpproxy" $((base + 3))
+stop
+start "$root/httpserver" -n 8 -r 1000000 -l log4 $((base + 4))
+start "$root/httpproxy" -N 8 -R 1000 -p $((base + 5)) $((base + 4))
+measure "httpproxy -p" $((base + 5))
+stop
+exit 0
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Compares the server's connection engines on the same workloads: the
+# plain thread pool fed by main's accept loop, the epoll event loop (-e)
+# and the io_uring event loop (-u). Small files are served over kept-alive
+# connections and over a new connection per request, large files over
+# kept-alive connections.
+#
+# usage: bench/uring-bench.sh [seconds per run]   (from the repository root)
+
+seconds=${1:-3}
+root=$(pwd)
+make -s httpserver load-bench || exit 1
+
+dir=$(mktemp -d)
+trap '[ -n "$server" ] && kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+head -c 1024 /dev/urandom > "$dir/small.txt"
+head -c $((8 << 20)) /dev/urandom > "$dir/large.bin"
+
+run () {
+	local name=$1 flags=$2
+	# valid_host rejects ports above 32767
+	local port=$((20000 + RANDOM % 10000))
+	(cd "$dir" && exec "$root/httpserver" -n 8 -r 1000000 $flags $port) &
+	server=$!
+	sleep 0.3
+	printf "%-10s small, keep-alive  " "$name"
+	bench/load-bench -p $port -f small.txt -c 32 -d $seconds
+	printf "%-10s small, new conn    " "$name"
+	bench/load-bench -p $port -f small.txt -c 32 -d $seconds -x
+	printf "%-10s large, keep-alive  " "$name"
+	bench/load-bench -p $port -f large.bin -c 8 -d $seconds
+	kill $server
+	wait $server 2>/dev/null
+	server=
+}
+
+run "threads" ""
+run "epoll" "-e 1"
+run "io_uring" "-u"
+exit 0
@@ -0,0 +1,102 @@
+#include <err.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "connqueue.h"
+
+void connqueue_init(struct ConnQueue* queue, size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  queue->slots = malloc(size * sizeof *queue->slots);
+  if (queue->slots == NULL) {
+    err(EXIT_FAILURE, "cannot allocate connection queue");
+  }
+  queue->mask = size - 1;
+
+  // slot i is first written by ticket i
+  for (size_t i = 0; i < size; ++i) {
+    atomic_init(&queue->slots[i].sequence, i);
+  }
+  atomic_init(&queue->pushTicket, 0);
+  atomic_init(&queue->popTicket, 0);
+
+  sem_init(&queue->items, 0, 0);
+  sem_init(&queue->spaces, 0, size);
+}
+
+void connqueue_destroy(struct ConnQueue* queue) {
+  sem_destroy(&queue->items);
+  sem_destroy(&queue->spaces);
+  free(queue->slots);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// sem_wait that doesn't give up on signals
+static void sem_wait_nointr(sem_t* sem) {
+  while (sem_wait(sem) < 0 && errno == EINTR) { }
+}
+
+/*
+  Waits until the slot is ready for the given ticket. The semaphores
+  already guarantee there is a slot for us, so this only waits when the
+  thread holding the previous ticket for the slot hasn't finished with it.
+*/
+static void wait_for_slot(struct ConnQueueSlot* slot, size_t ticket) {
+  while (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ticket) {
+    sched_yield();
+  }
+}
+
+void connqueue_push(struct ConnQueue* queue, int connfd) {
+  sem_wait_nointr(&queue->spaces);
+
+  size_t ticket = atomic_fetch_add_explicit(&queue->pushTicket, 1, memory_order_relaxed);
+  struct ConnQueueSlot* slot = &queue->slots[ticket & queue->mask];
+  wait_for_slot(slot, ticket);
+
+  slot->connfd = connfd;
+  slot->pushedNs = now_ns();
+  // hand the slot to the consumer holding this ticket
+  atomic_store_explicit(&slot->sequence, ticket + 1, memory_order_release);
+
+  sem_post(&queue->items);
+}
+
+int connqueue_pop(struct ConnQueue* queue) {
+  uint64_t queuedNs;
+  return connqueue_pop_timed(queue, &queuedNs);
+}
+
+int connqueue_pop_timed(struct ConnQueue* queue, uint64_t* queuedNs) {
+  sem_wait_nointr(&queue->items);
+
+  size_t ticket = atomic_fetch_add_explicit(&queue->popTicket, 1, memory_order_relaxed);
+  struct ConnQueueSlot* slot = &queue->slots[ticket & queue->mask];
+  wait_for_slot(slot, ticket + 1);
+
+  int connfd = slot->connfd;
+  uint64_t pushedNs = slot->pushedNs;
+  // hand the slot to the producer one lap ahead
+  atomic_store_explicit(&slot->sequence, ticket + queue->mask + 1, memory_order_release);
+
+  sem_post(&queue->spaces);
+  uint64_t poppedNs = now_ns();
+  *queuedNs = poppedNs > pushedNs ? poppedNs - pushedNs : 0;
+  return connfd;
+}
+
+int connqueue_depth(struct ConnQueue* queue) {
+  int depth;
+  sem_getvalue(&queue->items, &depth);
+  return depth;
+}
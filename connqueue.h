@@ -0,0 +1,49 @@
+#ifndef CONNQUEUE_H
+#define CONNQUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <semaphore.h>
+
+/**
+   Bounded multi-producer/multi-consumer queue of connfds.
+   Producers and consumers take tickets with a single atomic increment, so
+   push and pop are O(1) and never hold a lock. Waiting for room or for a
+   connection sleeps on a semaphore, and each push/pop wakes at most one
+   waiter.
+ */
+struct ConnQueueSlot {
+  atomic_size_t sequence;   // ticket the slot is waiting for
+  int connfd;
+  uint64_t pushedNs;        // CLOCK_MONOTONIC time the connfd was pushed
+};
+
+struct ConnQueue {
+  struct ConnQueueSlot* slots;
+  size_t mask;              // capacity - 1, capacity is a power of two
+  sem_t items;              // connfds ready to be popped
+  sem_t spaces;             // free slots left to push into
+
+  // kept on separate cache lines so producers and consumers don't share one
+  _Alignas(64) atomic_size_t pushTicket;
+  _Alignas(64) atomic_size_t popTicket;
+};
+
+// capacity is rounded up to a power of two
+void connqueue_init(struct ConnQueue* queue, size_t capacity);
+void connqueue_destroy(struct ConnQueue* queue);
+
+// blocks while the queue is full
+void connqueue_push(struct ConnQueue* queue, int connfd);
+
+// blocks while the queue is empty
+int connqueue_pop(struct ConnQueue* queue);
+
+// connqueue_pop that also sets *queuedNs to how long the connfd waited in the queue
+int connqueue_pop_timed(struct ConnQueue* queue, uint64_t* queuedNs);
+
+// number of connfds currently waiting in the queue
+int connqueue_depth(struct ConnQueue* queue);
+
+#endif
@@ -0,0 +1,754 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "eventloop.h"
+#include "httpparse.h"
+#include "metrics.h"
+#include "uring.h"
+
+#define MAX_EVENTS 256
+#define RING_ENTRIES 256        // submissions an io_uring loop can queue before it has to submit
+#define RING_BUFFERS 64         // registered buffers of a loop, one per response it is sending
+#define RING_BUFFER_SIZE (64 << 10) // head and body of a response a loop sends itself
+
+/*
+  Completions a loop can have outstanding, the most the kernel allows. A
+  loop has a recv pending on every connection waiting for a request,
+  which is meant to be tens of thousands of them, and at most a read and
+  a send on each of RING_BUFFERS others. Completions that don't fit wait
+  on the kernel's overflow list rather than being lost, but slow every
+  pass down while they do.
+*/
+#define RING_CQ_ENTRIES 65536
+
+// user_data of the io_uring requests that don't belong to a connection.
+// Requests on a connection use the address of its struct Connection,
+// with what they do in the low bits
+#define ACCEPT_TAG 1
+#define WAKE_TAG 2
+#define OP_RECV 0
+#define OP_READ 1
+#define OP_SEND 2
+#define OP_MASK 3
+
+// each ring is only ever used by its own loop thread, which lets the kernel
+// skip locking and run completion work when the loop waits rather than
+// interrupting it. Multishot accept needs 5.19, so kernels older than these
+// flags (6.1) fall back to epoll
+#define URING_FLAGS (IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL)
+
+// states a connection moves through while it is owned by the event loops
+enum ConnState {
+  CONN_READING,     // waiting for the rest of the request head
+  CONN_DISPATCHED,  // handed off to a worker thread
+  CONN_SENDING,     // answering a request on the loop's ring
+  CONN_CLOSING      // timed out, closed once its pending io_uring recv completes
+};
+
+struct EventLoop;
+
+struct Connection {
+  int fd;
+  enum ConnState state;
+  struct ReadBuffer buffer;
+  int requestsServed;         // requests already answered on this connection
+  struct EventLoop* loop;     // loop the connection belongs to
+  time_t lastActive;          // when the connection last made progress
+  struct Connection* prev;    // idle list links, only touched by the owning loop
+  struct Connection* next;
+  struct Connection* nextResumed;
+  int ringBuffer;             // registered buffer a response is sent from, -1 if none
+  struct RingResponse response;   // the response being sent on the ring
+  size_t responseSent;        // bytes of it that went out so far
+};
+
+// connection state indexed by fd, sized to the fd limit
+struct Connection** connections;
+int maxConnections = 0;
+
+struct EventLoop {
+  int epollfd;
+  int listenfd;
+  int idleTimeout;
+  void (*dispatch)(int connfd);
+
+  // connections waiting for a request, oldest first
+  struct Connection* idleHead;
+  struct Connection* idleTail;
+
+  // connections handed back by workers, picked up when wakefd fires
+  int wakefd;
+  pthread_mutex_t m_resumed;
+  struct Connection* resumed;
+
+  // io_uring backend, used instead of epoll when useUring is set
+  int useUring;
+  struct Uring ring;
+  uint64_t wakeCount;   // read from wakefd by the ring
+
+  // answering requests on the ring, NULL if they all go to workers
+  const struct RingHandlers* ringHandlers;
+  char* ringBuffers;    // RING_BUFFERS registered buffers of RING_BUFFER_SIZE bytes
+  int freeBuffers[RING_BUFFERS];
+  int numOfFreeBuffers;
+};
+
+/*
+  Raises the open file limit as far as the hard limit allows so that
+  idle connections are only bounded by memory
+*/
+static int raise_fd_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    err(EXIT_FAILURE, "getrlimit error");
+  }
+  limit.rlim_cur = limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    warn("cannot raise the open file limit");
+    getrlimit(RLIMIT_NOFILE, &limit);
+  }
+  return limit.rlim_cur;
+}
+
+static time_t now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static void set_nonblocking(int fd, int nonblocking) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (nonblocking)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+  fcntl(fd, F_SETFL, flags);
+}
+
+/*
+  The idle list holds every connection the loop is waiting on. Every
+  connection gets the same timeout, so appending on activity keeps the
+  list sorted by lastActive and expiring only ever looks at the head.
+*/
+static void idle_append(struct EventLoop* loop, struct Connection* conn) {
+  conn->lastActive = now_seconds();
+  conn->next = NULL;
+  conn->prev = loop->idleTail;
+  if (loop->idleTail != NULL)
+    loop->idleTail->next = conn;
+  else
+    loop->idleHead = conn;
+  loop->idleTail = conn;
+}
+
+static void idle_remove(struct EventLoop* loop, struct Connection* conn) {
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else
+    loop->idleHead = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+  else
+    loop->idleTail = conn->prev;
+  conn->prev = conn->next = NULL;
+}
+
+// closes a connection the loop is still waiting on
+static void drop_connection(struct EventLoop* loop, struct Connection* conn) {
+  idle_remove(loop, conn);
+  close_connection(conn->fd);
+}
+
+// closes connections that have waited longer than the idle timeout
+static void expire_idle(struct EventLoop* loop) {
+  time_t deadline = now_seconds() - loop->idleTimeout;
+  while (loop->idleHead != NULL && loop->idleHead->lastActive <= deadline) {
+    struct Connection* conn = loop->idleHead;
+    if (!loop->useUring) {
+      drop_connection(loop, conn);
+      continue;
+    }
+
+    // the ring still has a recv pending on the fd, so it can't be closed
+    // yet. Shutting it down completes the recv, which then closes it
+    idle_remove(loop, conn);
+    conn->state = CONN_CLOSING;
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+}
+
+// returns a free sqe of the loop's ring
+static struct io_uring_sqe* get_sqe(struct EventLoop* loop) {
+  struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+  if (sqe == NULL) {
+    err(EXIT_FAILURE, "cannot submit to io_uring");
+  }
+  return sqe;
+}
+
+// queues a recv of whatever fits in the connection's buffer
+static void queue_recv(struct EventLoop* loop, struct Connection* conn) {
+  struct ReadBuffer* buffer = &conn->buffer;
+  size_t space = readbuf_reserve(buffer);
+  struct io_uring_sqe* sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->addr = (unsigned long) (buffer->data + buffer->len);
+  sqe->len = space;
+  sqe->user_data = (unsigned long) conn;
+}
+
+// queues an accept that keeps producing a completion per new connection
+static void queue_accept(struct EventLoop* loop) {
+  struct io_uring_sqe* sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = ACCEPT_TAG;
+}
+
+static void queue_wake(struct EventLoop* loop) {
+  struct io_uring_sqe* sqe = get_sqe(loop);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = loop->wakefd;
+  sqe->addr = (unsigned long) &loop->wakeCount;
+  sqe->len = sizeof loop->wakeCount;
+  sqe->user_data = WAKE_TAG;
+}
+
+static char* ring_buffer(struct EventLoop* loop, int index) {
+  return loop->ringBuffers + (size_t) index * RING_BUFFER_SIZE;
+}
+
+// queues a send of whatever is left of the response from its registered buffer
+static void queue_send(struct EventLoop* loop, struct Connection* conn) {
+  struct RingResponse* response = &conn->response;
+  struct io_uring_sqe* sqe = get_sqe(loop);
+  // a write to a socket is a send without flags, and unlike SEND it can
+  // use a registered buffer on any kernel with io_uring
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = conn->fd;
+  sqe->addr = (unsigned long) (ring_buffer(loop, conn->ringBuffer) + conn->responseSent);
+  sqe->len = response->headLen + response->bodyLen - conn->responseSent;
+  sqe->buf_index = conn->ringBuffer;
+  sqe->user_data = (unsigned long) conn | OP_SEND;
+}
+
+/*
+  Answers the request at the start of the connection's buffer on the
+  ring, if the server takes it: the file is read into a registered buffer
+  behind the head, and a send of both is linked to the read so it only
+  starts once the read is done. Returns 0 if a worker has to answer it.
+*/
+static int serve_on_ring(struct EventLoop* loop, struct Connection* conn) {
+  if (loop->ringHandlers == NULL || loop->numOfFreeBuffers == 0) {
+    return 0;
+  }
+  int index = loop->freeBuffers[loop->numOfFreeBuffers - 1];
+  char* out = ring_buffer(loop, index);
+  struct RingResponse* response = &conn->response;
+  if (!loop->ringHandlers->prepare(conn->fd, &conn->buffer, conn->requestsServed, out, RING_BUFFER_SIZE, response)) {
+    return 0;
+  }
+  loop->numOfFreeBuffers--;
+  conn->ringBuffer = index;
+  conn->responseSent = 0;
+  conn->state = CONN_SENDING;
+
+  // both have to go out in one submission, or the chain would end at the read
+  if (uring_make_room(&loop->ring, 2) < 0) {
+    err(EXIT_FAILURE, "cannot submit to io_uring");
+  }
+
+  // a read that fills the body posts no completion. One that comes up
+  // short or fails posts one and cancels the send, which then posts none
+  if (response->bodyLen > 0) {
+    struct io_uring_sqe* sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = response->fd;
+    sqe->addr = (unsigned long) (out + response->headLen);
+    sqe->len = response->bodyLen;
+    sqe->off = 0;
+    sqe->buf_index = index;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = (unsigned long) conn | OP_READ;
+  }
+  queue_send(loop, conn);
+  return 1;
+}
+
+// (re)arms a connection for a single readable event
+static void watch_connection(struct EventLoop* loop, struct Connection* conn, int op) {
+  if (loop->useUring) {
+    queue_recv(loop, conn);
+    return;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof event);
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  event.data.fd = conn->fd;
+  if (epoll_ctl(loop->epollfd, op, conn->fd, &event) < 0) {
+    warn("epoll_ctl error");
+    drop_connection(loop, conn);
+  }
+}
+
+// starts waiting for the first request on a newly accepted connection
+static void add_connection(struct EventLoop* loop, int connfd) {
+  if (connfd >= maxConnections) {
+    warnx("too many connections, dropping fd %d", connfd);
+    close(connfd);
+    return;
+  }
+
+  struct Connection* conn = malloc(sizeof *conn);
+  conn->fd = connfd;
+  conn->state = CONN_READING;
+  readbuf_init(&conn->buffer);
+  conn->requestsServed = 0;
+  conn->loop = loop;
+  conn->ringBuffer = -1;
+  connections[connfd] = conn;
+
+  idle_append(loop, conn);
+  watch_connection(loop, conn, EPOLL_CTL_ADD);
+}
+
+// accepts every pending connection on the listening socket
+static void accept_connections(struct EventLoop* loop) {
+  while (1) {
+    int connfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK);
+    if (connfd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        warn("accept error");
+      return;
+    }
+
+    // send responses right away rather than after the client ACKs the previous one
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    add_connection(loop, connfd);
+  }
+}
+
+/*
+  Hands the connection off once its request head is complete, or waits
+  for more of it. Heads that can't fit are handed off too, so the worker
+  can reject them.
+*/
+static void dispatch_or_wait(struct EventLoop* loop, struct Connection* conn) {
+  struct ReadBuffer* buffer = &conn->buffer;
+  if (http_head_length(buffer->data, buffer->len, &buffer->scanned) == HTTP_PARSE_INCOMPLETE
+      && buffer->len < HTTP_MAX_HEAD_SIZE) {
+    idle_remove(loop, conn);
+    idle_append(loop, conn);
+    watch_connection(loop, conn, EPOLL_CTL_MOD);
+    return;
+  }
+
+  idle_remove(loop, conn);
+  if (loop->useUring && serve_on_ring(loop, conn)) {
+    return;
+  }
+
+  // the handlers expect a blocking socket, which is all the ring ever uses
+  conn->state = CONN_DISPATCHED;
+  if (!loop->useUring) {
+    set_nonblocking(conn->fd, 0);
+  }
+  loop->dispatch(conn->fd);
+}
+
+// reads whatever is available and hands the connection off once the head is complete
+static void read_connection(struct EventLoop* loop, struct Connection* conn) {
+  struct ReadBuffer* buffer = &conn->buffer;
+  while (1) {
+    size_t space = readbuf_reserve(buffer);
+    if (space == 0)
+      break;
+    int bytesRead = recv(conn->fd, buffer->data + buffer->len, space, 0);
+    if (bytesRead < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      drop_connection(loop, conn);
+      return;
+    }
+
+    // a client that is done sending may still be waiting for the answer
+    // to a request it finished. Otherwise it hung up before finishing one
+    if (bytesRead == 0) {
+      if (http_head_length(buffer->data, buffer->len, &buffer->scanned) == HTTP_PARSE_INCOMPLETE) {
+        drop_connection(loop, conn);
+        return;
+      }
+      break;
+    }
+    buffer->len += bytesRead;
+    metrics_bytes_in(bytesRead);
+  }
+
+  dispatch_or_wait(loop, conn);
+}
+
+// starts waiting again on the connections workers have handed back
+static void take_resumed(struct EventLoop* loop) {
+  // START CRITICAL REGION
+  pthread_mutex_lock(&loop->m_resumed);
+  struct Connection* conn = loop->resumed;
+  loop->resumed = NULL;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&loop->m_resumed);
+
+  while (conn != NULL) {
+    struct Connection* next = conn->nextResumed;
+    conn->state = CONN_READING;
+    if (!loop->useUring) {
+      set_nonblocking(conn->fd, 1);
+    }
+    idle_append(loop, conn);
+    watch_connection(loop, conn, EPOLL_CTL_MOD);
+    conn = next;
+  }
+}
+
+// event loop thread function
+static void* t_event_loop(void* arg) {
+  struct EventLoop* loop = arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (1) {
+    // wake up at least once a second to expire idle connections
+    int numOfEvents = epoll_wait(loop->epollfd, events, MAX_EVENTS, 1000);
+    if (numOfEvents < 0) {
+      if (errno != EINTR)
+        warn("epoll_wait error");
+      continue;
+    }
+
+    for (int i = 0; i < numOfEvents; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == loop->listenfd) {
+        accept_connections(loop);
+      } else if (fd == loop->wakefd) {
+        uint64_t count;
+        if (read(loop->wakefd, &count, sizeof count) < 0 && errno != EAGAIN) {
+          warn("eventfd read error");
+        }
+        take_resumed(loop);
+      } else if (connections[fd] != NULL && connections[fd]->state == CONN_READING) {
+        read_connection(loop, connections[fd]);
+      }
+    }
+    expire_idle(loop);
+  }
+  return NULL;
+}
+
+// a recv on conn completed with res, the number of bytes read or -errno
+static void recv_completed(struct EventLoop* loop, struct Connection* conn, int res) {
+  if (conn->state == CONN_CLOSING) {
+    close_connection(conn->fd);
+    return;
+  }
+  if (res == -EINTR || res == -EAGAIN) {
+    queue_recv(loop, conn);
+    return;
+  }
+
+  // client hung up before finishing its request, or the connection failed
+  if (res <= 0) {
+    drop_connection(loop, conn);
+    return;
+  }
+  conn->buffer.len += res;
+  metrics_bytes_in(res);
+  dispatch_or_wait(loop, conn);
+}
+
+// hands the response on conn back to the server and frees its buffer
+static void end_response(struct EventLoop* loop, struct Connection* conn) {
+  loop->ringHandlers->finish(&conn->response, ring_buffer(loop, conn->ringBuffer), conn->responseSent > 0);
+  loop->freeBuffers[loop->numOfFreeBuffers++] = conn->ringBuffer;
+  conn->ringBuffer = -1;
+}
+
+/*
+  The read of the body for the response on conn came up short or failed,
+  e.g. because the file shrank, so its send was cancelled before anything
+  went out. A worker answers the request instead.
+*/
+static void read_failed(struct EventLoop* loop, struct Connection* conn) {
+  end_response(loop, conn);
+  conn->state = CONN_DISPATCHED;
+  loop->dispatch(conn->fd);
+}
+
+// a send of the response on conn completed with res, the number of bytes sent or -errno
+static void send_completed(struct EventLoop* loop, struct Connection* conn, int res) {
+  struct RingResponse* response = &conn->response;
+  size_t len = response->headLen + response->bodyLen;
+  if (res == -EINTR || res == -EAGAIN) {
+    queue_send(loop, conn);
+    return;
+  }
+  if (res > 0) {
+    conn->responseSent += res;
+    metrics_bytes_out(res);
+    if (conn->responseSent < len) {
+      queue_send(loop, conn);
+      return;
+    }
+  }
+
+  end_response(loop, conn);
+  if (conn->responseSent < len || !response->keepAlive) {
+    close_connection(conn->fd);
+    return;
+  }
+
+  // wait for the next request, which may already be in the buffer
+  conn->requestsServed++;
+  readbuf_consume(&conn->buffer, response->requestLen);
+  conn->state = CONN_READING;
+  idle_append(loop, conn);
+  dispatch_or_wait(loop, conn);
+}
+
+/*
+  Registers the loop's buffers for the responses it sends itself. Without
+  them, e.g. when they are over RLIMIT_MEMLOCK, every request goes to a
+  worker.
+*/
+static void register_buffers(struct EventLoop* loop) {
+  loop->ringBuffers = aligned_alloc(4096, (size_t) RING_BUFFERS * RING_BUFFER_SIZE);
+  if (loop->ringBuffers == NULL) {
+    err(EXIT_FAILURE, "cannot allocate io_uring buffers");
+  }
+  struct iovec buffers[RING_BUFFERS];
+  for (int i = 0; i < RING_BUFFERS; ++i) {
+    buffers[i].iov_base = ring_buffer(loop, i);
+    buffers[i].iov_len = RING_BUFFER_SIZE;
+    loop->freeBuffers[i] = i;
+  }
+  loop->numOfFreeBuffers = RING_BUFFERS;
+
+  if (uring_register_buffers(&loop->ring, buffers, RING_BUFFERS) < 0) {
+    warn("cannot register io_uring buffers, workers answer every request");
+    free(loop->ringBuffers);
+    loop->ringBuffers = NULL;
+    loop->ringHandlers = NULL;
+  }
+}
+
+/*
+  io_uring event loop thread function. A multishot accept, a recv per
+  waiting connection and a read of wakefd stay queued on the ring, so
+  each pass submits whatever was queued and collects every completion
+  with a single io_uring_enter. Requests the loop answers itself add a
+  linked read and send each, and only the send completes.
+*/
+static void* t_uring_loop(void* arg) {
+  struct EventLoop* loop = arg;
+
+  // the ring is created here since only this thread may submit to it
+  if (uring_init(&loop->ring, RING_ENTRIES, RING_CQ_ENTRIES, URING_FLAGS) < 0) {
+    err(EXIT_FAILURE, "io_uring_setup error");
+  }
+  if (loop->ringHandlers != NULL) {
+    register_buffers(loop);
+  }
+  queue_accept(loop);
+  queue_wake(loop);
+
+  while (1) {
+    // wake up at least once a second to expire idle connections
+    if (uring_submit_and_wait(&loop->ring, 1000) < 0 && errno != ETIME && errno != EINTR) {
+      warn("io_uring_enter error");
+    }
+
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+      uint64_t tag = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uring_cqe_seen(&loop->ring);
+
+      if (tag == ACCEPT_TAG) {
+        if (res >= 0) {
+          add_connection(loop, res);
+        } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED) {
+          errno = -res;
+          warn("accept error");
+        }
+        // the kernel ends a multishot accept on errors or when it runs short of completions
+        if (!(flags & IORING_CQE_F_MORE))
+          queue_accept(loop);
+      } else if (tag == WAKE_TAG) {
+        take_resumed(loop);
+        queue_wake(loop);
+      } else {
+        struct Connection* conn = (struct Connection*) (uintptr_t) (tag & ~(uint64_t) OP_MASK);
+        // a read only completes if it didn't fill the body
+        if ((tag & OP_MASK) == OP_RECV)
+          recv_completed(loop, conn, res);
+        else if ((tag & OP_MASK) == OP_READ)
+          read_failed(loop, conn);
+        else
+          send_completed(loop, conn, res);
+      }
+    }
+    expire_idle(loop);
+  }
+  return NULL;
+}
+
+// whether this kernel has everything the io_uring backend needs
+static int uring_supported() {
+  struct Uring ring;
+  if (uring_init(&ring, RING_ENTRIES, RING_CQ_ENTRIES, URING_FLAGS) < 0) {
+    return 0;
+  }
+  uring_exit(&ring);
+  return 1;
+}
+
+void start_event_loops(const int* listenfds, int numOfLoops, int idleTimeout, int useUring, void (*dispatch)(int connfd), const struct RingHandlers* ringHandlers) {
+  maxConnections = raise_fd_limit();
+  connections = calloc(maxConnections, sizeof *connections);
+  if (connections == NULL) {
+    err(EXIT_FAILURE, "cannot allocate connection table");
+  }
+
+  if (useUring && !uring_supported()) {
+    warn("io_uring is not available, using epoll");
+    useUring = 0;
+  }
+
+  for (int i = 0; i < numOfLoops; ++i) {
+    if (useUring) {
+      // the ring waits for readiness itself and the handlers want blocking
+      // sockets, so nothing is switched to non-blocking. Accepted sockets
+      // inherit TCP_NODELAY from the listening one, saving a setsockopt each
+      int one = 1;
+      setsockopt(listenfds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    } else {
+      set_nonblocking(listenfds[i], 1);
+    }
+  }
+
+  struct EventLoop* loops = malloc(numOfLoops * sizeof *loops);
+  pthread_t t_ids[numOfLoops];
+  for (int i = 0; i < numOfLoops; ++i) {
+    loops[i].listenfd = listenfds[i];
+    loops[i].idleTimeout = idleTimeout;
+    loops[i].dispatch = dispatch;
+    loops[i].idleHead = loops[i].idleTail = NULL;
+    loops[i].resumed = NULL;
+    pthread_mutex_init(&loops[i].m_resumed, NULL);
+    loops[i].useUring = useUring;
+    loops[i].ringHandlers = useUring ? ringHandlers : NULL;
+
+    if (useUring) {
+      // the ring polls wakefd itself, so it stays blocking
+      loops[i].wakefd = eventfd(0, 0);
+      if (loops[i].wakefd < 0) {
+        err(EXIT_FAILURE, "eventfd error");
+      }
+      if (pthread_create(&t_ids[i], NULL, &t_uring_loop, &loops[i]) != 0) {
+        perror("Failed to create thread");
+      }
+      continue;
+    }
+
+    loops[i].epollfd = epoll_create1(0);
+    if (loops[i].epollfd < 0) {
+      err(EXIT_FAILURE, "epoll_create1 error");
+    }
+    loops[i].wakefd = eventfd(0, EFD_NONBLOCK);
+    if (loops[i].wakefd < 0) {
+      err(EXIT_FAILURE, "eventfd error");
+    }
+
+    // loops sharing a listening socket all watch it, but only one is woken per connection
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = loops[i].listenfd;
+    if (epoll_ctl(loops[i].epollfd, EPOLL_CTL_ADD, loops[i].listenfd, &event) < 0) {
+      err(EXIT_FAILURE, "epoll_ctl error");
+    }
+    event.events = EPOLLIN;
+    event.data.fd = loops[i].wakefd;
+    if (epoll_ctl(loops[i].epollfd, EPOLL_CTL_ADD, loops[i].wakefd, &event) < 0) {
+      err(EXIT_FAILURE, "epoll_ctl error");
+    }
+
+    if (pthread_create(&t_ids[i], NULL, &t_event_loop, &loops[i]) != 0) {
+      perror("Failed to create thread");
+    }
+  }
+
+  for (int i = 0; i < numOfLoops; ++i) {
+    pthread_join(t_ids[i], NULL);
+  }
+  free(loops);
+}
+
+// the buffers are swapped rather than copied, so only the pointers change hands
+void take_buffered_request(int connfd, struct ReadBuffer* buffer, int* requestsServed) {
+  struct Connection* conn = connections[connfd];
+  struct ReadBuffer taken = conn->buffer;
+  conn->buffer = *buffer;
+  *buffer = taken;
+  *requestsServed = conn->requestsServed;
+}
+
+void resume_connection(int connfd, struct ReadBuffer* buffer, int requestsServed) {
+  struct Connection* conn = connections[connfd];
+  struct ReadBuffer resumed = conn->buffer;
+  conn->buffer = *buffer;
+  *buffer = resumed;
+  conn->requestsServed = requestsServed;
+
+  struct EventLoop* loop = conn->loop;
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&loop->m_resumed);
+  conn->nextResumed = loop->resumed;
+  loop->resumed = conn;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&loop->m_resumed);
+
+  uint64_t one = 1;
+  if (write(loop->wakefd, &one, sizeof one) < 0) {
+    warn("eventfd write error");
+  }
+}
+
+void close_connection(int connfd) {
+  // the slot has to be cleared before the fd number can be reused by accept
+  readbuf_free(&connections[connfd]->buffer);
+  free(connections[connfd]);
+  connections[connfd] = NULL;
+  close(connfd);
+}
@@ -0,0 +1,78 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "httpparse.h"
+
+/**
+   A response an io_uring loop sends by itself: a head, then bodyLen bytes
+   of the file fd from its start. The body is read into one of the loop's
+   registered buffers right behind the head, by a read linked to the send
+   of both, so the loop only hears back once the response is out.
+ */
+struct RingResponse {
+  int fd;               // file the body is read from
+  size_t headLen;       // bytes of head at the start of the buffer
+  size_t bodyLen;
+  size_t requestLen;    // bytes of the connection's read buffer the request took up
+  int keepAlive;        // whether the connection waits for another request afterwards
+  void* context;        // the server's, for finish
+};
+
+/**
+   Lets the io_uring loops answer requests without a worker. prepare gets
+   a connection with a complete request head at the start of buffer. If
+   the loop can answer it, prepare writes the response head into out,
+   which has room for outSize bytes of head and body, fills in response
+   and returns 1. Otherwise it returns 0 and the connection goes to
+   dispatch as usual. finish gets the response back once it is done, with
+   out holding the head and body, and sent set if any of it went out. A
+   response that failed before anything went out, e.g. because the file
+   got shorter, is then handed to dispatch to be answered by a worker.
+   Both run on the loop's thread.
+ */
+struct RingHandlers {
+  int (*prepare)(int connfd, struct ReadBuffer* buffer, int requestsServed, char* out, size_t outSize, struct RingResponse* response);
+  void (*finish)(struct RingResponse* response, const char* out, int sent);
+};
+
+/**
+   epoll-driven connection engine. A handful of event loop threads accept
+   connections on non-blocking sockets and read request headers without
+   tying up a worker. Once a full request head has arrived, the connection
+   is handed to dispatch() so the regular handlers can serve it. The
+   worker keeps the connection until the response is out, so a slow
+   upload or a slow reader still holds it that long.
+   Connections that wait longer than idleTimeout seconds for a request
+   are closed.
+
+   With useUring, each loop drives an io_uring instead: accepts and reads
+   are queued on the ring and complete in batches, so a loop makes one
+   system call per pass rather than one per accept, read and rearm. If
+   ringHandlers isn't NULL, the requests it takes are answered on the ring
+   as well. It falls back to epoll if the kernel lacks io_uring or the
+   features used.
+
+   Loop i accepts on listenfds[i]. The loops can all share one socket, or
+   each have a SO_REUSEPORT listener of its own so they never contend on
+   the same accept queue.
+ */
+void start_event_loops(const int* listenfds, int numOfLoops, int idleTimeout, int useUring, void (*dispatch)(int connfd), const struct RingHandlers* ringHandlers);
+
+/**
+   Exchanges buffer with the bytes the event loop has read for connfd,
+   so the caller owns them without a copy. Sets requestsServed to the number
+   of requests already answered on the connection.
+ */
+void take_buffered_request(int connfd, struct ReadBuffer* buffer, int* requestsServed);
+
+/**
+   Hands a kept-alive connection back to its event loop to wait for the
+   next request. buffer holds whatever part of that request has already
+   been read, and is exchanged for the loop's empty one.
+ */
+void resume_connection(int connfd, struct ReadBuffer* buffer, int requestsServed);
+
+// releases the per-connection state and closes connfd
+void close_connection(int connfd);
+
+#endif
@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "fdcache.h"
+#include "sidecar.h"
+
+#define NUM_OF_SHARDS 16          // must be a power of two
+#define BUCKETS_PER_SHARD 64      // must be a power of two
+#define GENERATION_DISABLED UINT64_MAX  // a shard's generation once the watch is lost, never cached into again
+
+struct Shard;
+
+struct Entry {
+  struct CachedFile file;     // first, so the public pointer converts back
+  char fileName[SIDECAR_NAME_SIZE];
+  int refCount;               // the cache's reference plus its users, protected by the shard mutex
+  struct Shard* shard;        // NULL for an uncached entry, which only ever has one user
+  struct Entry* next;         // bucket chain
+  struct Entry* lruPrev;
+  struct Entry* lruNext;
+};
+
+struct Shard {
+  pthread_mutex_t m_shard;
+  struct Entry* buckets[BUCKETS_PER_SHARD];
+  struct Entry lru;           // sentinel, lru.lruNext is the most recently used entry
+  int numOfEntries;
+  int capacity;
+  uint64_t generation;        // bumped by every invalidation, so a stale open isn't cached
+                              // GENERATION_DISABLED once the watch is lost
+};
+
+static struct Shard shards[NUM_OF_SHARDS];
+static atomic_int cacheEnabled = 0;
+
+static atomic_uint_fast64_t hits, misses, evictions, invalidations, cached;
+
+// told about every change the inotify watch sees, and about losing it
+static void (*changeListener)(const char* fileName) = NULL;
+static void (*lossListener)() = NULL;
+
+// FNV-1a
+static uint32_t hash_name(const char* fileName) {
+  uint32_t hash = 2166136261u;
+  for (const char* c = fileName; *c != '\0'; ++c) {
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  }
+  return hash;
+}
+
+static struct Shard* get_shard(uint32_t hash) {
+  return &shards[hash & (NUM_OF_SHARDS - 1)];
+}
+
+static struct Entry** get_bucket(struct Shard* shard, uint32_t hash) {
+  return &shard->buckets[(hash / NUM_OF_SHARDS) & (BUCKETS_PER_SHARD - 1)];
+}
+
+static void lru_unlink(struct Entry* entry) {
+  entry->lruPrev->lruNext = entry->lruNext;
+  entry->lruNext->lruPrev = entry->lruPrev;
+}
+
+static void lru_push_front(struct Shard* shard, struct Entry* entry) {
+  entry->lruPrev = &shard->lru;
+  entry->lruNext = shard->lru.lruNext;
+  shard->lru.lruNext->lruPrev = entry;
+  shard->lru.lruNext = entry;
+}
+
+static void free_entry(struct Entry* entry) {
+  if (entry->file.fd >= 0)
+    close(entry->file.fd);
+  free(entry);
+}
+
+/*
+  Takes entry out of the table and drops the cache's reference to it.
+  Must hold the shard mutex. Returns 1 if that was the last reference and
+  the caller has to free the entry once the mutex is released.
+*/
+static int remove_entry(struct Shard* shard, uint32_t hash, struct Entry* entry) {
+  struct Entry** pEntry = get_bucket(shard, hash);
+  while (*pEntry != entry) {
+    pEntry = &(*pEntry)->next;
+  }
+  *pEntry = entry->next;
+  lru_unlink(entry);
+  shard->numOfEntries--;
+  atomic_fetch_sub(&cached, 1);
+  return --entry->refCount == 0;
+}
+
+static struct Entry* find_entry(struct Shard* shard, uint32_t hash, const char* fileName) {
+  struct Entry* entry = *get_bucket(shard, hash);
+  while (entry != NULL && strcmp(entry->fileName, fileName) != 0) {
+    entry = entry->next;
+  }
+  return entry;
+}
+
+/*
+  Opens and stats fileName into a new entry nobody else knows about yet.
+  If negative, a file that doesn't exist gets an entry with fd -1, so it
+  can be cached too.
+*/
+static struct Entry* open_entry(const char* fileName, int negative) {
+  struct stat fileStat = { 0 };
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0) {
+    if (!negative || errno != ENOENT)
+      return NULL;
+  } else if (fstat(fd, &fileStat) < 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return NULL;
+  }
+
+  struct Entry* entry = malloc(sizeof *entry);
+  if (entry == NULL) {
+    err(EXIT_FAILURE, "cannot allocate fd cache entry");
+  }
+  entry->file.fd = fd;
+  entry->file.size = fileStat.st_size;
+  entry->file.mtime = fileStat.st_mtim;
+  strncpy(entry->fileName, fileName, sizeof entry->fileName - 1);
+  entry->fileName[sizeof entry->fileName - 1] = '\0';
+  entry->refCount = 1;
+  entry->shard = NULL;
+  return entry;
+}
+
+// hands out an entry from fdcache_open, or NULL for one that says the file doesn't exist
+static struct CachedFile* found(struct Entry* entry) {
+  if (entry->file.fd < 0) {
+    fdcache_release(&entry->file);
+    errno = ENOENT;
+    return NULL;
+  }
+  return &entry->file;
+}
+
+void fdcache_init(int maxFiles) {
+  cacheEnabled = maxFiles > 0;
+  for (int i = 0; i < NUM_OF_SHARDS; ++i) {
+    struct Shard* shard = &shards[i];
+    pthread_mutex_init(&shard->m_shard, NULL);
+    memset(shard->buckets, 0, sizeof shard->buckets);
+    shard->lru.lruNext = shard->lru.lruPrev = &shard->lru;
+    shard->numOfEntries = 0;
+    shard->capacity = (maxFiles + NUM_OF_SHARDS - 1) / NUM_OF_SHARDS;
+    shard->generation = 0;
+  }
+}
+
+struct CachedFile* fdcache_open(const char* fileName) {
+  if (!cacheEnabled || strlen(fileName) >= sizeof ((struct Entry*) 0)->fileName) {
+    return (struct CachedFile*) open_entry(fileName, 0);
+  }
+
+  uint32_t hash = hash_name(fileName);
+  struct Shard* shard = get_shard(hash);
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&shard->m_shard);
+  struct Entry* entry = find_entry(shard, hash, fileName);
+  if (entry != NULL) {
+    entry->refCount++;
+    lru_unlink(entry);
+    lru_push_front(shard, entry);
+  }
+  uint64_t generation = shard->generation;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&shard->m_shard);
+
+  if (entry != NULL) {
+    atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+    return found(entry);
+  }
+  atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+
+  // open outside the lock so a slow lookup doesn't hold up the whole shard
+  struct Entry* opened = open_entry(fileName, 1);
+  if (opened == NULL) {
+    return NULL;
+  }
+
+  struct Entry* evicted = NULL;
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&shard->m_shard);
+  entry = find_entry(shard, hash, fileName);
+  if (entry != NULL) {
+    // another request cached it in the meantime
+    entry->refCount++;
+  } else if (shard->generation == generation && generation != GENERATION_DISABLED) {
+    entry = opened;
+    opened = NULL;
+    entry->shard = shard;
+    entry->refCount = 2;
+    struct Entry** bucket = get_bucket(shard, hash);
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    shard->numOfEntries++;
+    atomic_fetch_add(&cached, 1);
+
+    // make room by dropping the least recently used entries
+    while (shard->numOfEntries > shard->capacity) {
+      struct Entry* victim = shard->lru.lruPrev;
+      if (remove_entry(shard, hash_name(victim->fileName), victim)) {
+        victim->next = evicted;
+        evicted = victim;
+      }
+      atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+    }
+  }
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&shard->m_shard);
+
+  while (evicted != NULL) {
+    struct Entry* next = evicted->next;
+    free_entry(evicted);
+    evicted = next;
+  }
+
+  // the file changed while it was being opened, so this open is served but not cached
+  if (entry == NULL) {
+    entry = opened;
+  } else if (opened != NULL) {
+    free_entry(opened);
+  }
+  return found(entry);
+}
+
+void fdcache_release(struct CachedFile* file) {
+  struct Entry* entry = (struct Entry*) file;
+  if (entry->shard == NULL) {
+    free_entry(entry);
+    return;
+  }
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&entry->shard->m_shard);
+  int last = --entry->refCount == 0;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&entry->shard->m_shard);
+
+  if (last) {
+    free_entry(entry);
+  }
+}
+
+void fdcache_invalidate(const char* fileName) {
+  if (!cacheEnabled) {
+    return;
+  }
+  uint32_t hash = hash_name(fileName);
+  struct Shard* shard = get_shard(hash);
+  int last = 0;
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&shard->m_shard);
+  if (shard->generation != GENERATION_DISABLED)
+    shard->generation++;
+  struct Entry* entry = find_entry(shard, hash, fileName);
+  if (entry != NULL) {
+    last = remove_entry(shard, hash, entry);
+    atomic_fetch_add_explicit(&invalidations, 1, memory_order_relaxed);
+  }
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&shard->m_shard);
+
+  if (last) {
+    free_entry(entry);
+  }
+}
+
+/*
+  Drops every entry, for when inotify lost track of what changed. With
+  disable, the watch is gone for good: every shard's generation is set to
+  GENERATION_DISABLED, so an open that was already past the cacheEnabled
+  check when caching was turned off still isn't cached once it is done.
+*/
+static void invalidate_all(int disable) {
+  for (int i = 0; i < NUM_OF_SHARDS; ++i) {
+    struct Shard* shard = &shards[i];
+    struct Entry* dropped = NULL;
+
+    // START CRITICAL REGION
+    pthread_mutex_lock(&shard->m_shard);
+    if (disable)
+      shard->generation = GENERATION_DISABLED;
+    else if (shard->generation != GENERATION_DISABLED)
+      shard->generation++;
+    while (shard->lru.lruNext != &shard->lru) {
+      struct Entry* entry = shard->lru.lruNext;
+      if (remove_entry(shard, hash_name(entry->fileName), entry)) {
+        entry->next = dropped;
+        dropped = entry;
+      }
+      atomic_fetch_add_explicit(&invalidations, 1, memory_order_relaxed);
+    }
+    // END CRITICAL REGION
+    pthread_mutex_unlock(&shard->m_shard);
+
+    while (dropped != NULL) {
+      struct Entry* next = dropped->next;
+      free_entry(dropped);
+      dropped = next;
+    }
+  }
+}
+
+// inotify thread function
+static void* t_watch(void* arg) {
+  int watchfd = (int) (intptr_t) arg;
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t len = read(watchfd, buffer, sizeof buffer);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      warn("cannot read inotify events, no longer caching files");
+      cacheEnabled = 0;
+      invalidate_all(1);
+      if (lossListener != NULL)
+        lossListener();
+      return NULL;
+    }
+
+    for (char* p = buffer; p < buffer + len; ) {
+      struct inotify_event* event = (struct inotify_event*) p;
+      if (event->mask & IN_IGNORED) {
+        // the directory itself went away, so nothing more will be reported
+        warnx("lost the inotify watch, no longer caching files");
+        cacheEnabled = 0;
+        invalidate_all(1);
+        if (lossListener != NULL)
+          lossListener();
+        return NULL;
+      } else if (event->mask & IN_Q_OVERFLOW) {
+        invalidate_all(0);
+        if (changeListener != NULL)
+          changeListener(NULL);
+      } else if (event->len > 0) {
+        fdcache_invalidate(event->name);
+        if (changeListener != NULL)
+          changeListener(event->name);
+      }
+      p += sizeof *event + event->len;
+    }
+  }
+  return NULL;
+}
+
+int fdcache_watch(const char* dir, void (*onChange)(const char* fileName), void (*onLost)()) {
+  changeListener = onChange;
+  lossListener = onLost;
+
+  // without a watch nothing would notice outside changes, so stop caching
+  int watchfd = inotify_init1(IN_CLOEXEC);
+  if (watchfd < 0) {
+    cacheEnabled = 0;
+    return -1;
+  }
+  // IN_CREATE so a cached miss ends as soon as the file shows up
+  uint32_t mask = IN_CREATE | IN_MODIFY | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+  if (inotify_add_watch(watchfd, dir, mask) < 0) {
+    close(watchfd);
+    cacheEnabled = 0;
+    return -1;
+  }
+
+  pthread_t watchThread;
+  if (pthread_create(&watchThread, NULL, &t_watch, (void*) (intptr_t) watchfd) != 0) {
+    close(watchfd);
+    cacheEnabled = 0;
+    return -1;
+  }
+  pthread_detach(watchThread);
+  return 0;
+}
+
+void fdcache_get_stats(struct FdCacheStats* stats) {
+  stats->hits = atomic_load(&hits);
+  stats->misses = atomic_load(&misses);
+  stats->evictions = atomic_load(&evictions);
+  stats->invalidations = atomic_load(&invalidations);
+  stats->cached = atomic_load(&cached);
+}
@@ -0,0 +1,58 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/**
+   Cache of open descriptors and their size and modification time for the
+   files being served, hashed by file name into shards that each keep
+   their share of the most recently used maxFiles, at least one. Entries are
+   refcounted, so any number of requests share one descriptor, and one
+   that is evicted or invalidated is only closed once the last of them
+   releases it. Shared descriptors must only be read at explicit offsets
+   (pread, sendfile with an offset), never through the file position.
+ */
+struct CachedFile {
+  int fd;
+  off_t size;
+  struct timespec mtime;
+};
+
+// maxFiles == 0 turns caching off, every open then gets its own descriptor
+void fdcache_init(int maxFiles);
+
+/**
+   Watches dir with inotify, dropping the entries of files that anything
+   else writes, replaces, removes or changes the permissions of, and
+   passing their names on to onChange if it isn't NULL. onChange gets
+   NULL when any file may have changed. If the watch is lost later on,
+   e.g. because dir was removed, caching is turned off and onLost, if
+   not NULL, is called instead, since no change is reported after that.
+   Returns 0 if the watch was set up, -1 if not, in which case caching is
+   turned off since outside changes would go unnoticed.
+ */
+int fdcache_watch(const char* dir, void (*onChange)(const char* fileName), void (*onLost)());
+
+/**
+   Returns fileName opened for reading, or NULL with errno set if it can't
+   be opened. That a file doesn't exist is cached like an open, so probing
+   for files that are usually missing, such as sidecars, costs no syscall.
+ */
+struct CachedFile* fdcache_open(const char* fileName);
+void fdcache_release(struct CachedFile* file);
+
+// drops the entry for fileName, e.g. after it was written
+void fdcache_invalidate(const char* fileName);
+
+struct FdCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;       // entries dropped to make room
+  uint64_t invalidations;   // entries dropped because the file changed
+  uint64_t cached;          // entries in the cache now
+};
+void fdcache_get_stats(struct FdCacheStats* stats);
+
+#endif
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "filelock.h"
+
+#define NUM_OF_BUCKETS 64 // must be a power of two
+
+struct FileLock {
+  char fileName[20];
+  pthread_rwlock_t rwlock;
+  int refCount;             // holders and waiters, protected by the bucket mutex
+  struct FileLock* next;
+};
+
+struct Bucket {
+  pthread_mutex_t m_bucket;
+  struct FileLock* head;
+};
+
+static struct Bucket buckets[NUM_OF_BUCKETS];
+
+static atomic_uint_fast64_t acquisitions, contended, waitNs, maxWaitNs, active;
+
+// FNV-1a
+static struct Bucket* get_bucket(const char* fileName) {
+  uint32_t hash = 2166136261u;
+  for (const char* c = fileName; *c != '\0'; ++c) {
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  }
+  return &buckets[hash & (NUM_OF_BUCKETS - 1)];
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// finds the entry for fileName, creating it if nobody holds it yet
+static struct FileLock* get_entry(const char* fileName) {
+  struct Bucket* bucket = get_bucket(fileName);
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&bucket->m_bucket);
+
+  struct FileLock* lock = bucket->head;
+  while (lock != NULL && strcmp(lock->fileName, fileName) != 0) {
+    lock = lock->next;
+  }
+
+  if (lock == NULL) {
+    lock = malloc(sizeof *lock);
+    if (lock == NULL) {
+      err(EXIT_FAILURE, "cannot allocate file lock");
+    }
+    strncpy(lock->fileName, fileName, sizeof lock->fileName - 1);
+    lock->fileName[sizeof lock->fileName - 1] = '\0';
+    lock->refCount = 0;
+
+    // writers go first so a steady stream of GETs can't starve a PUT
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lock->rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    lock->next = bucket->head;
+    bucket->head = lock;
+    atomic_fetch_add(&active, 1);
+  }
+  lock->refCount++;
+
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&bucket->m_bucket);
+
+  return lock;
+}
+
+void filelock_init() {
+  for (int i = 0; i < NUM_OF_BUCKETS; ++i) {
+    pthread_mutex_init(&buckets[i].m_bucket, NULL);
+    buckets[i].head = NULL;
+  }
+}
+
+struct FileLock* filelock_acquire(const char* fileName, int exclusive) {
+  struct FileLock* lock = get_entry(fileName);
+  atomic_fetch_add_explicit(&acquisitions, 1, memory_order_relaxed);
+
+  // only time the acquisitions that actually have to wait
+  int rc = exclusive ? pthread_rwlock_trywrlock(&lock->rwlock) : pthread_rwlock_tryrdlock(&lock->rwlock);
+  if (rc == 0) {
+    return lock;
+  }
+
+  uint64_t start = now_ns();
+  if (exclusive)
+    pthread_rwlock_wrlock(&lock->rwlock);
+  else
+    pthread_rwlock_rdlock(&lock->rwlock);
+  uint64_t waited = now_ns() - start;
+
+  atomic_fetch_add_explicit(&contended, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&waitNs, waited, memory_order_relaxed);
+  uint64_t prevMax = atomic_load_explicit(&maxWaitNs, memory_order_relaxed);
+  while (waited > prevMax &&
+      !atomic_compare_exchange_weak_explicit(&maxWaitNs, &prevMax, waited, memory_order_relaxed, memory_order_relaxed)) { }
+
+  return lock;
+}
+
+// drops a reference taken by get_entry, freeing the entry once nobody holds or waits on it
+static void put_entry(struct FileLock* lock) {
+  struct Bucket* bucket = get_bucket(lock->fileName);
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&bucket->m_bucket);
+
+  if (--lock->refCount == 0) {
+    struct FileLock** pLock = &bucket->head;
+    while (*pLock != lock) {
+      pLock = &(*pLock)->next;
+    }
+    *pLock = lock->next;
+    pthread_rwlock_destroy(&lock->rwlock);
+    free(lock);
+    atomic_fetch_sub(&active, 1);
+  }
+
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&bucket->m_bucket);
+}
+
+struct FileLock* filelock_try_acquire(const char* fileName, int exclusive) {
+  struct FileLock* lock = get_entry(fileName);
+  int rc = exclusive ? pthread_rwlock_trywrlock(&lock->rwlock) : pthread_rwlock_tryrdlock(&lock->rwlock);
+  if (rc != 0) {
+    put_entry(lock);
+    return NULL;
+  }
+  atomic_fetch_add_explicit(&acquisitions, 1, memory_order_relaxed);
+  return lock;
+}
+
+void filelock_release(struct FileLock* lock) {
+  if (lock == NULL) {
+    return;
+  }
+  pthread_rwlock_unlock(&lock->rwlock);
+  put_entry(lock);
+}
+
+void filelock_get_stats(struct FileLockStats* stats) {
+  stats->acquisitions = atomic_load(&acquisitions);
+  stats->contended = atomic_load(&contended);
+  stats->waitNs = atomic_load(&waitNs);
+  stats->maxWaitNs = atomic_load(&maxWaitNs);
+  stats->active = atomic_load(&active);
+}
@@ -0,0 +1,33 @@
+#ifndef FILELOCK_H
+#define FILELOCK_H
+
+#include <stdint.h>
+
+/**
+   Table of per-file reader/writer locks, hashed by file name.
+   Entries are created the first time a file is locked and freed once the
+   last holder releases them. Any number of GET/HEAD requests can read a
+   file at once while a PUT has it to itself, and threads that have to
+   wait sleep on the lock instead of spinning.
+ */
+struct FileLock;
+
+void filelock_init();
+
+// blocks until fileName can be read (exclusive == 0) or written (exclusive == 1)
+struct FileLock* filelock_acquire(const char* fileName, int exclusive);
+// like filelock_acquire, but returns NULL instead of waiting if someone else holds fileName
+struct FileLock* filelock_try_acquire(const char* fileName, int exclusive);
+// releasing NULL does nothing, for requests that didn't need a lock
+void filelock_release(struct FileLock* lock);
+
+struct FileLockStats {
+  uint64_t acquisitions;  // locks taken
+  uint64_t contended;     // locks that had to wait for another holder
+  uint64_t waitNs;        // total time spent waiting
+  uint64_t maxWaitNs;     // longest single wait
+  uint64_t active;        // files currently locked
+};
+void filelock_get_stats(struct FileLockStats* stats);
+
+#endif
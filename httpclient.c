@@ -0,0 +1,897 @@
+/*
+  Load generator for the server and the proxy. Every thread runs an
+  epoll loop over its share of the connections, each of which keeps up
+  to -P requests in flight on a kept-alive connection, or opens a new
+  connection for every request with -x.
+
+  Closed loop (the default): a connection sends its next request as soon
+  as a response comes back, so the server sets the pace.
+  Open loop (-R rate): requests are due at a constant rate however fast
+  the server answers, spread evenly over the connections. A request that
+  can't go out when it is due, because its connection is still waiting
+  for earlier responses, is sent late but its latency is still measured
+  from when it was due, so a stalled server shows up in the latencies
+  instead of quietly lowering the rate (coordinated omission).
+
+  Requests are a random mix of GET, PUT and HEAD (-m) for -k keys,
+  picked uniformly or, with -z s, from a Zipf distribution where the
+  key of rank r is picked in proportion to 1 / r^s. With one key the key
+  is the file name itself, otherwise the names are the file name with
+  the key's number after it, e.g. key0, key1, ...; -i PUTs every key
+  before the run so GETs don't miss.
+
+  usage: ./httpclient -p port [-a address] [-f file] [-k keys] [-z zipf]
+           [-m get=N,put=N,head=N] [-b put bytes] [-i] [-t threads]
+           [-c connections] [-P pipeline] [-R rate] [-d seconds]
+           [-w warmup seconds] [-x] [-o result.json]
+*/
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#define MAX_THREADS 64
+#define MAX_PIPELINE 64
+#define MAX_EVENTS 256
+#define KEY_NAME_SIZE 20   // the server takes names of up to 19 characters
+
+/*
+  Latencies are counted in log-linear buckets of nanoseconds, the way
+  metrics.c counts them but finer: every power of two is split into
+  HIST_SUB_BUCKETS, so a bucket's bounds are within about 3% of any
+  latency in it.
+*/
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+enum Method { GET, PUT, HEAD, NUM_OF_METHODS };
+static const char* methodNames[NUM_OF_METHODS] = { "GET", "PUT", "HEAD" };
+
+struct Histogram {
+  uint64_t buckets[HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sumNs;
+  uint64_t maxNs;
+};
+
+// a request that was sent, or is waiting to be resent, and has no response yet
+struct Pending {
+  uint64_t dueNs;       // when it was due, or sent in a closed loop
+  enum Method method;
+  uint32_t key;
+};
+
+struct Connection {
+  int fd;                               // -1 while not connected
+  struct Pending pending[MAX_PIPELINE]; // oldest first, from first
+  int first;
+  int numOfPending;
+  char* out;            // requests not sent yet
+  size_t outLen, outSent, outSize;
+  int waitingToWrite;   // EPOLLOUT is on
+  char* in;             // response bytes not parsed yet
+  size_t inLen, inSize;
+  long bodyLeft;        // -1 while the response head is incomplete
+  int statusCode;
+  int closes;           // the server closes the connection after this response
+  int answered;         // responses read off this connection
+  uint64_t nextDueNs;   // open loop only
+};
+
+struct Worker {
+  pthread_t thread;
+  int epollfd;
+  int timerfd;
+  struct Connection* connections;
+  int numOfConnections;
+  uint64_t random;      // xorshift state
+  int measuring;        // the warmup is over
+  // results, only written by the worker's own thread
+  struct Histogram latency[NUM_OF_METHODS];
+  uint64_t statuses[600];
+  uint64_t connectionErrors;
+  uint64_t retries;
+  uint64_t bytesIn, bytesOut;
+};
+
+// options
+struct sockaddr_in serverAddr;
+uint16_t port = 0;
+const char* fileName = "key";
+uint32_t numOfKeys = 1;
+double zipf = 0;
+int mix[NUM_OF_METHODS] = { 100, 0, 0 };   // weights of GET, PUT and HEAD
+long putBytes = 1024;
+int initKeys = 0;
+int numOfThreads = 1;
+int numOfConnections = 16;
+int pipelineDepth = 1;
+double rate = 0;           // requests per second, 0 for a closed loop
+double seconds = 10;
+double warmupSeconds = 0;
+int newConnections = 0;
+const char* resultFileName = NULL;
+
+// derived from the options
+char* putBody;
+double* keyCdf;            // probability of a key of this rank or lower
+uint64_t startNs, measureNs, endNs;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns) {
+  if (ns < 2 * HIST_SUB_BUCKETS)
+    return ns;
+  int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+  return shift * HIST_SUB_BUCKETS + (ns >> shift);
+}
+
+// the highest latency in bucket index
+static uint64_t bucket_top(int index) {
+  if (index < 2 * HIST_SUB_BUCKETS)
+    return index;
+  int shift = index / HIST_SUB_BUCKETS - 1;
+  return (((uint64_t) (index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+static void hist_add(struct Histogram* hist, uint64_t ns) {
+  hist->buckets[bucket_of(ns)]++;
+  hist->count++;
+  hist->sumNs += ns;
+  if (ns > hist->maxNs)
+    hist->maxNs = ns;
+}
+
+static void hist_merge(struct Histogram* into, const struct Histogram* hist) {
+  for (int i = 0; i < HIST_BUCKETS; ++i)
+    into->buckets[i] += hist->buckets[i];
+  into->count += hist->count;
+  into->sumNs += hist->sumNs;
+  if (hist->maxNs > into->maxNs)
+    into->maxNs = hist->maxNs;
+}
+
+// the latency fraction of the requests took at most, in nanoseconds
+static uint64_t hist_percentile(const struct Histogram* hist, double fraction) {
+  if (hist->count == 0)
+    return 0;
+  uint64_t target = ceil(hist->count * fraction), seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; ++i) {
+    seen += hist->buckets[i];
+    if (seen >= target && seen > 0)
+      return bucket_top(i) < hist->maxNs ? bucket_top(i) : hist->maxNs;
+  }
+  return hist->maxNs;
+}
+
+static uint64_t next_random(struct Worker* worker) {
+  uint64_t x = worker->random;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return worker->random = x;
+}
+
+// a uniformly random number in [0, 1)
+static double next_fraction(struct Worker* worker) {
+  return (next_random(worker) >> 11) * 0x1.0p-53;
+}
+
+static uint32_t pick_key(struct Worker* worker) {
+  if (keyCdf == NULL)
+    return next_random(worker) % numOfKeys;
+
+  // the first rank whose cumulative probability is above a random fraction
+  double fraction = next_fraction(worker);
+  uint32_t low = 0, high = numOfKeys - 1;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (keyCdf[middle] > fraction)
+      high = middle;
+    else
+      low = middle + 1;
+  }
+  return low;
+}
+
+static enum Method pick_method(struct Worker* worker) {
+  int total = mix[GET] + mix[PUT] + mix[HEAD];
+  int n = next_random(worker) % total;
+  if (n < mix[GET])
+    return GET;
+  return n < mix[GET] + mix[PUT] ? PUT : HEAD;
+}
+
+static void key_name(char* name, uint32_t key) {
+  if (numOfKeys == 1)
+    snprintf(name, KEY_NAME_SIZE, "%s", fileName);
+  else
+    snprintf(name, KEY_NAME_SIZE, "%s%u", fileName, key);
+}
+
+static int connect_to_server() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &serverAddr, sizeof serverAddr) < 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+static void reserve(char** buffer, size_t* size, size_t needed) {
+  if (needed <= *size)
+    return;
+  size_t newSize = *size > 0 ? *size : 4096;
+  while (newSize < needed)
+    newSize *= 2;
+  *buffer = realloc(*buffer, newSize);
+  if (*buffer == NULL)
+    err(EXIT_FAILURE, "cannot allocate a buffer");
+  *size = newSize;
+}
+
+// adds a request for pending to what conn has to send
+static void write_request(struct Connection* conn, const struct Pending* pending) {
+  char name[KEY_NAME_SIZE];
+  key_name(name, pending->key);
+  long bodyLen = pending->method == PUT ? putBytes : 0;
+
+  reserve(&conn->out, &conn->outSize, conn->outLen + 256 + bodyLen);
+  conn->outLen += sprintf(conn->out + conn->outLen, "%s /%s HTTP/1.1\r\nHost: localhost:%d\r\n",
+      methodNames[pending->method], name, port);
+  if (pending->method == PUT)
+    conn->outLen += sprintf(conn->out + conn->outLen, "Content-Length: %ld\r\n", bodyLen);
+  if (newConnections)
+    conn->outLen += sprintf(conn->out + conn->outLen, "Connection: close\r\n");
+  conn->outLen += sprintf(conn->out + conn->outLen, "\r\n");
+  memcpy(conn->out + conn->outLen, putBody, bodyLen);
+  conn->outLen += bodyLen;
+}
+
+static void set_writable_wait(struct Worker* worker, struct Connection* conn, int wait) {
+  if (conn->waitingToWrite == wait)
+    return;
+  struct epoll_event event = { .events = EPOLLIN | (wait ? EPOLLOUT : 0), .data.ptr = conn };
+  epoll_ctl(worker->epollfd, EPOLL_CTL_MOD, conn->fd, &event);
+  conn->waitingToWrite = wait;
+}
+
+static void drop_connection(struct Connection* conn) {
+  if (conn->fd >= 0)
+    close(conn->fd);   // which also takes it out of the epoll set
+  conn->fd = -1;
+  conn->outLen = conn->outSent = 0;
+  conn->inLen = 0;
+  conn->bodyLeft = -1;
+  conn->waitingToWrite = 0;
+  conn->answered = 0;
+}
+
+/**
+   Connects conn if it isn't and writes a request for every pending one,
+   for a new connection or one that replaces a connection the server
+   closed before answering all of them. Returns -1 if it can't connect.
+ */
+static int ensure_connected(struct Worker* worker, struct Connection* conn) {
+  if (conn->fd >= 0)
+    return 0;
+  conn->fd = connect_to_server();
+  if (conn->fd < 0)
+    return -1;
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+  if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, conn->fd, &event) < 0)
+    err(EXIT_FAILURE, "epoll_ctl error");
+  for (int i = 0; i < conn->numOfPending; ++i)
+    write_request(conn, &conn->pending[(conn->first + i) % MAX_PIPELINE]);
+  return 0;
+}
+
+// sends as much of what conn has to send as the socket takes
+static int flush_requests(struct Worker* worker, struct Connection* conn) {
+  while (conn->outSent < conn->outLen) {
+    ssize_t sent = send(conn->fd, conn->out + conn->outSent, conn->outLen - conn->outSent, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        set_writable_wait(worker, conn, 1);
+        return 0;
+      }
+      if (conn->answered > 0) {
+        // the server is closing a kept-alive connection. Whatever it
+        // answered can still be read, and read_responses retries the rest
+        conn->outLen = conn->outSent = 0;
+        set_writable_wait(worker, conn, 0);
+        return 0;
+      }
+      return -1;
+    }
+    if (worker->measuring)
+      worker->bytesOut += sent;
+    conn->outSent += sent;
+  }
+  conn->outLen = conn->outSent = 0;
+  set_writable_wait(worker, conn, 0);
+  return 0;
+}
+
+/**
+   The connection failed: every request on it is counted as a connection
+   error and it is reconnected the next time a request is due on it.
+ */
+static void fail_connection(struct Worker* worker, struct Connection* conn) {
+  uint64_t now = now_ns();
+  for (int i = 0; i < conn->numOfPending; ++i) {
+    if (conn->pending[(conn->first + i) % MAX_PIPELINE].dueNs >= measureNs && now < endNs)
+      worker->connectionErrors++;
+  }
+  // a response that wasn't asked for
+  if (conn->numOfPending == 0 && now >= measureNs && now < endNs)
+    worker->connectionErrors++;
+  conn->numOfPending = 0;
+  drop_connection(conn);
+}
+
+static void send_request(struct Worker* worker, struct Connection* conn, uint64_t dueNs) {
+  struct Pending* pending = &conn->pending[(conn->first + conn->numOfPending++) % MAX_PIPELINE];
+  pending->dueNs = dueNs;
+  pending->method = pick_method(worker);
+  pending->key = pick_key(worker);
+
+  // a new connection writes every pending request, including this one
+  if (conn->fd >= 0) {
+    write_request(conn, pending);
+  } else if (ensure_connected(worker, conn) < 0) {
+    fail_connection(worker, conn);
+    return;
+  }
+  if (flush_requests(worker, conn) < 0)
+    fail_connection(worker, conn);
+}
+
+// sends every request that is due on conn and fits in its pipeline
+static void send_due_requests(struct Worker* worker, struct Connection* conn, uint64_t now) {
+  if (rate > 0) {
+    uint64_t intervalNs = 1e9 * numOfConnections / rate;
+    while (conn->nextDueNs <= now && conn->numOfPending < pipelineDepth) {
+      uint64_t dueNs = conn->nextDueNs;
+      conn->nextDueNs += intervalNs;
+      send_request(worker, conn, dueNs);
+    }
+  } else {
+    while (conn->numOfPending < pipelineDepth)
+      send_request(worker, conn, now_ns());
+  }
+}
+
+static void finish_response(struct Worker* worker, struct Connection* conn) {
+  struct Pending* pending = &conn->pending[conn->first];
+  conn->first = (conn->first + 1) % MAX_PIPELINE;
+  conn->numOfPending--;
+  conn->bodyLeft = -1;
+  conn->answered++;
+
+  uint64_t now = now_ns();
+  if (pending->dueNs >= measureNs && now < endNs) {
+    hist_add(&worker->latency[pending->method], now - pending->dueNs);
+    worker->statuses[conn->statusCode]++;
+  }
+}
+
+// the server closed the connection after a response, so the rest go again on a new one
+static void resend_pending(struct Worker* worker, struct Connection* conn) {
+  drop_connection(conn);
+  if (conn->numOfPending > 0 && (ensure_connected(worker, conn) < 0 || flush_requests(worker, conn) < 0))
+    fail_connection(worker, conn);
+}
+
+/**
+   Parses the head of the response at the start of conn->in. Returns its
+   length, 0 if it is incomplete, or -1 if it isn't a response.
+ */
+static long parse_response_head(struct Connection* conn, enum Method method) {
+  char* end = memmem(conn->in, conn->inLen, "\r\n\r\n", 4);
+  if (end == NULL)
+    return conn->inLen > 65536 ? -1 : 0;
+  *end = '\0';
+
+  int statusCode;
+  if (sscanf(conn->in, "HTTP/1.%*d %d", &statusCode) != 1 || statusCode < 100 || statusCode > 599)
+    return -1;
+  conn->statusCode = statusCode;
+
+  conn->bodyLeft = 0;
+  conn->closes = 0;
+  for (char* line = strstr(conn->in, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0 && method != HEAD && statusCode != 304)
+      conn->bodyLeft = atol(line + 17);
+    else if (strncasecmp(line + 2, "Connection: close", 17) == 0)
+      conn->closes = 1;
+  }
+  return end + 4 - conn->in;
+}
+
+// reads and parses whatever has arrived on conn, returns once it would block
+static void read_responses(struct Worker* worker, struct Connection* conn) {
+  while (conn->fd >= 0) {
+    reserve(&conn->in, &conn->inSize, conn->inLen + 65536);
+    ssize_t len = recv(conn->fd, conn->in + conn->inLen, conn->inSize - conn->inLen - 1, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len == 0 && conn->numOfPending == 0) {
+      // closed while idle, e.g. after the server's keep-alive timeout
+      drop_connection(conn);
+      return;
+    }
+    if (len <= 0 && conn->answered > 0 && conn->numOfPending > 0) {
+      // a server that closes a kept-alive connection, e.g. after its -r
+      // limit, resets it when pipelined requests arrive after the last one
+      // it answers, so those are retried like browsers retry them
+      worker->retries += conn->numOfPending;
+      resend_pending(worker, conn);
+      return;
+    }
+    if (len <= 0 || conn->numOfPending == 0) {
+      fail_connection(worker, conn);
+      return;
+    }
+    if (worker->measuring)
+      worker->bytesIn += len;
+    conn->inLen += len;
+
+    size_t parsed = 0;
+    while (conn->numOfPending > 0 && conn->fd >= 0) {
+      if (conn->bodyLeft < 0) {
+        // shift what's left of the previous response out of the way first
+        memmove(conn->in, conn->in + parsed, conn->inLen - parsed);
+        conn->inLen -= parsed;
+        parsed = 0;
+        long headLen = parse_response_head(conn, conn->pending[conn->first].method);
+        if (headLen < 0) {
+          fail_connection(worker, conn);
+          return;
+        }
+        if (headLen == 0)
+          break;
+        parsed = headLen;
+      }
+      // bodies are skipped without being kept
+      size_t body = conn->inLen - parsed < (size_t) conn->bodyLeft ? conn->inLen - parsed : (size_t) conn->bodyLeft;
+      parsed += body;
+      conn->bodyLeft -= body;
+      if (conn->bodyLeft > 0)
+        break;
+      finish_response(worker, conn);
+      if (conn->closes) {
+        resend_pending(worker, conn);
+        return;
+      }
+    }
+
+    memmove(conn->in, conn->in + parsed, conn->inLen - parsed);
+    conn->inLen -= parsed;
+    if (conn->numOfPending == 0)
+      return;
+  }
+}
+
+static void arm_timer(struct Worker* worker, uint64_t atNs) {
+  struct itimerspec timer = { 0 };
+  timer.it_value.tv_sec = atNs / 1000000000;
+  timer.it_value.tv_nsec = atNs % 1000000000;
+  timerfd_settime(worker->timerfd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+void* t_run_worker(void* arg) {
+  struct Worker* worker = (struct Worker*) arg;
+
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->timerfd, &event);
+
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t now;
+  while ((now = now_ns()) < endNs) {
+    worker->measuring = now >= measureNs;
+
+    // the timer goes off when the next request is due, or the run is over
+    uint64_t wakeNs = endNs;
+    for (int i = 0; i < worker->numOfConnections; ++i) {
+      struct Connection* conn = &worker->connections[i];
+      send_due_requests(worker, conn, now);
+      if (rate > 0 && conn->numOfPending < pipelineDepth && conn->nextDueNs < wakeNs)
+        wakeNs = conn->nextDueNs;
+    }
+    arm_timer(worker, wakeNs);
+
+    int numOfEvents = epoll_wait(worker->epollfd, events, MAX_EVENTS, -1);
+    for (int i = 0; i < numOfEvents; ++i) {
+      struct Connection* conn = events[i].data.ptr;
+      if (conn == NULL) {
+        uint64_t expirations;
+        if (read(worker->timerfd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+          warn("timerfd read error");
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && conn->fd >= 0 && flush_requests(worker, conn) < 0)
+        fail_connection(worker, conn);
+      if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && conn->fd >= 0)
+        read_responses(worker, conn);
+    }
+  }
+  return NULL;
+}
+
+// PUTs every key once, one after the other
+void init_keys() {
+  struct Worker worker;
+  memset(&worker, 0, sizeof worker);
+  struct Connection conn;
+  memset(&conn, 0, sizeof conn);
+  conn.fd = -1;
+  conn.bodyLeft = -1;
+
+  for (uint32_t key = 0; key < numOfKeys; ++key) {
+    conn.first = 0;
+    conn.numOfPending = 1;
+    conn.pending[0].method = PUT;
+    conn.pending[0].key = key;
+    if (conn.fd < 0) {
+      conn.fd = connect_to_server();
+      if (conn.fd < 0)
+        err(EXIT_FAILURE, "cannot connect to port %d", port);
+      fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL, 0) & ~O_NONBLOCK);
+    }
+    conn.outLen = 0;
+    conn.statusCode = 0;
+    write_request(&conn, &conn.pending[0]);
+    if (send(conn.fd, conn.out, conn.outLen, MSG_NOSIGNAL) != (ssize_t) conn.outLen)
+      err(EXIT_FAILURE, "cannot send to port %d", port);
+
+    // blocking, so this reads until the response is complete or the connection fails
+    conn.inLen = 0;
+    read_responses(&worker, &conn);
+    if (conn.statusCode == 0)
+      errx(EXIT_FAILURE, "the server closed the connection while creating the keys");
+    if (conn.statusCode >= 300)
+      errx(EXIT_FAILURE, "PUT of key %u failed with %d", key, conn.statusCode);
+  }
+  if (conn.fd >= 0)
+    close(conn.fd);
+}
+
+static void parse_mix(char* text) {
+  int weights[NUM_OF_METHODS] = { 0 };
+  for (char* part = strtok(text, ","); part != NULL; part = strtok(NULL, ",")) {
+    char* equals = strchr(part, '=');
+    if (equals == NULL)
+      errx(EXIT_FAILURE, "invalid mix %s, e.g. get=90,put=5,head=5", part);
+    *equals = '\0';
+    int method = 0;
+    while (method < NUM_OF_METHODS && strcasecmp(part, methodNames[method]) != 0)
+      method++;
+    if (method == NUM_OF_METHODS || atoi(equals + 1) < 0)
+      errx(EXIT_FAILURE, "invalid mix %s, e.g. get=90,put=5,head=5", part);
+    weights[method] = atoi(equals + 1);
+  }
+  if (weights[GET] + weights[PUT] + weights[HEAD] <= 0)
+    errx(EXIT_FAILURE, "the mix needs at least one request");
+  memcpy(mix, weights, sizeof mix);
+}
+
+static void print_latencies(const char* name, const struct Histogram* hist) {
+  if (hist->count == 0)
+    return;
+  printf("%-6s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+      name,
+      hist->count,
+      hist->sumNs / 1e3 / hist->count,
+      hist_percentile(hist, 0.5) / 1e3,
+      hist_percentile(hist, 0.9) / 1e3,
+      hist_percentile(hist, 0.99) / 1e3,
+      hist_percentile(hist, 0.999) / 1e3,
+      hist->maxNs / 1e3
+  );
+}
+
+// one row for every power of two of microseconds any request took
+static void print_histogram(const struct Histogram* hist) {
+  uint64_t rows[64] = { 0 }, most = 0;
+  int firstRow = 64, lastRow = -1;
+  for (int i = 0; i < HIST_BUCKETS; ++i) {
+    if (hist->buckets[i] == 0)
+      continue;
+    uint64_t us = bucket_top(i) / 1000;
+    int row = us > 0 ? 64 - __builtin_clzll(us) : 0;
+    rows[row] += hist->buckets[i];
+    firstRow = row < firstRow ? row : firstRow;
+    lastRow = row > lastRow ? row : lastRow;
+  }
+  for (int row = firstRow; row <= lastRow; ++row)
+    most = rows[row] > most ? rows[row] : most;
+
+  for (int row = firstRow; row <= lastRow; ++row) {
+    char bar[51];
+    int width = most > 0 ? rows[row] * 50 / most : 0;
+    memset(bar, '#', width);
+    bar[width] = '\0';
+    printf("  < %9lu us %10lu %s\n", 1ul << row, rows[row], bar);
+  }
+}
+
+static void write_latencies(FILE* out, const char* name, const struct Histogram* hist) {
+  fprintf(out, "    \"%s\": {\"count\": %lu, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f, \"buckets\": [",
+      name,
+      hist->count,
+      hist->count > 0 ? hist->sumNs / 1e3 / hist->count : 0.0,
+      hist_percentile(hist, 0.5) / 1e3,
+      hist_percentile(hist, 0.9) / 1e3,
+      hist_percentile(hist, 0.99) / 1e3,
+      hist_percentile(hist, 0.999) / 1e3,
+      hist->maxNs / 1e3
+  );
+  // every bucket anything fell in, as [highest latency in us, count]
+  const char* comma = "";
+  for (int i = 0; i < HIST_BUCKETS; ++i) {
+    if (hist->buckets[i] == 0)
+      continue;
+    fprintf(out, "%s[%.3f, %lu]", comma, bucket_top(i) / 1e3, hist->buckets[i]);
+    comma = ", ";
+  }
+  fprintf(out, "]}");
+}
+
+static void write_result(const char* name, double elapsed, const struct Histogram latency[], const struct Histogram* all,
+    const uint64_t statuses[], uint64_t connectionErrors, uint64_t retries, uint64_t bytesIn, uint64_t bytesOut) {
+  FILE* out = fopen(name, "w");
+  if (out == NULL)
+    err(EXIT_FAILURE, "cannot write %s", name);
+
+  fprintf(out, "{\n  \"config\": {\"port\": %d, \"file\": \"%s\", \"keys\": %u, \"zipf\": %g, \"mix\": {\"GET\": %d, \"PUT\": %d, \"HEAD\": %d}, "
+      "\"putBytes\": %ld, \"threads\": %d, \"connections\": %d, \"pipeline\": %d, \"mode\": \"%s\", \"rate\": %g, "
+      "\"seconds\": %g, \"warmupSeconds\": %g, \"newConnections\": %s},\n",
+      port, fileName, numOfKeys, zipf, mix[GET], mix[PUT], mix[HEAD],
+      putBytes, numOfThreads, numOfConnections, pipelineDepth, rate > 0 ? "open" : "closed", rate,
+      seconds, warmupSeconds, newConnections ? "true" : "false");
+  fprintf(out, "  \"elapsed\": %.3f,\n  \"requests\": %lu,\n  \"throughput\": %.1f,\n  \"bytesIn\": %lu,\n  \"bytesOut\": %lu,\n  \"connectionErrors\": %lu,\n  \"retries\": %lu,\n",
+      elapsed, all->count, all->count / elapsed, bytesIn, bytesOut, connectionErrors, retries);
+
+  fprintf(out, "  \"statuses\": {");
+  const char* comma = "";
+  for (int i = 0; i < 600; ++i) {
+    if (statuses[i] > 0) {
+      fprintf(out, "%s\"%d\": %lu", comma, i, statuses[i]);
+      comma = ", ";
+    }
+  }
+  fprintf(out, "},\n  \"latencyUs\": {\n");
+  for (int m = 0; m < NUM_OF_METHODS; ++m) {
+    write_latencies(out, methodNames[m], &latency[m]);
+    fprintf(out, ",\n");
+  }
+  write_latencies(out, "all", all);
+  fprintf(out, "\n  }\n}\n");
+
+  if (fclose(out) != 0)
+    err(EXIT_FAILURE, "cannot write %s", name);
+}
+
+int main(int argc, char* argv[]) {
+  const char* address = "127.0.0.1";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:a:f:k:z:m:b:it:c:P:R:d:w:xo:")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'a':
+        address = optarg;
+        break;
+      case 'f':
+        fileName = optarg;
+        break;
+      case 'k':
+        numOfKeys = atol(optarg);
+        break;
+      case 'z':
+        zipf = atof(optarg);
+        break;
+      case 'm':
+        parse_mix(optarg);
+        break;
+      case 'b':
+        putBytes = atol(optarg);
+        break;
+      case 'i':
+        initKeys = 1;
+        break;
+      case 't':
+        numOfThreads = atoi(optarg);
+        break;
+      case 'c':
+        numOfConnections = atoi(optarg);
+        break;
+      case 'P':
+        pipelineDepth = atoi(optarg);
+        break;
+      case 'R':
+        rate = atof(optarg);
+        break;
+      case 'd':
+        seconds = atof(optarg);
+        break;
+      case 'w':
+        warmupSeconds = atof(optarg);
+        break;
+      case 'x':
+        newConnections = 1;
+        break;
+      case 'o':
+        resultFileName = optarg;
+        break;
+      default:
+        errx(EXIT_FAILURE, "usage: %s -p port [-a address] [-f file] [-k keys] [-z zipf] [-m get=N,put=N,head=N] [-b put bytes] [-i] "
+            "[-t threads] [-c connections] [-P pipeline] [-R rate] [-d seconds] [-w warmup seconds] [-x] [-o result.json]", argv[0]);
+    }
+  }
+  if (port == 0) {
+    errx(EXIT_FAILURE, "a port is required");
+  }
+  memset(&serverAddr, 0, sizeof serverAddr);
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &serverAddr.sin_addr) != 1) {
+    errx(EXIT_FAILURE, "invalid IPv4 address: %s", address);
+  }
+  if (numOfKeys == 0 || zipf < 0 || putBytes < 0 || seconds <= 0 || warmupSeconds < 0 || rate < 0) {
+    errx(EXIT_FAILURE, "keys, seconds and rate have to be positive, and the zipf exponent, body size and warmup can't be negative");
+  }
+  if (numOfThreads <= 0 || numOfThreads > MAX_THREADS) {
+    errx(EXIT_FAILURE, "threads have to be between 1 and %d", MAX_THREADS);
+  }
+  if (numOfConnections < numOfThreads) {
+    errx(EXIT_FAILURE, "every thread needs at least one connection");
+  }
+  if (pipelineDepth <= 0 || pipelineDepth > MAX_PIPELINE) {
+    errx(EXIT_FAILURE, "the pipeline has to be between 1 and %d requests deep", MAX_PIPELINE);
+  }
+  if (newConnections) {
+    pipelineDepth = 1;
+  }
+  char longestName[KEY_NAME_SIZE + 16];
+  snprintf(longestName, sizeof longestName, numOfKeys == 1 ? "%s" : "%s%u", fileName, numOfKeys - 1);
+  if (strlen(longestName) >= KEY_NAME_SIZE) {
+    errx(EXIT_FAILURE, "key names such as %s are too long for the server", longestName);
+  }
+
+  putBody = malloc(putBytes + 1);
+  if (putBody == NULL) {
+    err(EXIT_FAILURE, "cannot allocate the PUT body");
+  }
+  for (long i = 0; i < putBytes; ++i)
+    putBody[i] = 'a' + i % 26;
+
+  if (zipf > 0) {
+    keyCdf = malloc(numOfKeys * sizeof *keyCdf);
+    if (keyCdf == NULL) {
+      err(EXIT_FAILURE, "cannot allocate the key distribution");
+    }
+    double total = 0;
+    for (uint32_t r = 0; r < numOfKeys; ++r)
+      total += keyCdf[r] = 1 / pow(r + 1, zipf);
+    double sum = 0;
+    for (uint32_t r = 0; r < numOfKeys; ++r)
+      keyCdf[r] = (sum += keyCdf[r]) / total;
+  }
+
+  if (initKeys) {
+    init_keys();
+  }
+
+  startNs = now_ns();
+  measureNs = startNs + warmupSeconds * 1e9;
+  endNs = measureNs + seconds * 1e9;
+
+  static struct Worker workers[MAX_THREADS];
+  static struct Connection* connections;
+  connections = calloc(numOfConnections, sizeof *connections);
+  if (connections == NULL) {
+    err(EXIT_FAILURE, "cannot allocate connections");
+  }
+  uint64_t seed = startNs ^ ((uint64_t) getpid() << 32);
+  for (int i = 0; i < numOfConnections; ++i) {
+    connections[i].fd = -1;
+    connections[i].bodyLeft = -1;
+    // connection i gets every numOfConnections-th slot of the arrival schedule
+    connections[i].nextDueNs = startNs + (rate > 0 ? 1e9 * i / rate : 0);
+  }
+  for (int t = 0, firstConn = 0; t < numOfThreads; ++t) {
+    struct Worker* worker = &workers[t];
+    int count = numOfConnections / numOfThreads + (t < numOfConnections % numOfThreads);
+    worker->connections = connections + firstConn;
+    worker->numOfConnections = count;
+    firstConn += count;
+    worker->random = seed + 0x9e3779b97f4a7c15ull * (t + 1);
+    worker->epollfd = epoll_create1(0);
+    worker->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (worker->epollfd < 0 || worker->timerfd < 0) {
+      err(EXIT_FAILURE, "cannot create the event loop");
+    }
+    if (pthread_create(&worker->thread, NULL, &t_run_worker, worker) != 0) {
+      err(EXIT_FAILURE, "cannot create thread");
+    }
+  }
+
+  struct Histogram latency[NUM_OF_METHODS], all;
+  memset(latency, 0, sizeof latency);
+  memset(&all, 0, sizeof all);
+  uint64_t statuses[600] = { 0 };
+  uint64_t connectionErrors = 0, retries = 0, bytesIn = 0, bytesOut = 0, non2xx = 0;
+  for (int t = 0; t < numOfThreads; ++t) {
+    struct Worker* worker = &workers[t];
+    pthread_join(worker->thread, NULL);
+    for (int m = 0; m < NUM_OF_METHODS; ++m) {
+      hist_merge(&latency[m], &worker->latency[m]);
+      hist_merge(&all, &worker->latency[m]);
+    }
+    for (int i = 0; i < 600; ++i)
+      statuses[i] += worker->statuses[i];
+    connectionErrors += worker->connectionErrors;
+    retries += worker->retries;
+    bytesIn += worker->bytesIn;
+    bytesOut += worker->bytesOut;
+  }
+  for (int i = 0; i < 600; ++i) {
+    if (i < 200 || i >= 300)
+      non2xx += statuses[i];
+  }
+  double elapsed = seconds;
+
+  printf("%lu requests in %.1f s, %.0f req/s, %.1f MB/s in, %.1f MB/s out, %lu non-2xx responses, %lu connection errors, %lu retried\n",
+      all.count,
+      elapsed,
+      all.count / elapsed,
+      bytesIn / elapsed / 1e6,
+      bytesOut / elapsed / 1e6,
+      non2xx,
+      connectionErrors,
+      retries
+  );
+  printf("%-6s %10s %9s %9s %9s %9s %9s %9s\n", "us", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+  for (int m = 0; m < NUM_OF_METHODS; ++m)
+    print_latencies(methodNames[m], &latency[m]);
+  print_latencies("all", &all);
+  print_histogram(&all);
+
+  if (resultFileName != NULL) {
+    write_result(resultFileName, elapsed, latency, &all, statuses, connectionErrors, retries, bytesIn, bytesOut);
+  }
+  return connectionErrors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "httpparse.h"
+
+#define READBUF_INITIAL_SIZE 512
+
+// characters allowed in methods and header names (RFC 9110 tchar), 32 per row
+static const unsigned char tokenChars[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static int is_token_char(unsigned char c) {
+  return tokenChars[c];
+}
+
+// characters allowed in header values, including spaces and tabs, 32 per row
+static const unsigned char valueChars[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+static int is_value_char(unsigned char c) {
+  return valueChars[c];
+}
+
+long http_head_length(const char* buf, size_t len, size_t* scanned) {
+  size_t start = *scanned;
+  if (start >= len) {
+    return HTTP_PARSE_INCOMPLETE;
+  }
+
+  const char* end = memmem(buf + start, len - start, "\r\n\r\n", 4);
+  if (end == NULL) {
+    // the terminator may straddle the bytes we have and the ones still to come
+    *scanned = len >= 3 ? len - 3 : 0;
+    return HTTP_PARSE_INCOMPLETE;
+  }
+  *scanned = end - buf;
+  return end - buf + 4;
+}
+
+// consumes a run of token characters, returning how many there were
+static size_t parse_token(const char* p, const char* end) {
+  const char* start = p;
+  while (p < end && is_token_char((unsigned char) *p))
+    p++;
+  return p - start;
+}
+
+long http_parse_request(const char* buf, size_t len, size_t* scanned, struct HttpRequest* request) {
+  long headLen = http_head_length(buf, len, scanned);
+  if (headLen == HTTP_PARSE_INCOMPLETE) {
+    return len >= HTTP_MAX_HEAD_SIZE ? HTTP_PARSE_ERROR : HTTP_PARSE_INCOMPLETE;
+  }
+  if (headLen > HTTP_MAX_HEAD_SIZE) {
+    return HTTP_PARSE_ERROR;
+  }
+
+  const char* p = buf;
+  const char* end = buf + headLen - 2; // every line below ends in a CRLF before this
+
+  // REQUEST LINE: method SP target SP HTTP/x.y CRLF
+
+  request->method.data = p;
+  request->method.len = parse_token(p, end);
+  p += request->method.len;
+  if (request->method.len == 0 || p >= end || *p++ != ' ') {
+    return HTTP_PARSE_ERROR;
+  }
+
+  request->target.data = p;
+  while (p < end && *p > 0x20 && *p != 0x7f)
+    p++;
+  request->target.len = p - request->target.data;
+  if (request->target.len == 0 || p >= end || *p++ != ' ') {
+    return HTTP_PARSE_ERROR;
+  }
+
+  if (end - p < 10 || memcmp(p, "HTTP/", 5) != 0 || !isdigit((unsigned char) p[5]) || p[6] != '.'
+      || !isdigit((unsigned char) p[7]) || p[8] != '\r' || p[9] != '\n') {
+    return HTTP_PARSE_ERROR;
+  }
+  request->version.data = p + 5;
+  request->version.len = 3;
+  p += 10;
+
+  // HEADERS: name ":" OWS value OWS CRLF
+
+  request->numOfHeaders = 0;
+  while (p < end) {
+    if (request->numOfHeaders == HTTP_MAX_HEADERS) {
+      return HTTP_PARSE_ERROR;
+    }
+    struct HttpHeader* header = &request->headers[request->numOfHeaders++];
+
+    header->name.data = p;
+    header->name.len = parse_token(p, end);
+    p += header->name.len;
+    if (header->name.len == 0 || p >= end || *p++ != ':') {
+      return HTTP_PARSE_ERROR;
+    }
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    header->value.data = p;
+
+    // the head is known to end in a CRLF, so the line always has one
+    const char* lineEnd = memchr(p, '\r', end + 2 - p);
+    if (lineEnd >= end || lineEnd[1] != '\n') {
+      return HTTP_PARSE_ERROR;
+    }
+    for (; p < lineEnd; ++p) {
+      if (!is_value_char((unsigned char) *p))
+        return HTTP_PARSE_ERROR;
+    }
+    while (p > header->value.data && (p[-1] == ' ' || p[-1] == '\t'))
+      p--;
+    header->value.len = p - header->value.data;
+    p = lineEnd + 2;
+  }
+
+  request->headLen = headLen;
+  return headLen;
+}
+
+const struct HttpSlice* http_find_header(const struct HttpRequest* request, const char* name) {
+  for (int i = 0; i < request->numOfHeaders; ++i) {
+    if (http_slice_equals(request->headers[i].name, name)) {
+      return &request->headers[i].value;
+    }
+  }
+  return NULL;
+}
+
+int http_slice_equals(struct HttpSlice slice, const char* str) {
+  return strlen(str) == slice.len && strncasecmp(slice.data, str, slice.len) == 0;
+}
+
+int http_has_token(struct HttpSlice value, const char* token) {
+  const char* p = value.data;
+  const char* end = value.data + value.len;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      p++;
+    const char* start = p;
+    while (p < end && *p != ',')
+      p++;
+    const char* last = p;
+    while (last > start && (last[-1] == ' ' || last[-1] == '\t'))
+      last--;
+
+    struct HttpSlice element = { start, last - start };
+    if (element.len > 0 && http_slice_equals(element, token)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// ACCEPT-ENCODING: #( codings [ OWS ";" OWS "q=" qvalue ] ), qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] )
+
+// parses a qvalue into thousandths, or returns -1 if it is malformed
+static int parse_qvalue(const char* p, const char* end) {
+  if (p == end || (*p != '0' && *p != '1'))
+    return -1;
+  int quality = (*p++ - '0') * 1000;
+  if (p < end && *p == '.') {
+    p++;
+    for (int scale = 100; p < end && isdigit((unsigned char) *p) && scale > 0; ++p, scale /= 10) {
+      quality += (*p - '0') * scale;
+    }
+  }
+  return p == end && quality <= 1000 ? quality : -1;
+}
+
+int http_accept_quality(struct HttpSlice acceptEncoding, const char* coding) {
+  const char* p = acceptEncoding.data;
+  const char* end = acceptEncoding.data + acceptEncoding.len;
+  int wildcard = 0;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      p++;
+    const char* start = p;
+    while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+      p++;
+    struct HttpSlice name = { start, p - start };
+
+    // the only parameter that matters is q, the others are skipped
+    int quality = 1000;
+    while (p < end && *p != ',') {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ';'))
+        p++;
+      const char* param = p;
+      while (p < end && *p != ',' && *p != ';')
+        p++;
+      const char* last = p;
+      while (last > param && (last[-1] == ' ' || last[-1] == '\t'))
+        last--;
+      if (last - param >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+        quality = parse_qvalue(param + 2, last);
+      }
+    }
+    if (name.len == 0 || quality < 0) {
+      continue;
+    }
+
+    if (http_slice_equals(name, coding)) {
+      return quality;
+    } else if (http_slice_equals(name, "*")) {
+      wildcard = quality;
+    }
+  }
+  return wildcard;
+}
+
+// reads the digits at *p into *value, saturating rather than overflowing. Returns 0 if there are none
+static int parse_digits(const char** p, const char* end, long long* value) {
+  const char* start = *p;
+  long long n = 0;
+  for (; *p < end && isdigit((unsigned char) **p); ++*p) {
+    int digit = **p - '0';
+    n = n > (LLONG_MAX - digit) / 10 ? LLONG_MAX : n * 10 + digit;
+  }
+  *value = n;
+  return *p > start;
+}
+
+// RANGES: "bytes=" 1#( first "-" [ last ] / "-" suffix-length )
+
+int http_parse_ranges(struct HttpSlice value, long long size, struct HttpRange ranges[], int maxRanges) {
+  const char* p = value.data;
+  const char* end = value.data + value.len;
+  if (value.len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+    return -1;
+  }
+  p += 6;
+
+  int numOfParts = 0, numOfRanges = 0;
+  while (1) {
+    // empty list elements are allowed and skipped
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      p++;
+    if (p >= end)
+      break;
+    if (++numOfParts > maxRanges)
+      return -1;
+
+    long long first, last;
+    if (*p == '-') {
+      // the last suffix bytes of the file
+      long long suffix;
+      p++;
+      if (!parse_digits(&p, end, &suffix))
+        return -1;
+      first = suffix >= size ? 0 : size - suffix;
+      last = suffix > 0 ? size - 1 : -1;
+    } else {
+      if (!parse_digits(&p, end, &first) || p >= end || *p++ != '-')
+        return -1;
+      if (!parse_digits(&p, end, &last))
+        last = LLONG_MAX;
+      else if (last < first)
+        return -1;
+      if (last >= size)
+        last = size - 1;
+    }
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    if (p < end && *p != ',')
+      return -1;
+
+    // ranges starting past the end of the file, or empty ones, can't be served
+    if (first <= last) {
+      ranges[numOfRanges].first = first;
+      ranges[numOfRanges].last = last;
+      numOfRanges++;
+    }
+  }
+  return numOfParts > 0 ? numOfRanges : -1;
+}
+
+int http_parse_date(struct HttpSlice value, time_t* date) {
+  static const char* formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",    // IMF-fixdate
+    "%A, %d-%b-%y %H:%M:%S GMT",    // RFC 850
+    "%a %b %e %H:%M:%S %Y",         // asctime
+  };
+
+  char text[64];
+  if (value.len >= sizeof text) {
+    return -1;
+  }
+  memcpy(text, value.data, value.len);
+  text[value.len] = '\0';
+
+  for (size_t i = 0; i < sizeof formats / sizeof formats[0]; ++i) {
+    struct tm tm;
+    memset(&tm, 0, sizeof tm);
+    const char* rest = strptime(text, formats[i], &tm);
+    if (rest != NULL && *rest == '\0') {
+      *date = timegm(&tm);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void http_chunks_init(struct ChunkDecoder* decoder) {
+  decoder->state = CHUNK_SIZE;
+  decoder->remaining = 0;
+  decoder->lineLen = 0;
+  decoder->trailerLen = 0;
+}
+
+// value of a hex digit, or -1
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+long http_decode_chunks(struct ChunkDecoder* decoder, const char* buf, size_t len, struct HttpSlice* data) {
+  const char* p = buf;
+  const char* end = buf + len;
+  data->data = buf;
+  data->len = 0;
+
+  while (p < end && decoder->state != CHUNK_DONE) {
+    // data runs are handed back whole, everything else goes a byte at a time
+    if (decoder->state == CHUNK_DATA) {
+      size_t run = end - p < decoder->remaining ? (size_t) (end - p) : (size_t) decoder->remaining;
+      data->data = p;
+      data->len = run;
+      decoder->remaining -= run;
+      if (decoder->remaining == 0)
+        decoder->state = CHUNK_DATA_CR;
+      return p + run - buf;
+    }
+
+    char c = *p++;
+    if (decoder->state == CHUNK_SIZE || decoder->state == CHUNK_EXTENSION ||
+        decoder->state == CHUNK_TRAILER_LINE) {
+      if (++decoder->lineLen > HTTP_MAX_CHUNK_LINE)
+        return HTTP_PARSE_ERROR;
+    }
+    if (decoder->state >= CHUNK_TRAILER) {
+      if (++decoder->trailerLen > HTTP_MAX_HEAD_SIZE)
+        return HTTP_PARSE_ERROR;
+    }
+
+    switch (decoder->state) {
+      case CHUNK_SIZE: {
+        int digit = hex_value(c);
+        if (digit >= 0) {
+          // sizes past 2^60 can't be real
+          if (decoder->remaining >> 60)
+            return HTTP_PARSE_ERROR;
+          decoder->remaining = decoder->remaining * 16 + digit;
+          break;
+        }
+        // a size needs at least one digit
+        if (decoder->lineLen == 1)
+          return HTTP_PARSE_ERROR;
+        if (c == '\r')
+          decoder->state = CHUNK_SIZE_LF;
+        else if (c == ';' || c == ' ' || c == '\t')
+          decoder->state = CHUNK_EXTENSION;
+        else
+          return HTTP_PARSE_ERROR;
+        break;
+      }
+      case CHUNK_EXTENSION:
+        if (c == '\r')
+          decoder->state = CHUNK_SIZE_LF;
+        else if (c == '\n')
+          return HTTP_PARSE_ERROR;
+        break;
+      case CHUNK_SIZE_LF:
+        if (c != '\n')
+          return HTTP_PARSE_ERROR;
+        decoder->lineLen = 0;
+        decoder->state = decoder->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        break;
+      case CHUNK_DATA_CR:
+        if (c != '\r')
+          return HTTP_PARSE_ERROR;
+        decoder->state = CHUNK_DATA_LF;
+        break;
+      case CHUNK_DATA_LF:
+        if (c != '\n')
+          return HTTP_PARSE_ERROR;
+        decoder->state = CHUNK_SIZE;
+        break;
+      case CHUNK_TRAILER:
+        if (c == '\r') {
+          decoder->state = CHUNK_END_LF;
+        } else if (c == '\n') {
+          return HTTP_PARSE_ERROR;
+        } else {
+          decoder->lineLen = 1;
+          decoder->state = CHUNK_TRAILER_LINE;
+        }
+        break;
+      case CHUNK_TRAILER_LINE:
+        if (c == '\r')
+          decoder->state = CHUNK_TRAILER_LF;
+        else if (c == '\n')
+          return HTTP_PARSE_ERROR;
+        break;
+      case CHUNK_TRAILER_LF:
+        if (c != '\n')
+          return HTTP_PARSE_ERROR;
+        decoder->lineLen = 0;
+        decoder->state = CHUNK_TRAILER;
+        break;
+      case CHUNK_END_LF:
+        if (c != '\n')
+          return HTTP_PARSE_ERROR;
+        decoder->state = CHUNK_DONE;
+        break;
+      case CHUNK_DATA:
+      case CHUNK_DONE:
+        break;
+    }
+  }
+  return p - buf;
+}
+
+void http_chunks_skip(struct ChunkDecoder* decoder, long long len) {
+  decoder->remaining -= len;
+  if (decoder->remaining == 0)
+    decoder->state = CHUNK_DATA_CR;
+}
+
+int http_format_date(time_t date, char* out) {
+  // spelled out here because strftime's names follow the locale
+  static const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+  struct tm tm;
+  gmtime_r(&date, &tm);
+  return snprintf(out, HTTP_DATE_SIZE, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+      days[tm.tm_wday],
+      tm.tm_mday,
+      months[tm.tm_mon],
+      tm.tm_year + 1900,
+      tm.tm_hour,
+      tm.tm_min,
+      tm.tm_sec
+  );
+}
+
+void readbuf_init(struct ReadBuffer* buffer) {
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->cap = 0;
+  buffer->scanned = 0;
+}
+
+void readbuf_free(struct ReadBuffer* buffer) {
+  free(buffer->data);
+  readbuf_init(buffer);
+}
+
+size_t readbuf_reserve(struct ReadBuffer* buffer) {
+  if (buffer->len < buffer->cap) {
+    return buffer->cap - buffer->len;
+  }
+  if (buffer->cap >= HTTP_MAX_HEAD_SIZE) {
+    return 0;
+  }
+
+  size_t cap = buffer->cap == 0 ? READBUF_INITIAL_SIZE : buffer->cap * 2;
+  char* data = realloc(buffer->data, cap);
+  if (data == NULL) {
+    err(EXIT_FAILURE, "cannot grow read buffer");
+  }
+  buffer->data = data;
+  buffer->cap = cap;
+  return buffer->cap - buffer->len;
+}
+
+void readbuf_consume(struct ReadBuffer* buffer, size_t n) {
+  if (n > buffer->len)
+    n = buffer->len;
+  memmove(buffer->data, buffer->data + n, buffer->len - n);
+  buffer->len -= n;
+  buffer->scanned = 0;
+}
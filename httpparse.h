@@ -0,0 +1,163 @@
+#ifndef HTTPPARSE_H
+#define HTTPPARSE_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_HEAD_SIZE 8192   // request heads larger than this are rejected
+#define HTTP_MAX_RANGES 16        // Range headers asking for more parts than this are ignored
+#define HTTP_MAX_CHUNK_LINE 1024  // longest chunk size line, extensions included, or trailer line
+
+#define HTTP_PARSE_INCOMPLETE -1  // the head hasn't fully arrived yet
+#define HTTP_PARSE_ERROR -2       // the head is malformed or too large
+
+/**
+   A view into the buffer a request was parsed from. Slices are not NUL
+   terminated and are only valid until the buffer is changed.
+ */
+struct HttpSlice {
+  const char* data;
+  size_t len;
+};
+
+struct HttpHeader {
+  struct HttpSlice name;
+  struct HttpSlice value;   // without surrounding whitespace
+};
+
+struct HttpRequest {
+  struct HttpSlice method;
+  struct HttpSlice target;
+  struct HttpSlice version; // "1.0", "1.1", ... without the "HTTP/"
+  struct HttpHeader headers[HTTP_MAX_HEADERS];
+  int numOfHeaders;
+  size_t headLen;           // bytes up to and including the blank line
+};
+
+/**
+   Finds the end of the request head at the start of buf. *scanned keeps
+   how far earlier calls on the same bytes got, so a head that arrives a
+   few bytes at a time is only searched once; start it at 0 for every new
+   head. Returns the length of the head including the blank line, or
+   HTTP_PARSE_INCOMPLETE.
+ */
+long http_head_length(const char* buf, size_t len, size_t* scanned);
+
+/**
+   Parses the request head at the start of buf without copying it: the
+   slices in request point into buf. Bytes after the head (a body or the
+   next pipelined request) are left alone. Returns the length of the head,
+   HTTP_PARSE_INCOMPLETE, or HTTP_PARSE_ERROR.
+ */
+long http_parse_request(const char* buf, size_t len, size_t* scanned, struct HttpRequest* request);
+
+// looks up a header, ignoring case in its name. Returns NULL if it is missing
+const struct HttpSlice* http_find_header(const struct HttpRequest* request, const char* name);
+
+// compares a slice to a string, ignoring case
+int http_slice_equals(struct HttpSlice slice, const char* str);
+
+// checks a comma separated header value such as Connection for a token, ignoring case
+int http_has_token(struct HttpSlice value, const char* token);
+
+/**
+   Looks up coding in an Accept-Encoding value such as "gzip;q=0.8, *;q=0.1"
+   and returns its quality in thousandths: 1000 if it is listed without a
+   q parameter, what "*" gets if it isn't listed at all, and 0 if it isn't
+   acceptable. Names are compared ignoring case.
+ */
+int http_accept_quality(struct HttpSlice acceptEncoding, const char* coding);
+
+// an inclusive range of byte offsets into a file
+struct HttpRange {
+  long long first;
+  long long last;
+};
+
+/**
+   Parses a Range header value such as "bytes=0-99,200-,-50" for a file of
+   size bytes. The satisfiable ranges are clamped to the file and stored in
+   ranges in the order they were asked for. Returns how many there are, 0
+   if none can be satisfied, or -1 if the value is malformed, isn't in bytes
+   or has more than maxRanges parts, in which case it should be ignored.
+ */
+int http_parse_ranges(struct HttpSlice value, long long size, struct HttpRange ranges[], int maxRanges);
+
+/**
+   Parses an HTTP date in any of the formats a recipient has to accept:
+   "Sun, 06 Nov 1994 08:49:37 GMT" and the obsolete RFC 850 and asctime
+   ones. Returns 0 and sets *date, or -1 if value isn't one of them.
+ */
+int http_parse_date(struct HttpSlice value, time_t* date);
+
+#define HTTP_DATE_SIZE 30 // "Sun, 06 Nov 1994 08:49:37 GMT" and its terminator
+
+/**
+   Writes date as an IMF-fixdate, the format every date header is sent in,
+   to out, which has room for HTTP_DATE_SIZE bytes. Returns its length.
+ */
+int http_format_date(time_t date, char* out);
+
+enum ChunkState {
+  CHUNK_SIZE,           // hex digits of the chunk size
+  CHUNK_EXTENSION,      // anything after the size up to the end of the line
+  CHUNK_SIZE_LF,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,        // the line break after the data
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER,        // start of a trailer line, or the blank line ending the body
+  CHUNK_TRAILER_LINE,
+  CHUNK_TRAILER_LF,
+  CHUNK_END_LF,
+  CHUNK_DONE
+};
+
+/**
+   Decoder for a body sent with "Transfer-Encoding: chunked". It keeps
+   nothing but its place in the framing, so the body can be fed to it in
+   pieces of any size as they arrive.
+ */
+struct ChunkDecoder {
+  enum ChunkState state;
+  long long remaining;      // size of the chunk, then how much of its data is left
+  size_t lineLen;           // bytes of the size or trailer line so far
+  size_t trailerLen;        // bytes of trailers so far
+};
+
+void http_chunks_init(struct ChunkDecoder* decoder);
+
+/**
+   Decodes the chunked body bytes in buf up to the next run of data, which
+   is returned in *data without being copied, and may be empty. Extensions
+   and trailers are skipped. Returns how many bytes of buf were used,
+   including the data, or HTTP_PARSE_ERROR if the framing is malformed or
+   a line is too long. Once decoder->state is CHUNK_DONE the body is over,
+   and the rest of buf belongs to whatever follows it.
+ */
+long http_decode_chunks(struct ChunkDecoder* decoder, const char* buf, size_t len, struct HttpSlice* data);
+
+// accounts for len bytes of the current chunk's data that were read without going through the decoder
+void http_chunks_skip(struct ChunkDecoder* decoder, long long len);
+
+/**
+   Growable buffer for the bytes read off a connection. It starts out empty
+   and doubles as needed up to HTTP_MAX_HEAD_SIZE.
+ */
+struct ReadBuffer {
+  char* data;
+  size_t len;       // bytes in data
+  size_t cap;
+  size_t scanned;   // progress of http_head_length on the head at the start of data
+};
+
+void readbuf_init(struct ReadBuffer* buffer);
+void readbuf_free(struct ReadBuffer* buffer);
+
+// makes room to read more into data + len. Returns the free space, 0 once the buffer is full
+size_t readbuf_reserve(struct ReadBuffer* buffer);
+
+// drops the first n bytes, keeping whatever follows them
+void readbuf_consume(struct ReadBuffer* buffer, size_t n);
+
+#endif
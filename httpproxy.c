@@ -10,8 +10,13 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/socket.h>
 
+#include "connqueue.h"
+#include "httpparse.h"
+
 #define BUFFER_SIZE 512
 #define QUEUE_SIZE 512
 
@@ -19,40 +24,41 @@ uint16_t strtouint16(char number[]);
 int isStrInt(char* str);
 int valid_filename(char fileName[]);
 
-int create_listen_socket(uint16_t port);
+int create_listen_socket(uint16_t port, int reuse);
 int create_client_socket(uint16_t port);
+int server_connection_usable(int clientConnfd);
 void parseArgs(int argc, char *argv[]);
 void handle_connection(int connfd);
 void getHealthcheck();
 int getServerPort(int connfd);
-int checkCache(int clientConnfd, int port, char resourceName[]);
-int isCachedFileUpToDate(char cachedModifyDate[], char serverModifyDate[]);
-void getServerLastModified(int clientConnfd, int port, char resourceName[], char serverLastModified[]);
-void sendCachedResponseToClient(int connfd, int index);
+struct CachedFilesInfo;
+int checkCache(char resourceName[], struct CachedFilesInfo* copy);
+int addIfModifiedSince(char buffer[], int requestBytes, time_t lastModified, char conditional[]);
+void sendCachedResponseToClient(int connfd, struct CachedFilesInfo* cached);
 void* t_waitForReq(void* arg);
+void* t_acceptReq(void* arg);
 void* t_healthcheck(void* arg);
 void process_request(int connfd);
 int parseRequestHeaders(char buffer[], int connfd, char method[], char resource[], char httpVer[], char host[]);
-void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[]);
+void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[], struct CachedFilesInfo* cached, int mayCache);
 void send_response_fail(int connfd, int statusCode);
 const char* generate_status_msg(int code);
 
 
 // GLOBAL VARIABLES
-pthread_mutex_t m_queue = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t m_healthcheck = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t m_cache = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t c_gotRequest = PTHREAD_COND_INITIALIZER;
 pthread_cond_t c_performHC = PTHREAD_COND_INITIALIZER;
 pthread_cond_t c_useCache = PTHREAD_COND_INITIALIZER;
 
-int connQueue[QUEUE_SIZE]; // queue of connfds and their server ports
-int connQueueCount = 0;
+struct ConnQueue connQueue; // queue of connfds
 
 int numOfThreads = 5, healthcheckInterval = 5, reqSinceLastHC = 0, healthchecksNeeded = 0;
 
 int numOfCachedFiles = 3, maxCachedBytes = 1024;
 
+int reusePort = 0; // each worker accepts on its own SO_REUSEPORT listener instead of main
+
 uint16_t clientPort;
 uint16_t* serverPorts;
 int numOfServerPorts = 0;
@@ -66,7 +72,7 @@ struct HealthcheckInfo* healthchecks;
 
 struct CachedFilesInfo {
   char resourceName[20];
-  char lastModified[40];
+  time_t lastModified;
   char* content;
   int contentLength;
 };
@@ -79,15 +85,20 @@ int main(int argc, char *argv[]) {
   parseArgs(argc, argv);
 
   // initialize healthchecks array
-  healthchecks = malloc(numOfServerPorts * sizeof(healthchecks));
+  healthchecks = malloc(numOfServerPorts * sizeof *healthchecks);
 
   // initialize cached cached files array
-  cachedFiles = malloc(numOfCachedFiles * sizeof(cachedFiles));
+  cachedFiles = malloc(numOfCachedFiles * sizeof *cachedFiles);
   for (int i = 0; i < numOfCachedFiles; ++i) {
     strcpy(cachedFiles[i].resourceName, "hey!!!");
     cachedFiles[i].content = malloc(maxCachedBytes * sizeof(char));
   }
 
+  connqueue_init(&connQueue, QUEUE_SIZE);
+
+  // a server closing a kept-alive connection shouldn't kill the proxy
+  signal(SIGPIPE, SIG_IGN);
+
   getHealthcheck();
 
   pthread_t healthcheckThread;
@@ -96,7 +107,22 @@ int main(int argc, char *argv[]) {
   }
   
   // create a listening socket on the client's port number
-  listenfd = create_listen_socket(clientPort);
+  listenfd = create_listen_socket(clientPort, reusePort);
+
+  // with -p every worker accepts on a listener of its own, so connections
+  // never go through main or connQueue
+  if (reusePort) {
+    pthread_t t_ids[numOfThreads];
+    for (int i = 0; i < numOfThreads; ++i) {
+      int workerfd = i == 0 ? listenfd : create_listen_socket(clientPort, 1);
+      if (pthread_create(&t_ids[i], NULL, &t_acceptReq, (void*) (intptr_t) workerfd) != 0) {
+        perror("Failed to create thread");
+      }
+    }
+    for (int i = 0; i < numOfThreads; ++i) {
+      pthread_join(t_ids[i], NULL);
+    }
+  }
 
   // create array of n threads
 	pthread_t t_ids[numOfThreads];
@@ -174,13 +200,21 @@ int valid_filename(char fileName[]) {
    Creates a socket for listening for connections.
    Closes the program and prints an error message on error.
  */
-int create_listen_socket(uint16_t port) {
+int create_listen_socket(uint16_t port, int reuse) {
   struct sockaddr_in addr;
   int listenfd = socket(AF_INET, SOCK_STREAM, 0);
   if (listenfd < 0) {
     err(EXIT_FAILURE, "socket error");
   }
 
+  // a restarted proxy can bind again while old connections are in TIME_WAIT,
+  // and with reuse any number of listeners share the port
+  int one = 1;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (reuse && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0) {
+    err(EXIT_FAILURE, "setsockopt SO_REUSEPORT error");
+  }
+
   memset(&addr, 0, sizeof addr);
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = htons(INADDR_ANY);
@@ -214,11 +248,22 @@ int create_client_socket(uint16_t port) {
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
   addr.sin_port = htons(port);
   if (connect(clientfd, (struct sockaddr*) &addr, sizeof addr)) {
+    close(clientfd);
     return -1;
   }
   return clientfd;
 }
 
+/*
+  Checks whether a kept-alive connection to a server can take another
+  request. The server answers each request before we send the next, so
+  anything readable now means it has hung up (idle timeout or request limit).
+*/
+int server_connection_usable(int clientConnfd) {
+  struct pollfd pfd = { .fd = clientConnfd, .events = POLLIN };
+  return poll(&pfd, 1, 0) == 0;
+}
+
 /*
   Parses the args from the command line and assigns them to their
   respective variables
@@ -227,9 +272,9 @@ void parseArgs(int argc, char *argv[]) {
   int opt;
   
   // parsing through the flags
-  while((opt = getopt(argc, argv, ":N:R:s:m:")) != -1) {
-    // check to see if option was a pos int
-    if (!isStrInt(optarg)) {
+  while((opt = getopt(argc, argv, ":N:R:s:m:p")) != -1) {
+    // check to see if option was a pos int, -p takes no value
+    if (opt != 'p' && !isStrInt(optarg)) {
       errx(EXIT_FAILURE, "option -%c has to be a positive integer", optopt);
     }
     switch (opt) {
@@ -245,6 +290,9 @@ void parseArgs(int argc, char *argv[]) {
       case 'm':
         maxCachedBytes = atoi(optarg);
         break;
+      case 'p':
+        reusePort = 1;
+        break;
       case ':':
         errx(EXIT_FAILURE, "option -%c needs a value", optopt);
       case '?':
@@ -296,25 +344,8 @@ void* t_healthcheck(void* arg) {
 
 // dispatcher function
 void handle_connection(int connfd) {
-  // wait if queue is full (this will never happen in this program's scope)
-  while (connQueueCount == QUEUE_SIZE) {  }
-
-  /* ---------- START CRIT REGION ---------- */
-  int rc = pthread_mutex_lock(&m_queue);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
-  }
-
-  // push connfd and onto queue
-  connQueue[connQueueCount] = connfd;
-  connQueueCount++;
-
-  // signal to worker threads that there is a new connection to grab
-  pthread_cond_signal(&c_gotRequest);
-
-  pthread_mutex_unlock(&m_queue);
-  /* ----------- END CRIT REGION ----------- */
+  // push connfd onto the queue, waiting if it is full, and wake a single worker thread
+  connqueue_push(&connQueue, connfd);
 }
 
 void getHealthcheck() {
@@ -414,207 +445,71 @@ int getServerPort(int connfd) {
 }
 
 /*
-  checks to see if the requested file is already in the cache and is up to date
-  returns the index of the cached file if it meets those requirements, else returns -1
+  checks to see if the requested file is in the cache, and copies it into copy,
+  whose content has room for maxCachedBytes, so it can be sent after the lock is dropped
+  returns 1 if the file was found, else returns 0
 */
-int checkCache(int clientConnfd, int port, char resourceName[]) {
+int checkCache(char resourceName[], struct CachedFilesInfo* copy) {
   // loop through the cached files
   for (int i = 0; i < numOfCachedFiles; ++i) {
-    // if requested file is in cache AND it is up to date, return index of cached file
     if (strcmp(resourceName, cachedFiles[i].resourceName) == 0) {
-      char serverLastModified[40];
-      getServerLastModified(clientConnfd, port, resourceName, serverLastModified);
-      if ( isCachedFileUpToDate(cachedFiles[i].lastModified, serverLastModified) ) {
-        return i;
-      }
-    }
-  }
-
-  // else return -1
-  return -1;
-}
-
-/*
-  checks to see if the cached file is up to date
-  returns 1 if the cached file's last modified date is later or equal to the servers, else returns 0
-*/
-int isCachedFileUpToDate(char cachedModifyDate[], char serverModifyDate[]) {
-  char cDayName[4], sDayName[4];
-  int cDay = 0, sDay = 0;
-  char cMonthStr[4], sMonthStr[4];
-  int cMonth = 0, sMonth = 0;
-  int cYear = 0, sYear = 0;
-  int cHour = 0, sHour = 0;
-  int cMinute = 0, sMinute = 0;
-  int cSecond = 0, sSecond = 0;
-  
-  // parse the cached file's last-modified date
-  sscanf(cachedModifyDate, "%s, %d %s %d %d:%d:%d GMT",
-      cDayName, &cDay, cMonthStr, &cYear, &cHour, &cMinute, &cSecond
-  );
-
-  // parse the server file's last-modified date
-  sscanf(serverModifyDate, "%s, %d %s %d %d:%d:%d GMT",
-      sDayName, &sDay, sMonthStr, &sYear, &sHour, &sMinute, &sSecond
-  );
-
-  // convert month from string to int for comparison
-  if (strcmp(cMonthStr, "Jan") == 0)
-    cMonth = 0;
-  else if (strcmp(cMonthStr, "Feb") == 0)
-    cMonth = 1;
-  else if (strcmp(cMonthStr, "Mar") == 0)
-    cMonth = 2;
-  else if (strcmp(cMonthStr, "Apr") == 0)
-    cMonth = 3;
-  else if (strcmp(cMonthStr, "May") == 0)
-    cMonth = 4;
-  else if (strcmp(cMonthStr, "Jun") == 0)
-    cMonth = 5;
-  else if (strcmp(cMonthStr, "Jul") == 0)
-    cMonth = 6;
-  else if (strcmp(cMonthStr, "Aug") == 0)
-    cMonth = 7;
-  else if (strcmp(cMonthStr, "Sep") == 0)
-    cMonth = 8;
-  else if (strcmp(cMonthStr, "Oct") == 0)
-    cMonth = 9;
-  else if (strcmp(cMonthStr, "Nov") == 0)
-    cMonth = 10;
-  else if (strcmp(cMonthStr, "Dec") == 0)
-    cMonth = 11;
-
-  if (strcmp(sMonthStr, "Jan") == 0)
-    sMonth = 0;
-  else if (strcmp(sMonthStr, "Feb") == 0)
-    sMonth = 1;
-  else if (strcmp(sMonthStr, "Mar") == 0)
-    sMonth = 2;
-  else if (strcmp(sMonthStr, "Apr") == 0)
-    sMonth = 3;
-  else if (strcmp(sMonthStr, "May") == 0)
-    sMonth = 4;
-  else if (strcmp(sMonthStr, "Jun") == 0)
-    sMonth = 5;
-  else if (strcmp(sMonthStr, "Jul") == 0)
-    sMonth = 6;
-  else if (strcmp(sMonthStr, "Aug") == 0)
-    sMonth = 7;
-  else if (strcmp(sMonthStr, "Sep") == 0)
-    sMonth = 8;
-  else if (strcmp(sMonthStr, "Oct") == 0)
-    sMonth = 9;
-  else if (strcmp(sMonthStr, "Nov") == 0)
-    sMonth = 10;
-  else if (strcmp(sMonthStr, "Dec") == 0)
-    sMonth = 11;
-
-  // check if years are different
-  if (cYear != sYear) {
-    if (cYear > sYear) {
+      copy->lastModified = cachedFiles[i].lastModified;
+      copy->contentLength = cachedFiles[i].contentLength;
+      memcpy(copy->content, cachedFiles[i].content, cachedFiles[i].contentLength);
       return 1;
-    } else {
-      return 0;
-    }
-  }
-  // check if months are different
-  if (cMonth != sMonth) {
-    if (cMonth > sMonth) {
-      return 1;
-    } else {
-      return 0;
-    }
-  }
-  // check if days are different
-  if (cDay != sDay) {
-    if (cDay > sDay) {
-      return 1;
-    } else {
-      return 0;
-    }
-  }
-  // check if hours are different
-  if (cHour != sHour) {
-    if (cHour > sHour) {
-      return 1;
-    } else {
-      return 0;
-    }
-  }
-  // check if minutes are different
-  if (cMinute != sMinute) {
-    if (cMinute > sMinute) {
-      return 1;
-    } else {
-      return 0;
-    }
-  }
-  // check if seconds are different
-  if (cSecond != sSecond) {
-    if (cSecond > sSecond) {
-      return 1;
-    } else {
-      return 0;
     }
   }
 
-  // times for both are the same, so return 1
-  return 1;
-  
+  // else return 0
+  return 0;
 }
 
 /*
-  gets the last modified field of a given resource from a server
-  returns a string of the last modified value
+  turns the request in buffer into a conditional GET for a cached copy last modified
+  at lastModified, so the server answers 304 instead of the body if the copy is current
+  returns the length of the request written to conditional, or -1 if the request head isn't all in buffer
 */
-void getServerLastModified(int clientConnfd, int port, char resourceName[], char serverLastModified[]) {
-  char buffer[128];
-
-  // send head request to clientConnfd
-  sprintf(buffer, "HEAD /%s HTTP/1.1\r\nHost: localhost:%d\r\n\r\n",
-      resourceName,
-      port
-  );
-  send(clientConnfd, buffer, strlen(buffer), 0);
-
-  // empty buffer 
-  memset(buffer, '\0', 128);
-
-  // TODO: make this more robust
-  // receive response from server
-  recv(clientConnfd, buffer, 128, 0);
+int addIfModifiedSince(char buffer[], int requestBytes, time_t lastModified, char conditional[]) {
+  char* endOfHead = strstr(buffer, "\r\n\r\n");
+  if (endOfHead == NULL) {
+    return -1;
+  }
 
-  // copy last modified string into array
-  char* pLastModified = strstr(buffer, "Last-Modified: ") + 15;
-  memcpy(serverLastModified, pLastModified, strcspn(pLastModified, "\r\n"));
+  // the new header goes right before the blank line that ends the head
+  int headLen = endOfHead + 2 - buffer;
+  char date[HTTP_DATE_SIZE];
+  http_format_date(lastModified, date);
+  memcpy(conditional, buffer, headLen);
+  int len = headLen + sprintf(conditional + headLen, "If-Modified-Since: %s\r\n", date);
+  memcpy(conditional + len, buffer + headLen, requestBytes - headLen);
+  return len + requestBytes - headLen;
 }
 
 // worker thread wrapper
 void* t_waitForReq(void* arg) {
   free(arg);
   while (1) {
-    /* ---------- START CRIT REGION ---------- */
-    int rc = pthread_mutex_lock(&m_queue);
-    if (rc) {
-      perror("pthread_mutex_lock failed");
-      pthread_exit(NULL);
-    }
-
     // wait for a request if the queue of connfds is empty
-    while (connQueueCount == 0){
-      pthread_cond_wait(&c_gotRequest, &m_queue);
-    }
-
-    // pop connfd off front of queue
-    int connfd = connQueue[0];
-    for (int i = 0; i < connQueueCount-1; ++i) {
-      connQueue[i] = connQueue[i+1];
-    }
-    connQueueCount--;
+    int connfd = connqueue_pop(&connQueue);
 
-    pthread_mutex_unlock(&m_queue);
-    /* ----------- END CRIT REGION ----------- */
+    process_request(connfd);
+  }
+  return NULL;
+}
 
+/*
+  Worker thread function with -p: accepts on its own listener and serves
+  each connection itself. The kernel spreads connections over the
+  listeners regardless of how busy each worker is.
+*/
+void* t_acceptReq(void* arg) {
+  int listenfd = (int) (intptr_t) arg;
+  while (1) {
+    int connfd = accept(listenfd, NULL, NULL);
+    if (connfd < 0) {
+      warn("accept error");
+      continue;
+    }
     process_request(connfd);
   }
   return NULL;
@@ -692,8 +587,14 @@ void process_request(int connfd) {
       break;
     }
 
-    // create new connection with server
-    clientConnfd = create_client_socket(port);
+    // reuse the connection to the server while it stays open
+    if (clientConnfd >= 0 && !server_connection_usable(clientConnfd)) {
+      close(clientConnfd);
+      clientConnfd = -1;
+    }
+    if (clientConnfd < 0) {
+      clientConnfd = create_client_socket(port);
+    }
 
     // if server port went down since the last healthcheck
     while (clientConnfd < 0) {
@@ -708,20 +609,38 @@ void process_request(int connfd) {
       clientConnfd = create_client_socket(port);
     }
     
-    /* ---------- START CRIT REGION ---------- */
-    // if requested content is in the cache and up to date, send it to client
-    pthread_mutex_lock(&m_cache);
-    int cachedFilesIndex = checkCache(clientConnfd, port, resource);
-    if (cachedFilesIndex >= 0) {
-      sendCachedResponseToClient(connfd, cachedFilesIndex);
+    // header names are matched whatever their case or the spacing after the
+    // colon. a head that didn't arrive in one piece is neither served from
+    // nor put in the cache, since its headers can't all be checked
+    struct HttpRequest request;
+    size_t scanned = 0;
+    int parsed = http_parse_request(buffer, requestBytes, &scanned, &request) > 0;
+    int isConditional = !parsed || http_find_header(&request, "If-Modified-Since") != NULL;
+    int wantsRange = !parsed || http_find_header(&request, "Range") != NULL;
+
+    // a cached copy is revalidated with the request itself: made conditional,
+    // the server answers 304 if the copy is current or sends the new version.
+    // requests that are already conditional go through as they are
+    char cachedContent[maxCachedBytes];
+    struct CachedFilesInfo cached = { .content = cachedContent };
+    int isCached = 0;
+    if (!isConditional && !wantsRange) {
+      /* ---------- START CRIT REGION ---------- */
+      pthread_mutex_lock(&m_cache);
+      isCached = checkCache(resource, &cached);
       pthread_mutex_unlock(&m_cache);
-      goto addOneToHC;
+      /* ----------- END CRIT REGION ----------- */
     }
-    pthread_mutex_unlock(&m_cache);
-    /* ----------- END CRIT REGION ----------- */
 
     // send http request to the server
-    send(clientConnfd, buffer, requestBytes, 0);
+    char conditional[BUFFER_SIZE + 64];
+    int conditionalBytes = isCached ? addIfModifiedSince(buffer, requestBytes, cached.lastModified, conditional) : -1;
+    if (conditionalBytes >= 0) {
+      send(clientConnfd, conditional, conditionalBytes, 0);
+    } else {
+      isCached = 0;
+      send(clientConnfd, buffer, requestBytes, 0);
+    }
 
     /*  TODO: maybe implement this
       int sendBytes = 0;
@@ -730,10 +649,9 @@ void process_request(int connfd) {
       } while (sendBytes < requestBytes);
     */
     
-    // forward response from server to client
-    fwdResponseToClient(connfd, clientConnfd, resource);
-
-    addOneToHC: ;
+    // forward response from server to client. The answer to a Range is
+    // only part of the file, so it mustn't be cached as the whole of it
+    fwdResponseToClient(connfd, clientConnfd, resource, isCached ? &cached : NULL, !wantsRange);
 
     /* ---------- START CRIT REGION ---------- */
     // update healthcheck, add one to reqSinceLastHC (in a crit region)
@@ -755,17 +673,20 @@ void process_request(int connfd) {
   close(connfd);
 }
 
-void sendCachedResponseToClient(int connfd, int index) {
-  char headers[64];
+void sendCachedResponseToClient(int connfd, struct CachedFilesInfo* cached) {
+  char headers[128];
+  char lastModified[HTTP_DATE_SIZE];
+  http_format_date(cached->lastModified, lastModified);
 
   // send headers to client
-  sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n",
-      cachedFiles[index].contentLength
+  sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nLast-Modified: %s\r\n\r\n",
+      cached->contentLength,
+      lastModified
   );
   send(connfd, headers, strlen(headers), 0);
 
   // send body to client
-  send(connfd, cachedFiles[index].content, cachedFiles[index].contentLength, 0);
+  send(connfd, cached->content, cached->contentLength, 0);
 }
 
 // parses request headers contained in the buffer into the arrays
@@ -803,12 +724,18 @@ int parseRequestHeaders(char buffer[], int connfd, char method[], char resource[
   return 1;
 }
 
-// forwards response from server to client
-void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[]) {
+// forwards response from server to client, or the cached copy if the server
+// answered the conditional GET for it with 304. a 200 is cached if mayCache
+void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[], struct CachedFilesInfo* cached, int mayCache) {
   char buffer[BUFFER_SIZE];
 
-  // receive response from server
-  int responseBytes = recv(clientConnfd, buffer, BUFFER_SIZE, 0);
+  // receive response from server, terminated so the head can be searched with strstr
+  int responseBytes = recv(clientConnfd, buffer, BUFFER_SIZE - 1, 0);
+  if (responseBytes <= 0) {
+    warnx("server sent no response");
+    return;
+  }
+  buffer[responseBytes] = '\0';
 
   // get the status code from buffer
   int statusCode = 0;
@@ -817,18 +744,46 @@ void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[]) {
   memcpy(statusCodeStr, pBufferParser, 3);
   statusCode = atoi(statusCodeStr);
 
-  // get content length from buffer
+  // the copy we have is current
+  if (statusCode == 304 && cached != NULL) {
+    sendCachedResponseToClient(connfd, cached);
+    return;
+  }
+
+  // get content length from buffer, a 304 has no body whatever it says
   int contentLen = 0;
   char contentLenStr[16];
-  pBufferParser = strstr(buffer, "Content-Length: ") + 16;
-  memcpy(contentLenStr, pBufferParser, strcspn(pBufferParser, "\r\n"));
-  contentLen = atoi(contentLenStr);
+  memset(contentLenStr, '\0', 16);
+  pBufferParser = strstr(buffer, "Content-Length: ");
+  if (pBufferParser != NULL && statusCode != 304) {
+    pBufferParser += 16;
+    memcpy(contentLenStr, pBufferParser, strcspn(pBufferParser, "\r\n") < 15 ? strcspn(pBufferParser, "\r\n") : 15);
+    contentLen = atoi(contentLenStr);
+  }
+
+  // get last modified date from buffer, responses without one can't be cached.
+  // neither can a file modified this second, because changing it again within
+  // the second wouldn't change its date
+  time_t lastModified = 0;
+  // only a 200 has the whole file, a 206 has a part of it
+  int cacheable = mayCache && contentLen <= maxCachedBytes && statusCode == 200;
+  if (cacheable) {
+    pBufferParser = strstr(buffer, "Last-Modified: ");
+    if (pBufferParser == NULL) {
+      cacheable = 0;
+    } else {
+      pBufferParser += 15;
+      struct HttpSlice date = { pBufferParser, strcspn(pBufferParser, "\r\n") };
+      cacheable = http_parse_date(date, &lastModified) == 0 && lastModified < time(NULL);
+    }
+  }
 
-  // get last modified date from buffer
-  char lastModified[40];
-  if (contentLen <= maxCachedBytes && statusCode < 300) {
-    pBufferParser = strstr(buffer, "Last-Modified: ") + 15;
-    memcpy(lastModified, pBufferParser, strcspn(pBufferParser, "\r\n"));
+  // the cache keeps one copy per file, so a compressed one the client asked
+  // for mustn't be served to the next client, which may not accept it
+  char* endOfHead = strstr(buffer, "\r\n\r\n");
+  pBufferParser = strstr(buffer, "Content-Encoding: ");
+  if (pBufferParser != NULL && pBufferParser < endOfHead) {
+    cacheable = 0;
   }
 
   // point to beginning of the body of the response in the buffer
@@ -841,7 +796,7 @@ void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[]) {
   // start saving the body message for caching 
   char body[maxCachedBytes];
   char* pEndOfBody = body;
-  if (contentLen <= maxCachedBytes && statusCode < 300) {
+  if (cacheable) {
     memmove(body, pBufferParser, currentLen+1);
     pEndOfBody = body + currentLen; // move pointer to where the new end of the body is
   }
@@ -856,12 +811,16 @@ void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[]) {
       warn("cannot recieve response from server");
       break;
     }
+    if (responseBytes == 0) {
+      warnx("server closed the connection mid response");
+      break;
+    }
 
     // update the length of the body that we've received so far
     currentLen += responseBytes;
 
     // concat body message onto your string for caching
-    if (contentLen <= maxCachedBytes && statusCode < 300) {
+    if (cacheable) {
       memmove(pEndOfBody, buffer, responseBytes);
       pEndOfBody += responseBytes; // move pointer to where the new end of the body is
     }
@@ -871,7 +830,7 @@ void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[]) {
   }
 
   // cache response
-  if (contentLen <= maxCachedBytes && statusCode < 300) {
+  if (cacheable) {
     /* ---------- START CRIT REGION ---------- */
     pthread_mutex_lock(&m_cache);
 
@@ -888,14 +847,14 @@ void fwdResponseToClient(int connfd, int clientConnfd, char resourceName[]) {
     // (or it already existed in the cache, shift all files behind it forward by one)
     for (index = index; index < numOfCachedFiles-1; ++index) {
       strcpy(cachedFiles[index].resourceName, cachedFiles[index+1].resourceName);
-      strcpy(cachedFiles[index].lastModified, cachedFiles[index+1].lastModified);
+      cachedFiles[index].lastModified = cachedFiles[index+1].lastModified;
       memcpy(cachedFiles[index].content, cachedFiles[index+1].content, cachedFiles[index+1].contentLength);
       cachedFiles[index].contentLength = cachedFiles[index+1].contentLength;
     }
 
     // now index is at the end of the cache, so we insert the new file into the cache
     strcpy(cachedFiles[index].resourceName, resourceName);
-    strcpy(cachedFiles[index].lastModified, lastModified);
+    cachedFiles[index].lastModified = lastModified;
     memcpy(cachedFiles[index].content, body, contentLen);
     cachedFiles[index].contentLength = contentLen;
 
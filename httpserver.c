@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <err.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -8,37 +9,80 @@
 #include <errno.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "accesslog.h"
+#include "connqueue.h"
+#include "eventloop.h"
+#include "fdcache.h"
+#include "filelock.h"
+#include "httpparse.h"
+#include "logscan.h"
+#include "metrics.h"
+#include "objcache.h"
+#include "sidecar.h"
+#include "trace.h"
 
 #define BUFFER_SIZE 512
 #define QUEUE_SIZE 512
+#define SENDFILE_CHUNK (1 << 20) // bytes handed to a single sendfile call
+#define SMALL_BODY_BYTES (16 << 10) // files read and sent in one sendmsg with their head
+#define SPLICE_PIPE_SIZE (1 << 20) // capacity requested for the PUT splice pipe
+#define LOG_BODY_BYTES 1000 // bytes at the start of a GET or PUT body that get logged
+#define RANGE_TEXT_SIZE (HTTP_MAX_RANGES * 42 + 24) // ranges written out as "first-last,..." and "/size"
 
-pthread_mutex_t m_queue = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t m_activeFile = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t m_logFile = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t c_gotRequest = PTHREAD_COND_INITIALIZER;
-pthread_cond_t c_accessFile = PTHREAD_COND_INITIALIZER;
-
-int connQueue[QUEUE_SIZE]; // queue of connfd
-int connQueueCount = 0;
-
-// creating an array of pairs (file name, read/write status) that the threads
-// use to communicate with eachother whether they are using a certain file.
-// size is dynamically allocated
-struct FileInfo {
-  char fileName[19];
-  int isBeingWritten;
-};
-struct FileInfo* activeFiles;
+struct ConnQueue connQueue; // queue of connfd
 
 int logFileDesc = -1;
+atomic_long numOfLogEntries = 0; // lines in the log file, reported by /healthcheck
+atomic_long numOfLogErrors = 0;  // lines among them that start with FAIL
 uint16_t port;
 
 int numOfThreads = 5;
+int numOfEventLoops = 0; // 0 means connections are accepted by main, > 0 enables the epoll engine
+int useUring = 0;         // drive the event loops with io_uring instead of epoll
+int reusePort = 0;        // each worker, or event loop, accepts on its own SO_REUSEPORT listener
+int idleTimeout = 5;      // seconds a kept-alive connection may wait for its next request
+int maxRequests = 100;    // requests served on one connection before it is closed
+int logBatchBytes = 1 << 16; // log bytes that are written out as soon as they are queued
+int logBatchMs = 1;          // longest an entry waits to be batched with others
+int maxCachedFiles = 256;    // open descriptors kept for files being served, 0 turns it off
+long objectCacheBytes = 0;   // memory for caching small files whole, 0 turns it off
+int makeSidecars = 0;        // compress files into sidecars after they are PUT
+int atomicPuts = 0;          // PUTs write a new file and rename it over the old one
+const char* traceFileName = NULL; // where SIGUSR2 dumps the request trace, NULL when not tracing
+atomic_ulong uploadSeq;      // numbers the temporary names of uploads
+atomic_ulong boundarySeed;   // random start for the boundaries of multipart responses
+
+// the parts of a file a GET asked for with a Range header
+struct RangeRequest {
+  int count;                                  // 0 when the whole file is sent
+  struct HttpRange ranges[HTTP_MAX_RANGES];
+  char boundary[17];                          // separates the parts when there are several
+};
+
+// a parsed request head, plus whatever was read past it
+struct Request {
+  struct HttpRequest http;  // slices point into the connection's read buffer
+  const char* body;         // bytes read past the head, the start of a body or the next request
+  size_t bodyLen;
+  size_t bodyConsumed;      // bytes of body used up by this request
+  struct ReadBuffer* buffer;  // the connection's read buffer, which body is part of
+  char httpVer[4];
+  int keepAlive;          // whether the connection stays open after the response
+  int statusCode;         // of the response, once it is sent
+};
 
 /**
    Converts a string to an 16 bits unsigned integer.
@@ -54,16 +98,25 @@ uint16_t strtouint16(char number[]) {
 }
 
 /**
-   Creates a socket for listening for connections.
+   Creates a socket for listening for connections. With reuse, any
+   number of them can listen on the same port, and the kernel spreads
+   incoming connections across them.
    Closes the program and prints an error message on error.
  */
-int create_listen_socket(uint16_t portNum) {
+int create_listen_socket(uint16_t portNum, int reuse) {
   struct sockaddr_in addr;
   int listenfd = socket(AF_INET, SOCK_STREAM, 0);
   if (listenfd < 0) {
     err(EXIT_FAILURE, "socket error");
   }
 
+  // a restarted server can bind again while old connections are in TIME_WAIT
+  int one = 1;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (reuse && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0) {
+    err(EXIT_FAILURE, "setsockopt SO_REUSEPORT error");
+  }
+
   memset(&addr, 0, sizeof addr);
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = htons(INADDR_ANY);
@@ -85,12 +138,18 @@ const char* generate_status_msg(int code) {
       return "OK";
     case 201:
       return "Created";
+    case 206:
+      return "Partial Content";
+    case 304:
+      return "Not Modified";
     case 400:
       return "Bad Request";
     case 403:
       return "Forbidden";
     case 404:
       return "File Not Found";
+    case 416:
+      return "Range Not Satisfiable";
     case 500:
       return "Internal Server Error";
     case 501:
@@ -117,202 +176,657 @@ int valid_filename(char fileName[]) {
   return 1;
 }
 
-void logRequest(int statusCode, char* requestCmd, int threadNum, int contentLength, char* httpVer, char* firstThouBytes, int FTBLen) {
-  char log[2100];
+/**
+   Counts an entry for /healthcheck and queues it for the logger thread.
+   Entries are counted before errors, so a healthcheck never sees more
+   errors than entries.
+ */
+void append_log_entry(const char* log, size_t len, int failed) {
+  atomic_fetch_add(&numOfLogEntries, 1);
+  if (failed) {
+    atomic_fetch_add(&numOfLogErrors, 1);
+  }
+  accesslog_write(log, len);
+  TRACE_POINT(TRACE_LOGGED, log_queued);
+}
+
+/**
+   Logs a request. GET and PUT entries end with the hex encoding of
+   firstBytes, the start of the body that was sent or received. A GET of
+   part of a file logs range, the parts sent as in Content-Range, in place
+   of the length. A 304 is logged like a GET or HEAD of nothing.
+ */
+void logRequest(int statusCode, char* requestCmd, char* fileName, long long contentLength, const char* range, char* httpVer, const char* firstBytes, int firstBytesLen) {
+  char log[2 * LOG_BODY_BYTES + 100 + RANGE_TEXT_SIZE];
+  int len;
+
+  char length[RANGE_TEXT_SIZE];
+  if (range == NULL) {
+    sprintf(length, "%lld", contentLength);
+    range = length;
+  }
 
-  if (statusCode >= 300) {
-    sprintf(log, "FAIL\t%s /%s HTTP/%s\t%d\n",
+  // a 304 answers the request as well as the file itself would have
+  int failed = statusCode >= 300 && statusCode != 304;
+  if (failed) {
+    len = sprintf(log, "FAIL\t%s /%s HTTP/%s\t%d\n",
         requestCmd,
-        activeFiles[threadNum].fileName,
+        fileName,
         httpVer,
         statusCode
     );
   } else if (strcmp(requestCmd, "HEAD") == 0) {
-    sprintf(log, "%s\t/%s\tlocalhost:%d\t%d\n",
+    len = sprintf(log, "%s\t/%s\tlocalhost:%d\t%s\n",
         requestCmd,
-        activeFiles[threadNum].fileName,
+        fileName,
         port,
-        contentLength
+        range
     );
-  } else if (strcmp(requestCmd, "GET") == 0) {
-    // read first 1000 bytes from the file
-    char asciiBuf[1000];
-    int file = open(activeFiles[threadNum].fileName, O_RDONLY);
-    int bytesRead = read(file, asciiBuf, 1000);
-    if (bytesRead < 0) {
-      warn("cannot open file for reading");
-    }
-
-    // convert it to hex
-    char firstThouBytesHex[bytesRead*2];
-    for (int i = 0; i < bytesRead; ++i) {
-      sprintf(&firstThouBytesHex[i*2], "%02x", asciiBuf[i]);
-    }
-
-    sprintf(log, "%s\t/%s\tlocalhost:%d\t%d\t%s\n",
+  } else {
+    len = sprintf(log, "%s\t/%s\tlocalhost:%d\t%s\t",
         requestCmd,
-        activeFiles[threadNum].fileName,
+        fileName,
         port,
-        contentLength,
-        firstThouBytesHex
+        range
     );
-  } else if (strcmp(requestCmd, "PUT") == 0) {
-    // convert first 1000 bytes to hex
-    char firstThouBytesHex[FTBLen*2];
-    for (int i = 0; i < FTBLen; ++i) {
-      sprintf(&firstThouBytesHex[i*2], "%02x", firstThouBytes[i]);
-    }
 
-    sprintf(log, "%s\t/%s\tlocalhost:%d\t%d\t%s\n",
-        requestCmd,
-        activeFiles[threadNum].fileName,
-        port,
-        contentLength,
-        firstThouBytesHex
-    );
+    // hex encode the first bytes straight into the entry
+    if (firstBytesLen > LOG_BODY_BYTES)
+      firstBytesLen = LOG_BODY_BYTES;
+    len += accesslog_hex(log + len, firstBytes, firstBytesLen);
+    log[len++] = '\n';
   }
 
-  // START CRITICAL REGION
-  int rc = pthread_mutex_lock(&m_logFile);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
+  append_log_entry(log, len, failed);
+}
+
+/**
+   Waits until connfd can accept more data. Returns 0 once it is writable,
+   -1 if the connection went away.
+ */
+int wait_for_writable(int connfd) {
+  struct pollfd pfd = { .fd = connfd, .events = POLLOUT };
+  while (poll(&pfd, 1, -1) < 0) {
+    if (errno != EINTR)
+      return -1;
   }
+  return (pfd.revents & (POLLERR | POLLHUP)) ? -1 : 0;
+}
 
-  write(logFileDesc, log, strlen(log));
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-  // END CRITICAL REGION
-  pthread_mutex_unlock(&m_logFile);
+/**
+   Sends len bytes of data with flags, retrying on partial sends.
+   Returns 0 on success, -1 if the connection failed.
+ */
+int send_all_flags(int connfd, const char* data, size_t len, int flags) {
+  TRACE_POINT(TRACE_FIRST_BYTE, send);
+  while (len > 0) {
+    ssize_t bytesSent = send(connfd, data, len, flags | MSG_NOSIGNAL);
+    if (bytesSent < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_writable(connfd) == 0)
+        continue;
+      return -1;
+    }
+    metrics_bytes_out(bytesSent);
+    data += bytesSent;
+    len -= bytesSent;
+  }
+  return 0;
 }
 
-void healthcheck(int connfd, char* httpVer) {
-  int numOfEntries = 0;
-  int numOfErrors = 0;
-  int statusCode = 200;
+int send_all(int connfd, const char* data, size_t len) {
+  return send_all_flags(connfd, data, len, 0);
+}
 
-  char buffer[BUFFER_SIZE];
-  int firstEntry = 1;
+/**
+   Sends a head that a body is sent right after. MSG_MORE keeps the
+   kernel from pushing the head out in a segment of its own despite
+   TCP_NODELAY, so it shares the first segment with the body, and the
+   body's last send pushes both. Whatever follows has to be sent, or the
+   head waits for it.
+ */
+int send_head_more(int connfd, const char* head, size_t len) {
+  return send_all_flags(connfd, head, len, MSG_MORE);
+}
 
-  // START CRITICAL REGION
-  int rc = pthread_mutex_lock(&m_logFile);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
-  }
-  
-  while (1) {
-    // reading in BUFFER_SIZE btyes into the buffer
-    int bytesRead = read(logFileDesc, buffer, BUFFER_SIZE);
-    if (bytesRead < 0) {
-      warn("cannot open file for reading");
-      statusCode = 500;
-      break;
+/**
+   Sends every byte described by iov in as few calls as possible, retrying
+   on partial sends. iov is used up in the process.
+   Returns 0 on success, -1 if the connection failed.
+ */
+int send_iov_all(int connfd, struct iovec* iov, int iovcnt) {
+  TRACE_POINT(TRACE_FIRST_BYTE, send);
+  struct msghdr message;
+  memset(&message, 0, sizeof message);
+  while (iovcnt > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+      continue;
     }
 
-    // checking to see if first logged entry is FAIL
-    if (firstEntry && strncmp(buffer, "FAIL", 4) == 0) {
-      numOfErrors++;
-      firstEntry = 0;
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+    ssize_t bytesSent = sendmsg(connfd, &message, MSG_NOSIGNAL);
+    if (bytesSent < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_writable(connfd) == 0)
+        continue;
+      return -1;
     }
+    metrics_bytes_out(bytesSent);
 
-    // checking buffer for newlines and FAIL entries
-    for (int i = 0; i < bytesRead; ++i) {
-      if (buffer[i] == '\n') {
-        numOfEntries++;
-        // if there is another entry and if it is a FAIL
-        if (i < bytesRead-4 && buffer[i+1] == 'F' && buffer[i+2] == 'A' && buffer[i+3] == 'I' && buffer[i+4] == 'L') {
-          numOfErrors++;
-        }
-      }
+    // skip past whatever made it out
+    while (iovcnt > 0 && (size_t) bytesSent >= iov->iov_len) {
+      bytesSent -= iov->iov_len;
+      iov++;
+      iovcnt--;
     }
-
-    if (bytesRead < BUFFER_SIZE) {
-      break;
+    if (iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + bytesSent;
+      iov->iov_len -= bytesSent;
     }
   }
+  return 0;
+}
+
+/**
+   Copies the file name out of the request target into fileName.
+   Returns 0 if the target isn't a valid file name.
+ */
+int get_file_name(struct Request* request, char fileName[20]) {
+  struct HttpSlice target = request->http.target;
+  if (target.len < 2 || target.data[0] != '/' || target.len - 1 > 19) {
+    return 0;
+  }
+  memcpy(fileName, target.data + 1, target.len - 1);
+  fileName[target.len - 1] = '\0';
+  return valid_filename(fileName);
+}
+
+/**
+   Checks the Host header. It has to be present, and any port in it has to
+   be a valid number. Returns 1 if it is fine, 0 if not.
+ */
+int valid_host(struct Request* request) {
+  const struct HttpSlice* host = http_find_header(&request->http, "Host");
+  if (host == NULL || host->len == 0) {
+    return 0;
+  }
+
+  const char* portName = NULL;
+  for (size_t i = 0; i < host->len; ++i) {
+    if (isspace((unsigned char) host->data[i]))
+      return 0;
+    if (host->data[i] == ':')
+      portName = host->data + i + 1;
+  }
+  if (portName == NULL) {
+    return 1;
+  }
+
+  int portLen = host->data + host->len - portName;
+  if (portLen == 0 || portLen > 5) {
+    return 0;
+  }
+  unsigned int portNum = 0;
+  for (int i = 0; i < portLen; ++i) {
+    if (!isdigit((unsigned char) portName[i]))
+      return 0;
+    portNum = portNum * 10 + (portName[i] - '0');
+  }
+  return portNum <= 32767;
+}
+
+// returns the Connection header the response needs, if any
+const char* connection_header(struct Request* request) {
+  int isHttp10 = strcmp(request->httpVer, "1.0") == 0;
+  if (request->keepAlive && isHttp10)
+    return "Connection: keep-alive\r\n";
+  if (!request->keepAlive && !isHttp10)
+    return "Connection: close\r\n";
+  return "";
+}
+
+void healthcheck(int connfd, struct Request* request) {
+  char* httpVer = request->httpVer;
+  int statusCode = 200;
+
+  // errors first, so the pair is never read with an error whose entry is missing
+  long numOfErrors = atomic_load(&numOfLogErrors);
+  long numOfEntries = atomic_load(&numOfLogEntries);
 
   // combining the # of errors and entries into a string so we can measure
   // the length of it for the headers
-  char content[32];
-  sprintf(content, "%d\n%d", numOfErrors, numOfEntries);
+  char content[48];
+  sprintf(content, "%ld\n%ld", numOfErrors, numOfEntries);
 
   // sending healthcheck to client
-  char healthcheck[64];
+  char healthcheck[160];
+  sprintf(healthcheck, "HTTP/%s %d %s\r\nContent-Length: %ld\r\n%s\r\n%s\n",
+      httpVer,
+      statusCode,
+      generate_status_msg(statusCode),
+      strlen(content) + 1,
+      connection_header(request),
+      content
+  );
+  send_all(connfd, healthcheck, strlen(healthcheck));
+  request->statusCode = statusCode;
 
-  if (statusCode >= 300) {
-    sprintf(healthcheck, "HTTP/%s %d %s\r\nContent-Length: %ld\r\n\r\n%s\n",
-        httpVer,
-        statusCode,
-        generate_status_msg(statusCode),
-        strlen(generate_status_msg(statusCode)) + 1,
-        generate_status_msg(statusCode)
+  if (logFileDesc != -1) {
+    // log the response, hex encoded
+    int len = strlen(healthcheck);
+    char log[400];
+    int logLen = sprintf(log, "GET\t/healthcheck\tlocalhost:%d\t%d\t",
+        port,
+        len
+    );
+    logLen += accesslog_hex(log + logLen, healthcheck, len);
+    log[logLen++] = '\n';
+
+    append_log_entry(log, logLen, 0);
+  }
+
+  return;
+}
+
+/**
+   Answers GET /metrics with the request counters and latency histograms
+   in the Prometheus text format, followed by gauges and counters taken
+   from the rest of the server, and logs it like a file.
+ */
+void send_metrics(int connfd, struct Request* request) {
+  char* body = NULL;
+  size_t bodyLen = 0;
+  FILE* out = open_memstream(&body, &bodyLen);
+  if (out == NULL) {
+    err(EXIT_FAILURE, "cannot allocate metrics");
+  }
+  metrics_write(out, "httpserver_");
+
+  fprintf(out, "# HELP httpserver_connection_queue_depth Connections waiting for a worker.\n");
+  fprintf(out, "# TYPE httpserver_connection_queue_depth gauge\n");
+  fprintf(out, "httpserver_connection_queue_depth %d\n", connqueue_depth(&connQueue));
+
+  struct FileLockStats lockStats;
+  filelock_get_stats(&lockStats);
+  fprintf(out, "# HELP httpserver_file_locks_active Files locked by requests now.\n");
+  fprintf(out, "# TYPE httpserver_file_locks_active gauge\n");
+  fprintf(out, "httpserver_file_locks_active %lu\n", lockStats.active);
+  fprintf(out, "# HELP httpserver_file_lock_waits_total File locks that had to wait for another request.\n");
+  fprintf(out, "# TYPE httpserver_file_lock_waits_total counter\n");
+  fprintf(out, "httpserver_file_lock_waits_total %lu\n", lockStats.contended);
+
+  struct FdCacheStats cacheStats;
+  fdcache_get_stats(&cacheStats);
+  struct ObjCacheStats objStats;
+  objcache_get_stats(&objStats);
+  fprintf(out, "# HELP httpserver_cache_hits_total Lookups answered by the fd and object caches.\n");
+  fprintf(out, "# TYPE httpserver_cache_hits_total counter\n");
+  fprintf(out, "httpserver_cache_hits_total{cache=\"fd\"} %lu\n", cacheStats.hits);
+  fprintf(out, "httpserver_cache_hits_total{cache=\"object\"} %lu\n", objStats.hits);
+  fprintf(out, "# HELP httpserver_cache_misses_total Lookups the fd and object caches couldn't answer.\n");
+  fprintf(out, "# TYPE httpserver_cache_misses_total counter\n");
+  fprintf(out, "httpserver_cache_misses_total{cache=\"fd\"} %lu\n", cacheStats.misses);
+  fprintf(out, "httpserver_cache_misses_total{cache=\"object\"} %lu\n", objStats.misses);
+
+  if (logFileDesc != -1) {
+    struct AccessLogStats logStats;
+    accesslog_get_stats(&logStats);
+    fprintf(out, "# HELP httpserver_log_pending_bytes Log entries queued that the logger hasn't written yet.\n");
+    fprintf(out, "# TYPE httpserver_log_pending_bytes gauge\n");
+    fprintf(out, "httpserver_log_pending_bytes %lu\n", logStats.pending);
+    fprintf(out, "# HELP httpserver_log_stalls_total Times a thread waited for room to queue a log entry.\n");
+    fprintf(out, "# TYPE httpserver_log_stalls_total counter\n");
+    fprintf(out, "httpserver_log_stalls_total %lu\n", logStats.stalls);
+  }
+  fclose(out);
+
+  char headers[160];
+  int headersLen = sprintf(headers, "HTTP/%s 200 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n%s\r\n",
+      request->httpVer,
+      generate_status_msg(200),
+      bodyLen,
+      connection_header(request)
+  );
+  struct iovec iov[] = {
+    { headers, headersLen },
+    { body, bodyLen },
+  };
+  send_iov_all(connfd, iov, 2);
+  request->statusCode = 200;
+
+  if (logFileDesc != -1) {
+    logRequest(200, "GET", "metrics", bodyLen, NULL, request->httpVer, body, bodyLen);
+  }
+  free(body);
+}
+
+// whether the client's If-Modified-Since says its copy of a file modified at mtime is current
+int not_modified(struct Request* request, time_t mtime) {
+  const struct HttpSlice* since = http_find_header(&request->http, "If-Modified-Since");
+  time_t date;
+  return since != NULL && http_parse_date(*since, &date) == 0 && mtime <= date;
+}
+
+/**
+   Returns the Vary header every response with fileName gets, or "" if it
+   needs none. Once a file has a sidecar, or may get one with -z, what a
+   client is sent depends on its Accept-Encoding, and a cache has to keep
+   the answers apart, the uncompressed ones included. A sidecar that is
+   missing is remembered by the fd cache, so this is cheap.
+ */
+const char* vary_header(const char* fileName) {
+  if (makeSidecars)
+    return "Vary: Accept-Encoding\r\n";
+  for (int i = 0; i < NUM_OF_SIDECAR_ENCODINGS; ++i) {
+    char sidecarName[SIDECAR_NAME_SIZE];
+    sidecar_name(sidecarName, fileName, i);
+    struct CachedFile* sidecar = fdcache_open(sidecarName);
+    if (sidecar != NULL) {
+      fdcache_release(sidecar);
+      return "Vary: Accept-Encoding\r\n";
+    }
+  }
+  return "";
+}
+
+/**
+   Answers a GET or HEAD whose If-Modified-Since is still current with a
+   304, which has no body, and logs it.
+ */
+void send_not_modified(int connfd, struct Request* request, char* requestCmd, char* fileName, time_t mtime) {
+  char lastModified[HTTP_DATE_SIZE];
+  http_format_date(mtime, lastModified);
+
+  char headers[256];
+  int len = sprintf(headers, "HTTP/%s 304 %s\r\nLast-Modified: %s\r\n%s%s\r\n",
+      request->httpVer,
+      generate_status_msg(304),
+      lastModified,
+      vary_header(fileName),
+      connection_header(request)
+  );
+  send_all(connfd, headers, len);
+  request->statusCode = 304;
+  if (logFileDesc != -1) {
+    logRequest(304, requestCmd, fileName, 0, NULL, request->httpVer, NULL, 0);
+  }
+}
+
+/**
+   Answers a GET or HEAD with a cached object in one sendmsg and logs it.
+ */
+void send_object(int connfd, struct Request* request, char* requestCmd, char* fileName, struct CachedObject* object) {
+  const char* vary = vary_header(fileName);
+  const char* connection = connection_header(request);
+  int isGet = strcmp(requestCmd, "GET") == 0;
+
+  // the cached head is for HTTP/1.1, so the client's version is spliced in
+  struct iovec iov[] = {
+    { (void*) "HTTP/", 5 },
+    { request->httpVer, 3 },
+    { (void*) (object->head + 8), object->headLen - 8 },
+    { (void*) vary, strlen(vary) },
+    { (void*) connection, strlen(connection) },
+    { (void*) "\r\n", 2 },
+    { (void*) object->body, isGet ? object->bodyLen : 0 },
+  };
+  send_iov_all(connfd, iov, sizeof iov / sizeof iov[0]);
+  request->statusCode = 200;
+
+  if (logFileDesc != -1) {
+    logRequest(200, requestCmd, fileName, object->bodyLen, NULL, request->httpVer, object->body, isGet ? object->bodyLen : 0);
+  }
+}
+
+// gives every multipart response a boundary of its own
+void make_boundary(char* boundary) {
+  // splitmix64 over a counter that starts somewhere random
+  uint64_t x = atomic_fetch_add(&boundarySeed, 0x9e3779b97f4a7c15ULL);
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  sprintf(boundary, "%016llx", (unsigned long long) x);
+}
+
+/**
+   Works out which parts of file a GET asked for with its Range header.
+   Returns 1 with the parts in ranges, 0 if the whole file is sent instead,
+   or -1 if none of the parts are in the file.
+ */
+int select_ranges(struct Request* request, struct CachedFile* file, struct RangeRequest* ranges) {
+  const struct HttpSlice* range = http_find_header(&request->http, "Range");
+  if (range == NULL)
+    return 0;
+
+  // If-Range only lets the ranges through while the file is still the one
+  // the client has the rest of. There are no entity tags, so only a date
+  // can match
+  const struct HttpSlice* ifRange = http_find_header(&request->http, "If-Range");
+  time_t date;
+  if (ifRange != NULL && (http_parse_date(*ifRange, &date) < 0 || date != file->mtime.tv_sec))
+    return 0;
+
+  int count = http_parse_ranges(*range, file->size, ranges->ranges, HTTP_MAX_RANGES);
+  if (count < 0)
+    return 0;
+  if (count == 0)
+    return -1;
+
+  // overlapping ranges could add up to many times the file
+  long long total = 0;
+  for (int i = 0; i < count; ++i) {
+    total += ranges->ranges[i].last - ranges->ranges[i].first + 1;
+  }
+  if (total > file->size)
+    return 0;
+
+  ranges->count = count;
+  if (count > 1)
+    make_boundary(ranges->boundary);
+  return 1;
+}
+
+// writes the head of a part of a multipart/byteranges body to out
+int format_part_header(char* out, struct RangeRequest* ranges, int i, off_t size) {
+  return sprintf(out, "\r\n--%s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+      ranges->boundary,
+      ranges->ranges[i].first,
+      ranges->ranges[i].last,
+      (long long) size
+  );
+}
+
+/**
+   Sends the headers of a 206 response with the parts of file in ranges
+   and logs it. A single part is sent as is, several as a
+   multipart/byteranges body.
+ */
+void send_range_headers(int connfd, struct Request* request, char* fileName, struct CachedFile* file, struct RangeRequest* ranges) {
+  char headers[256];
+  long long contentLength = 0;
+  struct HttpRange* first = &ranges->ranges[0];
+  char lastModified[HTTP_DATE_SIZE];
+  http_format_date(file->mtime.tv_sec, lastModified);
+
+  if (ranges->count == 1) {
+    contentLength = first->last - first->first + 1;
+    sprintf(headers, "HTTP/%s 206 %s\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\nLast-Modified: %s\r\n%s%s\r\n",
+        request->httpVer,
+        generate_status_msg(206),
+        first->first,
+        first->last,
+        (long long) file->size,
+        contentLength,
+        lastModified,
+        vary_header(fileName),
+        connection_header(request)
     );
-    send(connfd, healthcheck, strlen(healthcheck), 0);
   } else {
-    sprintf(healthcheck, "HTTP/%s %d %s\r\nContent-Length: %ld\r\n\r\n%s\n",
-        httpVer,
-        statusCode,
-        generate_status_msg(statusCode),
-        strlen(content) + 1,
-        content
+    // the length counts every part header and the closing boundary
+    char partHeader[128];
+    for (int i = 0; i < ranges->count; ++i) {
+      contentLength += format_part_header(partHeader, ranges, i, file->size);
+      contentLength += ranges->ranges[i].last - ranges->ranges[i].first + 1;
+    }
+    contentLength += sprintf(partHeader, "\r\n--%s--\r\n", ranges->boundary);
+    sprintf(headers, "HTTP/%s 206 %s\r\nContent-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %lld\r\nLast-Modified: %s\r\n%s%s\r\n",
+        request->httpVer,
+        generate_status_msg(206),
+        ranges->boundary,
+        contentLength,
+        lastModified,
+        vary_header(fileName),
+        connection_header(request)
     );
-    send(connfd, healthcheck, strlen(healthcheck), 0);
   }
+  send_head_more(connfd, headers, strlen(headers));
+  request->statusCode = 206;
+
   if (logFileDesc != -1) {
-    // convert healthcheck to hex
-    int len = strlen(healthcheck);
-    char healthcheckHex[len*2];
-    for (int i = 0; i < len; ++i) {
-      sprintf(&healthcheckHex[i*2], "%02x", healthcheck[i]);
+    // the ranges are logged where a whole file has its length, followed
+    // by the start of the first one
+    char rangeText[RANGE_TEXT_SIZE];
+    int len = 0;
+    for (int i = 0; i < ranges->count; ++i) {
+      len += sprintf(rangeText + len, "%s%lld-%lld", i > 0 ? "," : "", ranges->ranges[i].first, ranges->ranges[i].last);
     }
+    sprintf(rangeText + len, "/%lld", (long long) file->size);
+
+    char firstBytes[LOG_BODY_BYTES];
+    long long firstLen = first->last - first->first + 1;
+    int firstBytesLen = pread(file->fd, firstBytes, firstLen < LOG_BODY_BYTES ? firstLen : LOG_BODY_BYTES, first->first);
+    if (firstBytesLen < 0)
+      firstBytesLen = 0;
+    logRequest(206, "GET", fileName, contentLength, rangeText, request->httpVer, firstBytes, firstBytesLen);
+  }
+}
 
-    char log[264];
-    sprintf(log, "GET\t/healthcheck\tlocalhost:%d\t%d\t%s\n",
-        port,
-        len,
-        healthcheckHex
-    );
+/**
+   Opens the sidecar of fileName to send instead of it, going by the
+   encodings the request's Accept-Encoding allows, best first. Only a
+   sidecar made from the current version of the file qualifies. Returns
+   the index of its encoding in sidecarEncodings and sets *file to it, or
+   returns -1 if the file is to be sent as is.
+ */
+int open_sidecar(struct Request* request, const char* fileName, struct CachedFile** file) {
+  const struct HttpSlice* acceptEncoding = http_find_header(&request->http, "Accept-Encoding");
+  if (acceptEncoding == NULL)
+    return -1;
 
-    write(logFileDesc, log, strlen(log));
+  int quality[NUM_OF_SIDECAR_ENCODINGS];
+  int acceptable = 0;
+  for (int i = 0; i < NUM_OF_SIDECAR_ENCODINGS; ++i) {
+    quality[i] = http_accept_quality(*acceptEncoding, sidecarEncodings[i].coding);
+    acceptable |= quality[i] > 0;
   }
+  if (!acceptable)
+    return -1;
 
-  // END CRITICAL REGION
-  pthread_mutex_unlock(&m_logFile);
+  struct CachedFile* original = fdcache_open(fileName);
+  if (original == NULL)
+    return -1;
 
-  return;
+  while (1) {
+    // the first of the best ones, which is the preferred one on a tie
+    int best = -1;
+    for (int i = 0; i < NUM_OF_SIDECAR_ENCODINGS; ++i) {
+      if (quality[i] > 0 && (best < 0 || quality[i] > quality[best]))
+        best = i;
+    }
+    if (best < 0)
+      break;
+    quality[best] = 0;
+
+    // a missing sidecar is remembered by the fd cache, so this is cheap
+    char sidecarName[SIDECAR_NAME_SIZE];
+    sidecar_name(sidecarName, fileName, best);
+    struct CachedFile* sidecar = fdcache_open(sidecarName);
+    if (sidecar == NULL)
+      continue;
+    if (sidecar->mtime.tv_sec == original->mtime.tv_sec && sidecar->mtime.tv_nsec == original->mtime.tv_nsec) {
+      fdcache_release(original);
+      *file = sidecar;
+      return best;
+    }
+    fdcache_release(sidecar);
+  }
+  fdcache_release(original);
+  return -1;
+}
+
+/**
+   Writes the head of a 200 for the whole of file into headers, which
+   needs room for 256 bytes. encoding is the index in sidecarEncodings of
+   the sidecar file is, or -1 if it is fileName itself. Returns the
+   length of the head.
+ */
+int format_file_head(char* headers, struct Request* request, const char* fileName, struct CachedFile* file, int encoding) {
+  // the size and modification time were taken when the file was opened,
+  // and PUTs drop the entry
+  char lastModified[HTTP_DATE_SIZE];
+  http_format_date(file->mtime.tv_sec, lastModified);
+  char extraHeader[64];
+  if (encoding >= 0)
+    sprintf(extraHeader, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", sidecarEncodings[encoding].coding);
+  else
+    strcpy(extraHeader, vary_header(fileName));
+
+  return sprintf(headers, "HTTP/%s 200 %s\r\nContent-Length: %lld\r\nLast-Modified: %s\r\n%s%s\r\n",
+      request->httpVer,
+      generate_status_msg(200),
+      (long long) file->size,
+      lastModified,
+      extraHeader,
+      connection_header(request)
+  );
 }
 
-int send_headers(int connfd, int threadNum, char buffer[], char* requestCmd) {
+/**
+   Validates the request and sends the response headers for a GET or HEAD.
+   Returns the opened file, or NULL if the response is already complete:
+   the request failed, was a healthcheck, or was answered from the object
+   cache. While a file is returned, *lock holds it for reading, and both
+   have to be released by the caller once the body is sent. A GET passes
+   ranges to learn which parts of the file its Range header asked for;
+   their count stays 0 when the whole file is due. Whole files are sent
+   compressed if the client accepts a sidecar's encoding, in which case
+   the sidecar is returned.
+ */
+struct CachedFile* send_headers(int connfd, struct Request* request, char* requestCmd, struct FileLock** lock, struct RangeRequest* ranges) {
+  char* httpVer = request->httpVer;
   int statusCode = 200;
+  struct CachedFile* file = NULL;
+  char extraHeader[64] = "";
+  *lock = NULL;
+  if (ranges != NULL)
+    ranges->count = 0;
 
   char fileName[20];
   memset(fileName, '\0', 20); // this is here to fix a buf with the file names
-  
-  // pointing to the start of the file name
-  char* pFileName = strchr(buffer, '/') + 1;
-  if (strcspn(pFileName, " ") > 19) {
-    statusCode = 400;
-    goto SkipOpenFile;
-  }
-  memcpy(fileName, pFileName, strcspn(pFileName, " ")); // copying the file name into fileName[]
 
   // check to see if filename is valid
-  if (!valid_filename(fileName)) {
+  if (!get_file_name(request, fileName)) {
     statusCode = 400;
     goto SkipOpenFile;
   }
 
-  // getting the http version
-  char httpVer[4];
-  char* pHttpVer = strstr(buffer, "HTTP/") + 5;
-  memcpy(httpVer, pHttpVer, 3);
-
   // checking to see if healthcheck was requested
   if (strcmp(fileName, "healthcheck") == 0) {
     if (strcmp(requestCmd, "GET") == 0) {
       if (logFileDesc != -1) {
-        healthcheck(connfd, httpVer);
-        return -1;
+        healthcheck(connfd, request);
+        return NULL;
       } else { // -l flag was not specified
         statusCode = 404;
         goto SkipOpenFile;
@@ -323,386 +837,752 @@ int send_headers(int connfd, int threadNum, char buffer[], char* requestCmd) {
     }
   }
 
-  // make sure the file isnt currently being written to. if it is, loop until it isnt
-  int fileBlocked;
-  while (1) {
-    fileBlocked = 0;
-    for (int i = 0; i < threadNum; ++i) {
-      // check to see if file matches one that is already being written to
-      if (strcmp(activeFiles[i].fileName, fileName) == 0 &&
-          activeFiles[i].isBeingWritten == 1
-      ) {
-        fileBlocked = 1;
-        break;
-      }
+  // as was /metrics, which doesn't need a log
+  if (strcmp(fileName, "metrics") == 0) {
+    if (strcmp(requestCmd, "GET") == 0) {
+      send_metrics(connfd, request);
+      return NULL;
     }
-    if (!fileBlocked)
-      break;
+    statusCode = 403;
+    goto SkipOpenFile;
   }
 
-  // ALERT: THIS CAUSES RACE CONDITION.
-  // if file is not blocked while loop runs, but then becomes blocked while thread is
-  // waiting to enter the critical region, this causes a race condition.
-
+  // CHECKING THE PORT NUMBER
 
-  // START CRITICAL REGION
-  int rc = pthread_mutex_lock(&m_activeFile);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
+  if (!valid_host(request)) {
+    statusCode = 400;
+    goto SkipOpenFile;
   }
 
-  // mark file as being read from
-  strcpy(activeFiles[threadNum].fileName, fileName);
-  activeFiles[threadNum].isBeingWritten = 0;
-
-  // END CRITICAL REGION
-  pthread_mutex_unlock(&m_activeFile);
-
+  // wait until no PUT is writing the file, then hold it for reading.
+  // Atomic PUTs never write a file that can be read, so there's nothing to wait for
+  if (!atomicPuts)
+    *lock = filelock_acquire(fileName, 0);
+  TRACE_POINT(TRACE_LOCKED, lock_acquired);
+
+  // ranges are always of the file as it is
+  int wantsRanges = ranges != NULL && http_find_header(&request->http, "Range") != NULL;
+  int encoding = wantsRanges ? -1 : open_sidecar(request, fileName, &file);
+
+  // small hot files are answered straight from memory, but parts of them
+  // are cut from the open file
+  uint64_t generation = 0;
+  struct CachedObject* object = wantsRanges || encoding >= 0 ? NULL : objcache_get(fileName, &generation);
+  if (object != NULL) {
+    if (not_modified(request, object->mtime))
+      send_not_modified(connfd, request, requestCmd, fileName, object->mtime);
+    else
+      send_object(connfd, request, requestCmd, fileName, object);
+    objcache_release(object);
+    filelock_release(*lock);
+    *lock = NULL;
+    return NULL;
+  }
 
-  // open the file
-  int file = open(fileName, O_RDONLY);
+  // open the file, or share the descriptor a recent request opened
+  if (encoding < 0)
+    file = fdcache_open(fileName);
 
   // check file perms
-  if (file < 0) {
+  if (file == NULL) {
     if (errno == EACCES)
       statusCode = 403;
     else
       statusCode = 404;
-  }
-
-  // CHECKING THE PORT NUMBER
-
-  char portName[5];
-  memset(portName, '\0', 5);
-
-  // checking to see if the port number is valid
-  char* pPortName = strstr(buffer, "Host:") + 16;
-  if (strcspn(pPortName, "\r\n") > 5) {
-    statusCode = 400;
-    goto SkipOpenFile;
-  }
-  memcpy(portName, pPortName, strcspn(pPortName, "\r\n"));
-  
-  for (unsigned int i = 0; i < strcspn(pPortName, "\r\n"); ++i) {
-    if (!isdigit(portName[i])) {
-      statusCode = 400;
-      goto SkipOpenFile;
-    }
-  }
-
-  unsigned int portNum = atoi(portName);
-
-  if (portNum > 32767) {
-    statusCode = 400;
-    goto SkipOpenFile;
+  } else if (not_modified(request, file->mtime.tv_sec)) {
+    // the client's copy is current, which takes precedence over a Range.
+    // A sidecar has the same modification time as its file
+    send_not_modified(connfd, request, requestCmd, fileName, file->mtime.tv_sec);
+    fdcache_release(file);
+    filelock_release(*lock);
+    *lock = NULL;
+    return NULL;
+  } else if (wantsRanges && select_ranges(request, file, ranges) < 0) {
+    statusCode = 416;
+    sprintf(extraHeader, "Content-Range: bytes */%lld\r\n", (long long) file->size);
   }
 
   SkipOpenFile: ;
 
-  char headers[64];
+  char headers[256];
   // sending response if not successful
   if (statusCode >= 300) {
-    sprintf(headers, "HTTP/%s %d %s\r\nContent-Length: %ld\r\n\r\n%s\n",
+    sprintf(headers, "HTTP/%s %d %s\r\n%sContent-Length: %ld\r\n%s\r\n%s\n",
         httpVer,
         statusCode,
         generate_status_msg(statusCode),
+        extraHeader,
         strlen(generate_status_msg(statusCode)) + 1,
+        connection_header(request),
         generate_status_msg(statusCode)
     );
-    send(connfd, headers, strlen(headers), 0);
+    // HEAD responses have no body
+    int len = strlen(headers);
+    if (strcmp(requestCmd, "HEAD") == 0)
+      len -= strlen(generate_status_msg(statusCode)) + 1;
+    send_all(connfd, headers, len);
+    request->statusCode = statusCode;
     if (logFileDesc != -1) {
-      logRequest(statusCode, requestCmd, threadNum, 0, httpVer, NULL, 0);
+      logRequest(statusCode, requestCmd, fileName, 0, NULL, httpVer, NULL, 0);
     }
-    return -1;
+    if (file != NULL) {
+      fdcache_release(file);
+    }
+    if (*lock != NULL) {
+      filelock_release(*lock);
+      *lock = NULL;
+    }
+    return NULL;
+  }
+
+  if (ranges != NULL && ranges->count > 0) {
+    send_range_headers(connfd, request, fileName, file, ranges);
+    return file;
   }
 
-  // getting the content length
-  // taken from: https://stackoverflow.com/a/3138754
-  struct stat* buf = malloc(sizeof(struct stat));
-  stat(fileName, buf);
-  int contentLength = buf->st_size;
-  free(buf);
+  // keep small files in memory for the requests that follow
+  if (strcmp(requestCmd, "GET") == 0 && !wantsRanges && encoding < 0) {
+    object = objcache_fill(fileName, generation, file->fd, file->size, file->mtime.tv_sec);
+    if (object != NULL) {
+      send_object(connfd, request, requestCmd, fileName, object);
+      objcache_release(object);
+      fdcache_release(file);
+      filelock_release(*lock);
+      *lock = NULL;
+      return NULL;
+    }
+  }
 
   // sending headers as response
-  sprintf(headers, "HTTP/%s %d %s\r\nContent-Length: %d\r\n\r\n",
-      httpVer,
-      statusCode,
-      generate_status_msg(statusCode),
-      contentLength
-  );
-  send(connfd, headers, strlen(headers), 0);
+  long long contentLength = file->size;
+  int headersLen = format_file_head(headers, request, fileName, file, encoding);
+  request->statusCode = statusCode;
+
+  // a small file is read whole and goes out with the head in one sendmsg,
+  // unless it got shorter since it was opened
+  int isGet = strcmp(requestCmd, "GET") == 0;
+  char body[SMALL_BODY_BYTES];
+  if (isGet && file->size <= SMALL_BODY_BYTES && pread(file->fd, body, file->size, 0) == file->size) {
+    int bodyLen = file->size;
+    struct iovec iov[] = {
+      { headers, headersLen },
+      { body, bodyLen },
+    };
+    send_iov_all(connfd, iov, 2);
+    if (logFileDesc != -1) {
+      logRequest(statusCode, requestCmd, fileName, bodyLen, NULL, httpVer, body, bodyLen);
+    }
+    fdcache_release(file);
+    filelock_release(*lock);
+    *lock = NULL;
+    return NULL;
+  }
+
+  // a larger one is sent from the page cache by get_req, after the head
+  if (isGet && contentLength > 0)
+    send_head_more(connfd, headers, headersLen);
+  else
+    send_all(connfd, headers, headersLen);
   if (logFileDesc != -1) {
-    logRequest(statusCode, requestCmd, threadNum, contentLength, httpVer, NULL, 0);
+    // a GET logs the start of the file, read from the page cache through
+    // the descriptor that is about to be sent
+    char firstBytes[LOG_BODY_BYTES];
+    int firstBytesLen = 0;
+    if (isGet) {
+      firstBytesLen = pread(file->fd, firstBytes, LOG_BODY_BYTES, 0);
+      if (firstBytesLen < 0)
+        firstBytesLen = 0;
+    }
+    logRequest(statusCode, requestCmd, fileName, contentLength, NULL, httpVer, firstBytes, firstBytesLen);
   }
   return file;
 }
 
-void get_req(int connfd, int threadNum, char buffer[]) {
-
-  // send the headers to client, returning the file
-  int file = send_headers(connfd, threadNum, buffer, "GET");
+/**
+   Sends len bytes of file from offset to connfd with sendfile(2), without
+   copying them through user space. The descriptor may be shared with
+   other requests, so it is read at explicit offsets and its position is
+   left alone. Returns the number of bytes sent, -1 if the connection
+   failed, or -2 if nothing was sent because the file type doesn't
+   support sendfile.
+ */
+ssize_t send_file_body(int connfd, int file, off_t offset, off_t len) {
+  off_t start = offset, end = offset + len;
+  while (offset < end) {
+    size_t chunk = end - offset < SENDFILE_CHUNK ? end - offset : SENDFILE_CHUNK;
+    ssize_t bytesSent = sendfile(connfd, file, &offset, chunk);
+    if (bytesSent < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_writable(connfd) == 0)
+        continue;
+      if ((errno == EINVAL || errno == ENOSYS) && offset == start)
+        return -2;
+      if (errno != EPIPE && errno != ECONNRESET)
+        warn("sendfile failed");
+      return -1;
+    }
 
-  // file is less than 0 if the file was not found
-  // OR healthcheck was performed
-  if (file < 0) {
-    return;
+    // the file got shorter since it was opened
+    if (bytesSent == 0)
+      break;
+    metrics_bytes_out(bytesSent);
   }
+  return offset - start;
+}
 
-  // getting the text from the file
-  while (1) {
+/**
+   Copies len bytes of file from offset to connfd, BUFFER_SIZE bytes at a
+   time. Returns 0, or -1 if the connection failed.
+ */
+int send_buffered_body(int connfd, int file, off_t offset, off_t len) {
+  char buffer[BUFFER_SIZE];
+  off_t end = offset + len;
+  while (offset < end) {
     // reading in BUFFER_SIZE btyes into the buffer
-    int bytesRead = read(file, buffer, BUFFER_SIZE);
+    size_t chunk = end - offset < BUFFER_SIZE ? end - offset : BUFFER_SIZE;
+    int bytesRead = pread(file, buffer, chunk, offset);
     if (bytesRead < 0) {
+      if (errno == EINTR)
+        continue;
       warn("cannot open file for reading");
       break;
     }
 
-    // if you've reached the end of the file: output whatever is remaining and jump to the end
-    if (bytesRead < BUFFER_SIZE) {
-      send(connfd, buffer, bytesRead, 0);
+    // reached the end of the file
+    if (bytesRead == 0)
       break;
-    }
 
-    // output BUFFER_SIZE bytes and continue
-    send(connfd, buffer, BUFFER_SIZE, 0);
+    if (send_all(connfd, buffer, bytesRead) < 0)
+      return -1;
+    offset += bytesRead;
   }
+  return 0;
+}
+
+/**
+   Sends len bytes of file from offset straight from the page cache,
+   falling back to copying through the buffer for files sendfile can't
+   handle. Returns 0, or -1 if the connection failed.
+ */
+int send_file_range(int connfd, int file, off_t offset, off_t len) {
+  ssize_t sent = send_file_body(connfd, file, offset, len);
+  if (sent == -2)
+    return send_buffered_body(connfd, file, offset, len);
+  return sent < 0 ? -1 : 0;
+}
 
-  // START CRITICAL REGION
-  int rc = pthread_mutex_lock(&m_activeFile);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
+// sends the parts of file in ranges, framed as multipart/byteranges if there are several
+void send_ranges(int connfd, struct CachedFile* file, struct RangeRequest* ranges) {
+  if (ranges->count == 1) {
+    send_file_range(connfd, file->fd, ranges->ranges[0].first, ranges->ranges[0].last - ranges->ranges[0].first + 1);
+    return;
   }
 
-  // mark file as not being used anymore
-  memset(activeFiles[threadNum].fileName, '\0', 19);
+  char partHeader[128];
+  for (int i = 0; i < ranges->count; ++i) {
+    int len = format_part_header(partHeader, ranges, i, file->size);
+    if (send_head_more(connfd, partHeader, len) < 0)
+      return;
+    if (send_file_range(connfd, file->fd, ranges->ranges[i].first, ranges->ranges[i].last - ranges->ranges[i].first + 1) < 0)
+      return;
+  }
+  int len = sprintf(partHeader, "\r\n--%s--\r\n", ranges->boundary);
+  send_all(connfd, partHeader, len);
+}
 
-  // END CRITICAL REGION
-  pthread_mutex_unlock(&m_activeFile);
+void get_req(int connfd, struct Request* request) {
+  struct FileLock* lock;
+  struct RangeRequest ranges;
 
+  // send the headers to client, returning the file
+  struct CachedFile* file = send_headers(connfd, request, "GET", &lock, &ranges);
 
-  if(close(file) < 0) {
-    warnx("file close fail get");
+  // file is NULL if the file was not found
+  // OR healthcheck was performed
+  if (file == NULL) {
+    return;
   }
+
+  // exactly the advertised length goes out even if the file grew since
+  if (ranges.count > 0) {
+    send_ranges(connfd, file, &ranges);
+  } else {
+    send_file_range(connfd, file->fd, 0, file->size);
+  }
+
+  // mark file as not being used anymore
+  filelock_release(lock);
+  fdcache_release(file);
   return;
 }
 
-void put_req(int connfd, int threadNum, char buffer[]) {
-
-  char fileName[20];
-  memset(fileName, '\0', 20); // this is here to fix a buf with the file names
-  char* pFileName;
-  int statusCode = 200;
+/**
+   Writes len bytes of data to file, retrying on short writes.
+   Returns 0 on success, -1 on failure.
+ */
+int write_all(int file, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t bytesWritten = write(file, data, len);
+    if (bytesWritten < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += bytesWritten;
+    len -= bytesWritten;
+  }
+  return 0;
+}
 
-  // OPEN FILE AND CHECK FOR ERRORS
+/**
+   Moves exactly len bytes from connfd into file with splice(2), using a
+   per-thread pipe so the body never passes through user space.
+   Returns 0 on success, -1 if the client or the disk failed, or -2 if
+   nothing was moved because splice isn't supported for these fds.
+ */
+int splice_body(int connfd, int file, long long len) {
+  static __thread int bodyPipe[2] = { -1, -1 };
+  long long totalMoved = 0;
 
-  // pointing to the start of the file name
-  pFileName = strchr(buffer, '/') + 1;
+  if (bodyPipe[0] == -1) {
+    if (pipe(bodyPipe) < 0) {
+      return -2;
+    }
+    // a bigger pipe means fewer round trips per upload
+    fcntl(bodyPipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+  }
 
-  // copying the file name into fileName[]
-  memcpy(fileName, pFileName, strcspn(pFileName, " "));
+  while (totalMoved < len) {
+    size_t chunk = len - totalMoved < SPLICE_PIPE_SIZE ? len - totalMoved : SPLICE_PIPE_SIZE;
+    ssize_t bytesIn = splice(connfd, NULL, bodyPipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (bytesIn < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL && totalMoved == 0)
+        return -2;
+      goto SpliceFailed;
+    }
 
-  // check to see if filename is valid
-  if (!valid_filename(fileName)) {
-    statusCode = 400;
-    goto SkipOpenFile;
+    // client hung up before sending the whole body
+    if (bytesIn == 0)
+      goto SpliceFailed;
+    metrics_bytes_in(bytesIn);
+
+    // drain everything that went into the pipe into the file
+    ssize_t pending = bytesIn;
+    while (pending > 0) {
+      ssize_t bytesOut = splice(bodyPipe[0], NULL, file, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (bytesOut < 0 && errno == EINTR)
+        continue;
+      if (bytesOut <= 0)
+        goto SpliceFailed;
+      pending -= bytesOut;
+    }
+    totalMoved += bytesIn;
   }
+  return 0;
+
+  SpliceFailed: ;
+  // the pipe may still hold part of the body, so start the next upload with a fresh one
+  close(bodyPipe[0]);
+  close(bodyPipe[1]);
+  bodyPipe[0] = bodyPipe[1] = -1;
+  return -1;
+}
 
-  // checking to see if healthcheck was requested
-  // send back error because you cant PUT a healthcheck
-  if (strcmp(fileName, "healthcheck") == 0) {
-    statusCode = 403;
-    goto SkipOpenFile;
+/**
+   Copies exactly len bytes from connfd into file, for when splice
+   can't be used. Returns 0 on success, -1 on failure.
+ */
+int recv_body(int connfd, int file, long long len) {
+  char buffer[BUFFER_SIZE];
+  while (len > 0) {
+    int bytesRead = recv(connfd, buffer, len < BUFFER_SIZE ? len : BUFFER_SIZE, 0);
+    if (bytesRead < 0 && errno == EINTR)
+      continue;
+    if (bytesRead <= 0)
+      return -1;
+    metrics_bytes_in(bytesRead);
+    if (write_all(file, buffer, bytesRead) < 0)
+      return -1;
+    len -= bytesRead;
   }
+  return 0;
+}
 
-  // getting the http version
-  char httpVer[4];
-  char* pHttpVer = strstr(buffer, "HTTP/") + 5;
-  memcpy(httpVer, pHttpVer, 3);
-
-  // make sure the file isnt currently being written to. if it is, loop until it isnt
-  int fileBlocked;
-  while (1) {
-    fileBlocked = 0;
-    for (int i = 0; i < threadNum; ++i) {
-      // check to see if file matches one that is already being written to
-      if (strcmp(activeFiles[i].fileName, fileName) == 0 &&
-          activeFiles[i].isBeingWritten == 1
-      ) {
-        fileBlocked = 1;
-        break;
+/**
+   Decodes a chunked body into file as it arrives. Size lines and short
+   chunks are decoded in the connection's read buffer after the head: once
+   they are used up the buffer is rewound to the end of the head and
+   refilled, so the body never takes more room than the buffer however long
+   it is. The rest of a chunk that didn't arrive with its size line is
+   spliced straight into the file. Whatever follows the last chunk stays in
+   the buffer for the next request. The buffer may move while it is
+   refilled, so the request's head can't be used afterwards.
+   Returns the length of the body, -1 if it is malformed or the client
+   went away, or -2 if the file can't be written.
+ */
+long long recv_chunked_body(int connfd, int file, struct Request* request) {
+  struct ReadBuffer* buffer = request->buffer;
+  size_t headLen = request->body - buffer->data;
+  size_t pos = headLen;
+  long long bodyLen = 0;
+  struct ChunkDecoder decoder;
+  http_chunks_init(&decoder);
+
+  while (decoder.state != CHUNK_DONE) {
+    if (pos == buffer->len) {
+      // everything read so far is decoded, so the space after the head is free again
+      buffer->len = pos = headLen;
+
+      // the rest of a chunk goes straight from the socket to the file
+      if (decoder.state == CHUNK_DATA) {
+        long long len = decoder.remaining;
+        int rcBody = splice_body(connfd, file, len);
+        if (rcBody == -2)
+          rcBody = recv_body(connfd, file, len);
+        if (rcBody < 0)
+          return -1;
+        http_chunks_skip(&decoder, len);
+        bodyLen += len;
+        continue;
       }
+
+      size_t space = readbuf_reserve(buffer);
+      if (space == 0)
+        return -1;
+      int bytesRead = recv(connfd, buffer->data + buffer->len, space, 0);
+      if (bytesRead < 0 && errno == EINTR)
+        continue;
+      if (bytesRead <= 0)
+        return -1;
+      buffer->len += bytesRead;
+      metrics_bytes_in(bytesRead);
     }
-    if (!fileBlocked)
-      break;
+
+    struct HttpSlice data;
+    long used = http_decode_chunks(&decoder, buffer->data + pos, buffer->len - pos, &data);
+    if (used == HTTP_PARSE_ERROR)
+      return -1;
+    if (write_all(file, data.data, data.len) < 0)
+      return -2;
+    bodyLen += data.len;
+    pos += used;
   }
 
-  // ALERT: THIS CAUSES RACE CONDITION.
-  // if file is not blocked while loop runs, but then becomes blocked while thread is
-  // waiting to enter the critical region, this causes a race condition.
+  // the next request starts right after the last chunk
+  request->body = buffer->data + headLen;
+  request->bodyLen = buffer->len - headLen;
+  request->bodyConsumed = pos - headLen;
+  return bodyLen;
+}
 
+/**
+   Opens the file an atomic PUT writes fileName's new contents to: an
+   unnamed O_TMPFILE where the file system supports one, else a file under
+   a temporary name, which goes in tempName. Neither can be asked for by
+   a client. Sets *statusCode to 201 if fileName doesn't exist yet, and
+   returns the descriptor, or -1 with *statusCode set if the PUT can't go
+   ahead.
+ */
+int open_upload(const char* fileName, char* tempName, int* statusCode) {
+  // an existing file is replaced by one with the same permissions
+  struct stat fileStat;
+  mode_t mode = 0644;
+  tempName[0] = '\0';
+  if (stat(fileName, &fileStat) == 0) {
+    if (access(fileName, W_OK) < 0 && errno == EACCES) {
+      *statusCode = 403;
+      return -1;
+    }
+    mode = fileStat.st_mode & 07777;
+  } else {
+    *statusCode = 201;
+  }
 
-  // START CRITICAL REGION
-  int rc = pthread_mutex_lock(&m_activeFile);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
+  // file systems without O_TMPFILE get a named file, where '-' keeps the
+  // name out of reach of requests
+  int file = open(".", O_TMPFILE | O_RDWR, mode);
+  if (file < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+    do {
+      sprintf(tempName, ".put-%lu", atomic_fetch_add(&uploadSeq, 1));
+      file = open(tempName, O_RDWR | O_CREAT | O_EXCL, mode);
+    } while (file < 0 && errno == EEXIST);
   }
+  if (file < 0) {
+    warn("cannot create a temporary file for '%s'", fileName);
+    tempName[0] = '\0';
+    *statusCode = 500;
+    return -1;
+  }
+  if (*statusCode != 201)
+    fchmod(file, mode);
+  return file;
+}
 
-  // mark file as being read from
-  strcpy(activeFiles[threadNum].fileName, fileName);
-  activeFiles[threadNum].isBeingWritten = 0;
+/**
+   Puts a completed upload in place of fileName with rename(2), so a GET
+   gets either all of the old contents or all of the new ones, and those
+   already sending the old ones carry on from their descriptors. Returns
+   0, or -1 if the old contents are still there.
+ */
+int publish_upload(int file, const char* fileName, char* tempName) {
+  // an unnamed file has to be linked in under a temporary name first,
+  // since linkat won't replace an existing file
+  if (tempName[0] == '\0') {
+    char procPath[32];
+    sprintf(procPath, "/proc/self/fd/%d", file);
+    int rc;
+    do {
+      sprintf(tempName, ".put-%lu", atomic_fetch_add(&uploadSeq, 1));
+      rc = linkat(AT_FDCWD, procPath, AT_FDCWD, tempName, AT_SYMLINK_FOLLOW);
+    } while (rc < 0 && errno == EEXIST);
+    if (rc < 0) {
+      warn("cannot link the upload of '%s'", fileName);
+      tempName[0] = '\0';
+      return -1;
+    }
+  }
+  if (rename(tempName, fileName) < 0) {
+    warn("cannot replace '%s'", fileName);
+    unlink(tempName);
+    tempName[0] = '\0';
+    return -1;
+  }
+  tempName[0] = '\0';
+  return 0;
+}
 
-  // END CRITICAL REGION
-  pthread_mutex_unlock(&m_activeFile);
+void put_req(int connfd, struct Request* request) {
+  char* httpVer = request->httpVer;
 
+  char fileName[20];
+  memset(fileName, '\0', 20); // this is here to fix a buf with the file names
+  int statusCode = 200;
+  int file = -1;
+  long long contentLength = 0;
+  int chunked = 0;
+  struct FileLock* lock = NULL;
+  char tempName[32] = "";   // where an atomic PUT's upload is until it is published
 
-  // open the file and truncate it
-  int file = open(fileName, O_WRONLY | O_TRUNC);
+  // the rest of the connection can only be read once the whole body is,
+  // so any failure before that closes it
+  int keepAlive = request->keepAlive;
+  request->keepAlive = 0;
 
-  // check for file permissions. if file doesnt exist, create a new file
-  if (file < 0) {
-    if (errno == EACCES) {
-      statusCode = 403;
-      goto SkipOpenFile;
-    }
-    else {
-      file = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      statusCode = 201;
-      goto SkipOpenFile;
-    }
+  // OPEN FILE AND CHECK FOR ERRORS
+
+  // check to see if filename is valid
+  if (!get_file_name(request, fileName)) {
+    statusCode = 400;
+    goto SkipOpenFile;
   }
 
-  // if for some reason this still failed, throw an error
-  if (file < 0 && statusCode < 300) {
-    statusCode = 500;
+  // checking to see if healthcheck was requested
+  // send back error because you cant PUT a healthcheck, or metrics
+  if (strcmp(fileName, "healthcheck") == 0 || strcmp(fileName, "metrics") == 0) {
+    statusCode = 403;
     goto SkipOpenFile;
   }
 
   // CHECKING THE PORT NUMBER
 
-  char portName[5];
-  memset(portName, '\0', 5);
-
-  // checking to see if the port number is valid
-  char* pPortName = strstr(buffer, "Host:") + 16;
-  if (strcspn(pPortName, "\r\n") > 5) {
+  if (!valid_host(request)) {
     statusCode = 400;
     goto SkipOpenFile;
   }
-  memcpy(portName, pPortName, strcspn(pPortName, "\r\n"));
-  
-  for (unsigned int i = 0; i < strcspn(pPortName, "\r\n"); ++i) {
-    if (!isdigit(portName[i])) {
+
+  // CHECKING THE CONTENT LENGTH
+
+  // a chunked body carries its own length. chunked is the only coding that
+  // can be undone, and a Content-Length next to it could make a proxy in
+  // front of us disagree about where the body ends
+  const struct HttpSlice* conLen = http_find_header(&request->http, "Content-Length");
+  const struct HttpSlice* transferEncoding = http_find_header(&request->http, "Transfer-Encoding");
+  if (transferEncoding != NULL) {
+    if (!http_slice_equals(*transferEncoding, "chunked")) {
+      statusCode = 501;
+      goto SkipOpenFile;
+    }
+    if (conLen != NULL) {
+      statusCode = 400;
+      goto SkipOpenFile;
+    }
+    chunked = 1;
+  } else {
+    // checking to see if the content length is valid
+    if (conLen == NULL || conLen->len == 0 || conLen->len > 15) {
       statusCode = 400;
       goto SkipOpenFile;
     }
+    for (size_t i = 0; i < conLen->len; ++i) {
+      if (!isdigit((unsigned char) conLen->data[i])) {
+        statusCode = 400;
+        goto SkipOpenFile;
+      }
+      contentLength = contentLength * 10 + (conLen->data[i] - '0');
+    }
   }
 
-  unsigned int portNum = atoi(portName);
-
-  if (portNum > 32767) {
-    statusCode = 400;
-    goto SkipOpenFile;
-  }
+  // OPEN THE FILE, only now that the request is known to be good, since
+  // that truncates it
 
+  if (atomicPuts) {
+    // an atomic PUT writes a file of its own, so nobody has to wait for anybody
+    file = open_upload(fileName, tempName, &statusCode);
+    TRACE_POINT(TRACE_LOCKED, lock_acquired);
+    if (file < 0)
+      goto SkipOpenFile;
+  } else {
+    // wait until nobody else is reading or writing the file, then hold it for writing
+    lock = filelock_acquire(fileName, 1);
+    TRACE_POINT(TRACE_LOCKED, lock_acquired);
 
-  // CHECKING THE CONTENT LENGTH
+    // open the file and truncate it
+    file = open(fileName, O_RDWR | O_TRUNC);
 
-  char conLenName[16];
-  memset(conLenName, '\0', 16);
+    // check for file permissions. if file doesnt exist, create a new file
+    if (file < 0) {
+      if (errno == EACCES) {
+        statusCode = 403;
+        goto SkipOpenFile;
+      }
+      else {
+        file = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        statusCode = 201;
+      }
+    }
 
-  // checking to see if the content length is valid
-  char* pContentLength = strstr(buffer, "Content-Length:") + 16;
-  if (!pContentLength) {
-    statusCode = 400;
-    goto SkipOpenFile;
-  }
-  memcpy(conLenName, pContentLength, strcspn(pContentLength, "\r\n"));
-  
-  for (unsigned int i = 0; i < strcspn(pContentLength, "\r\n"); ++i) {
-    if (!isdigit(conLenName[i])) {
-      statusCode = 400;
+    // if for some reason this still failed, throw an error
+    if (file < 0) {
+      statusCode = 500;
       goto SkipOpenFile;
     }
   }
 
-  SkipOpenFile: ;
-
   // WRITE THE FILE TO SERVER
 
-  // getting the text from the body 
-  char bufferBody[BUFFER_SIZE];
-  char firstThouBytes[1000];
-  int iteration = 0;
-  while (1) {
-    // reading in BUFFER_SIZE btyes into the buffer
-    int bytesRead = recv(connfd, bufferBody, BUFFER_SIZE, 0);
-    if (bytesRead < 0) {
-      warn("cannot open '%s' for reading", fileName);
-      statusCode = 500;
-      break;
-    }
+  // a client that asked whether to go ahead waits for this before sending the body
+  const struct HttpSlice* expect = http_find_header(&request->http, "Expect");
+  if (expect != NULL && http_slice_equals(*expect, "100-continue") && request->bodyLen == 0
+      && strcmp(httpVer, "1.1") == 0) {
+    send_all(connfd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+  }
 
-    // copy the first 1000 bytes for the logfile
-    if (iteration == 0 && logFileDesc != -1) {
-      if (bytesRead < 1000)
-        memcpy(firstThouBytes, bufferBody, bytesRead);
-      else
-        memcpy(firstThouBytes, bufferBody, 1000);
+  if (chunked) {
+    // how long the body is only shows once the last chunk is in
+    contentLength = recv_chunked_body(connfd, file, request);
+    if (contentLength < 0) {
+      warnx("did not receive the full chunked body of '%s'", fileName);
+      statusCode = contentLength == -2 ? 500 : 400;
+      contentLength = 0;
+    } else {
+      request->keepAlive = keepAlive;
     }
+    goto SkipOpenFile;
+  }
 
-    // if you've reached the end of the file: output whatever is remaining and jump to the end
-    if (bytesRead < BUFFER_SIZE) {
-      write(file, bufferBody, bytesRead);
-      break;
-    }
+  // reserve the blocks for the whole body up front so the upload is laid out
+  // contiguously and doesn't pay for block allocation on every write.
+  // KEEP_SIZE leaves the file length to grow with the data actually written
+  if (contentLength > 0 && fallocate(file, FALLOC_FL_KEEP_SIZE, 0, contentLength) < 0 && errno == ENOSPC) {
+    warn("cannot preallocate '%s'", fileName);
+    statusCode = 500;
+    goto SkipOpenFile;
+  }
 
-    // output BUFFER_SIZE bytes and continue
-    write(file, bufferBody, BUFFER_SIZE);
+  // part of the body may have arrived together with the headers
+  const char* pBody = request->body;
+  long long bodyInBuffer = request->bodyLen;
+  if (bodyInBuffer > contentLength)
+    bodyInBuffer = contentLength;
+  if (write_all(file, pBody, bodyInBuffer) < 0) {
+    warn("cannot write to '%s'", fileName);
+    statusCode = 500;
+    goto SkipOpenFile;
   }
+  request->bodyConsumed = bodyInBuffer;
 
-  // getting the content length
-  // taken from: https://stackoverflow.com/a/3138754
-  struct stat* buf = malloc(sizeof(struct stat));
-  stat(fileName, buf);
-  int contentLength = buf->st_size;
-  free(buf);
+  // move the rest of the body straight from the socket into the file
+  long long remaining = contentLength - bodyInBuffer;
+  int rcBody = remaining > 0 ? splice_body(connfd, file, remaining) : 0;
+  if (rcBody == -2) {
+    rcBody = recv_body(connfd, file, remaining);
+  }
+  if (rcBody < 0) {
+    warnx("did not receive the full body of '%s'", fileName);
+    statusCode = 400;
 
-  // log the request in the logfile
-  if (logFileDesc != -1) {
-    logRequest(statusCode, "PUT", threadNum, contentLength, httpVer, firstThouBytes, strlen(firstThouBytes));
+    // drop whatever was preallocated past the data that made it to disk
+    ftruncate(file, lseek(file, 0, SEEK_CUR));
+  } else {
+    request->keepAlive = keepAlive;
   }
 
-  // START CRITICAL REGION
-  rc = pthread_mutex_lock(&m_activeFile);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
+  SkipOpenFile: ;
+
+  // an atomic PUT only replaces the file once the whole body is in
+  if (atomicPuts && file >= 0) {
+    if (statusCode < 300 && publish_upload(file, fileName, tempName) < 0)
+      statusCode = 500;
+    // a failed upload goes away with its descriptor, unless it has a name
+    if (tempName[0] != '\0')
+      unlink(tempName);
   }
 
-  // mark file as not being used anymore
-  memset(activeFiles[threadNum].fileName, '\0', 19);
+  // log the request in the logfile
+  if (logFileDesc != -1) {
+    char firstBytes[LOG_BODY_BYTES];
+    int firstBytesLen = 0;
+    if (file >= 0 && statusCode < 300) {
+      long long logged = contentLength < LOG_BODY_BYTES ? contentLength : LOG_BODY_BYTES;
+
+      // whatever came in with the headers is still in the read buffer,
+      // unless it was chunked
+      if (!chunked) {
+        firstBytesLen = (long long) request->bodyConsumed < logged ? (int) request->bodyConsumed : logged;
+        memcpy(firstBytes, request->body, firstBytesLen);
+      }
+
+      // the rest was spliced straight to disk, so read it back from the page cache
+      if (firstBytesLen < logged) {
+        ssize_t bytesRead = pread(file, firstBytes + firstBytesLen, logged - firstBytesLen, firstBytesLen);
+        if (bytesRead > 0)
+          firstBytesLen += bytesRead;
+      }
+    }
+    logRequest(statusCode, "PUT", fileName, contentLength, NULL, httpVer, firstBytes, firstBytesLen);
+  }
 
-  // END CRITICAL REGION
-  pthread_mutex_unlock(&m_activeFile);
+  // mark file as not being used anymore, dropping any descriptor or copy
+  // cached for its old contents before another request can look it up
+  if (lock != NULL || (atomicPuts && statusCode < 300)) {
+    fdcache_invalidate(fileName);
+    objcache_invalidate(fileName);
+    filelock_release(lock);
+  }
 
+  // compress the new contents in the background for the GETs that accept it
+  if (statusCode < 300)
+    sidecar_queue(fileName);
 
   // SEND RESPONSE BACK
 
-  char headers[64];
+  request->statusCode = statusCode;
+  char headers[128];
   // sending response if not successful
   if (statusCode >= 300) {
-    sprintf(headers, "HTTP/%s %d %s\r\nContent-Length: %ld\r\n\r\n%s\n",
+    sprintf(headers, "HTTP/%s %d %s\r\nContent-Length: %ld\r\n%s\r\n%s\n",
         httpVer,
         statusCode,
         generate_status_msg(statusCode),
         strlen(generate_status_msg(statusCode)) + 1,
+        connection_header(request),
         generate_status_msg(statusCode)
     );
-    send(connfd, headers, strlen(headers), 0);
-    if (file > 0) {
+    send_all(connfd, headers, strlen(headers));
+    if (file >= 0) {
       if(close(file) < 0) {
         warnx("file close fail put code > 300");
       }
@@ -711,14 +1591,15 @@ void put_req(int connfd, int threadNum, char buffer[]) {
   }
 
   // output the headers including the content-Length
-  sprintf(headers, "HTTP/%s %d %s\r\nContent-Length: %lu\r\n\r\n%s\n",
+  sprintf(headers, "HTTP/%s %d %s\r\nContent-Length: %lu\r\n%s\r\n%s\n",
       httpVer,
       statusCode,
       generate_status_msg(statusCode),
       (strlen(generate_status_msg(statusCode)) + 1),
+      connection_header(request),
       generate_status_msg(statusCode)
   );
-  send(connfd, headers, strlen(headers), 0);
+  send_all(connfd, headers, strlen(headers));
 
   if(close(file) < 0) {
     warnx("file close fail put code < 300");
@@ -726,65 +1607,275 @@ void put_req(int connfd, int threadNum, char buffer[]) {
   return;
 }
 
-void head_req(int connfd, int threadNum, char buffer[]) {
+void head_req(int connfd, struct Request* request) {
+  struct FileLock* lock;
 
   // send the headers to client
-  int file = send_headers(connfd, threadNum, buffer, "HEAD");
+  struct CachedFile* file = send_headers(connfd, request, "HEAD", &lock, NULL);
 
-  // START CRITICAL REGION
-  int rc = pthread_mutex_lock(&m_activeFile);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
+  if (file == NULL) {
+    return;
   }
 
   // mark file as not being used anymore
-  memset(activeFiles[threadNum].fileName, '\0', 19);
+  filelock_release(lock);
+  fdcache_release(file);
+  return;
+}
+
+/**
+   Reads from connfd until buffer holds a complete request head and parses
+   it into request, waiting at most idleTimeout seconds for each piece.
+   Returns the length of the head, HTTP_PARSE_ERROR if it is malformed or
+   too large, or 0 if the client closed the connection or timed out.
+ */
+long read_request_head(int connfd, struct ReadBuffer* buffer, struct HttpRequest* request) {
+  while (1) {
+    long headLen = http_parse_request(buffer->data, buffer->len, &buffer->scanned, request);
+    if (headLen != HTTP_PARSE_INCOMPLETE)
+      return headLen;
 
-  // END CRITICAL REGION
-  pthread_mutex_unlock(&m_activeFile);
+    size_t space = readbuf_reserve(buffer);
+    if (space == 0)
+      return HTTP_PARSE_ERROR;
 
-  if(file < 0) {
-    return;
+    struct pollfd pfd = { .fd = connfd, .events = POLLIN };
+    int ready = poll(&pfd, 1, idleTimeout * 1000);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      return 0;
+
+    int bytesRead = recv(connfd, buffer->data + buffer->len, space, 0);
+    if (bytesRead < 0 && errno == EINTR)
+      continue;
+    if (bytesRead <= 0)
+      return 0;
+    buffer->len += bytesRead;
+    metrics_bytes_in(bytesRead);
   }
+}
 
-  if(close(file) < 0) {
-    warnx("file close fail head");
+/**
+   Decides whether the connection can stay open after this request.
+   HTTP/1.1 keeps connections alive unless the client sends
+   "Connection: close", HTTP/1.0 only if it sends "Connection: keep-alive".
+ */
+int wants_keep_alive(struct Request* request) {
+  const struct HttpSlice* connection = http_find_header(&request->http, "Connection");
+  if (connection != NULL && http_has_token(*connection, "close"))
+    return 0;
+  if (connection != NULL && http_has_token(*connection, "keep-alive"))
+    return 1;
+  return strcmp(request->httpVer, "1.1") == 0;
+}
+
+// answers a request that can't be served at all, then the connection is closed
+void send_error_and_close(int connfd, struct Request* request, int statusCode) {
+  char headers[128];
+  request->keepAlive = 0;
+  sprintf(headers, "HTTP/1.1 %d %s\r\nContent-Length: %ld\r\n%s\r\n%s\n",
+      statusCode,
+      generate_status_msg(statusCode),
+      strlen(generate_status_msg(statusCode)) + 1,
+      connection_header(request),
+      generate_status_msg(statusCode)
+  );
+  send_all(connfd, headers, strlen(headers));
+  request->statusCode = statusCode;
+}
+
+// a GET or HEAD an io_uring event loop answers, kept until the response is out
+struct RingRequest {
+  struct CachedFile* file;
+  struct FileLock* lock;
+  enum MetricsMethod method;
+  char requestCmd[5];
+  char fileName[20];
+  char httpVer[4];
+  uint64_t startNs;
+};
+
+/**
+   Takes a GET or HEAD of a whole file whose head and body fit in out for
+   an io_uring event loop to answer, and writes the head into out. Errors,
+   /healthcheck, /metrics, ranges, conditional requests, files a PUT is
+   writing and files too big to fit are left to the workers, and so is
+   everything while tracing, whose records assume one request per thread
+   at a time. The object cache is left alone: the loop reads into a
+   buffer of its own anyway. Nothing here waits, except to open a file
+   the fd cache doesn't have yet.
+ */
+int prepare_ring_response(int connfd, struct ReadBuffer* buffer, int requestsServed, char* out, size_t outSize, struct RingResponse* response) {
+  (void) connfd;
+  if (traceEnabled) {
+    return 0;
   }
-  return;
+
+  struct Request request;
+  strcpy(request.httpVer, "1.1");
+  long headLen = http_parse_request(buffer->data, buffer->len, &buffer->scanned, &request.http);
+  if (headLen <= 0) {
+    return 0;
+  }
+  int isGet = http_slice_equals(request.http.method, "GET");
+  if (!isGet && !http_slice_equals(request.http.method, "HEAD")) {
+    return 0;
+  }
+  memcpy(request.httpVer, request.http.version.data, 3);
+
+  char fileName[20];
+  if (!get_file_name(&request, fileName) || strcmp(fileName, "healthcheck") == 0 || strcmp(fileName, "metrics") == 0
+      || !valid_host(&request) || http_find_header(&request.http, "Range") != NULL
+      || http_find_header(&request.http, "If-Modified-Since") != NULL) {
+    return 0;
+  }
+
+  struct FileLock* lock = NULL;
+  if (!atomicPuts && (lock = filelock_try_acquire(fileName, 0)) == NULL) {
+    return 0;
+  }
+  struct CachedFile* file = NULL;
+  int encoding = open_sidecar(&request, fileName, &file);
+  if (encoding < 0)
+    file = fdcache_open(fileName);
+  if (file == NULL) {
+    filelock_release(lock);
+    return 0;
+  }
+
+  request.keepAlive = wants_keep_alive(&request) && requestsServed + 1 < maxRequests;
+  int headersLen = format_file_head(out, &request, fileName, file, encoding);
+  if (file->size > (off_t) (outSize - headersLen)) {
+    fdcache_release(file);
+    filelock_release(lock);
+    return 0;
+  }
+
+  struct RingRequest* ring = malloc(sizeof *ring);
+  if (ring == NULL) {
+    err(EXIT_FAILURE, "cannot allocate ring request");
+  }
+  ring->file = file;
+  ring->lock = lock;
+  ring->method = isGet ? METHOD_GET : METHOD_HEAD;
+  strcpy(ring->requestCmd, isGet ? "GET" : "HEAD");
+  strcpy(ring->fileName, fileName);
+  strcpy(ring->httpVer, request.httpVer);
+  ring->startNs = now_ns();
+
+  response->fd = file->fd;
+  response->headLen = headersLen;
+  response->bodyLen = isGet ? file->size : 0;
+  response->requestLen = headLen;
+  response->keepAlive = request.keepAlive;
+  response->context = ring;
+  return 1;
+}
+
+/**
+   Logs and counts a response an io_uring event loop sent, once it is out,
+   and lets go of its file. A response that never went out is answered
+   again by a worker, which logs it then.
+ */
+void finish_ring_response(struct RingResponse* response, const char* out, int sent) {
+  struct RingRequest* ring = response->context;
+  if (sent) {
+    if (logFileDesc != -1) {
+      logRequest(200, ring->requestCmd, ring->fileName, ring->file->size, NULL, ring->httpVer, out + response->headLen, response->bodyLen);
+    }
+    metrics_request(ring->method, 200, now_ns() - ring->startNs);
+  }
+  fdcache_release(ring->file);
+  filelock_release(ring->lock);
+  free(ring);
 }
 
+const struct RingHandlers ringHandlers = { &prepare_ring_response, &finish_ring_response };
+
 // process called by worker threads
-void process_request(int connfd, int threadNum) {
-  char buffer[BUFFER_SIZE];     // buffer for reading in text BUFFER_SIZE bytes at a time
-
-  recv(connfd, buffer, BUFFER_SIZE, 0);
- 
-  char command[10];
-  memset(command, '\0', 10);
-  memcpy(command, buffer, strcspn(buffer, " "));
-
-  if (strcmp(command, "GET") == 0) {
-    get_req(connfd, threadNum, buffer);
-  } else if (strcmp(command, "PUT") == 0) {
-    put_req(connfd, threadNum, buffer);
-  } else if (strcmp(command, "HEAD") == 0) {
-    head_req(connfd, threadNum, buffer);
-  } else {
-    // request isnt GET, PUT, or HEAD
-    char headers[64];
-    int statusCode = 501;
-    sprintf(headers, "HTTP/1.1 %d %s\r\nContent-Length: %ld\r\n\r\n%s\n",
-        statusCode,
-        generate_status_msg(statusCode),
-        strlen(generate_status_msg(statusCode)) + 1,
-        generate_status_msg(statusCode)
-    );
-    send(connfd, headers, strlen(headers), 0);
+void process_request(int connfd) {
+  struct ReadBuffer buffer;     // bytes read off the connection, kept across requests
+  readbuf_init(&buffer);
+  int requestsServed = 0;
+
+  // the epoll engine has already read the request head off the socket
+  if (numOfEventLoops > 0) {
+    take_buffered_request(connfd, &buffer, &requestsServed);
+  }
+
+  // serve requests in the order they arrive until the client or the limits close the connection
+  while (1) {
+    struct Request request;
+    strcpy(request.httpVer, "1.1");
+
+    long headLen = http_parse_request(buffer.data, buffer.len, &buffer.scanned, &request.http);
+    if (headLen == HTTP_PARSE_INCOMPLETE) {
+      // the epoll engine waits for the next request instead of this thread
+      if (numOfEventLoops > 0) {
+        resume_connection(connfd, &buffer, requestsServed);
+        readbuf_free(&buffer);
+        return;
+      }
+      headLen = read_request_head(connfd, &buffer, &request.http);
+    }
+    if (headLen == 0) {
+      break;
+    }
+    if (headLen == HTTP_PARSE_ERROR) {
+      send_error_and_close(connfd, &request, 400);
+      metrics_request(METHOD_OTHER, 400, 0);
+      break;
+    }
+
+    request.body = buffer.data + headLen;
+    request.bodyLen = buffer.len - headLen;
+    request.bodyConsumed = 0;
+    request.buffer = &buffer;
+    memcpy(request.httpVer, request.http.version.data, 3);
+    request.keepAlive = wants_keep_alive(&request) && requestsServed + 1 < maxRequests;
+
+    request.statusCode = 0;
+    uint64_t startNs = now_ns();
+    TRACE_PROBE(request_start);
+    if (traceEnabled)
+      trace_begin_request(connfd, &request.http);
+
+    enum MetricsMethod method = METHOD_OTHER;
+    if (http_slice_equals(request.http.method, "GET")) {
+      method = METHOD_GET;
+      get_req(connfd, &request);
+    } else if (http_slice_equals(request.http.method, "PUT")) {
+      method = METHOD_PUT;
+      put_req(connfd, &request);
+    } else if (http_slice_equals(request.http.method, "HEAD")) {
+      method = METHOD_HEAD;
+      head_req(connfd, &request);
+    } else {
+      // request isnt GET, PUT, or HEAD, and we can't tell whether it has a body
+      send_error_and_close(connfd, &request, 501);
+    }
+    metrics_request(method, request.statusCode, now_ns() - startNs);
+    TRACE_PROBE(request_done);
+    if (traceEnabled)
+      trace_end_request(request.statusCode);
+    requestsServed++;
+
+    if (!request.keepAlive) {
+      break;
+    }
+
+    // keep whatever came after this request for the next one
+    readbuf_consume(&buffer, headLen + request.bodyConsumed);
   }
 
   // when done, close socket
-  close(connfd);
+  readbuf_free(&buffer);
+  if (numOfEventLoops > 0) {
+    close_connection(connfd);
+  } else {
+    close(connfd);
+  }
 }
 
 int openLogFile(char* logFileName) {
@@ -798,40 +1889,22 @@ int openLogFile(char* logFileName) {
       errx(EXIT_FAILURE, "the log file does not have read/write permissions open to this program");
     }
     else {
-      file = open(logFileName, O_RDWR | O_CREAT, 0777);
+      file = open(logFileName, O_RDWR | O_CREAT | O_APPEND, 0777);
       return file;
     }
   }
 
-  char buffer[BUFFER_SIZE];
-  int tabCount = 0;
-  // getting the text from the file
-  while (1) {
-    // reading in BUFFER_SIZE btyes into the buffer
-    int bytesRead = read(file, buffer, BUFFER_SIZE);
-    if (bytesRead < 0) {
-      warn("cannot open file for reading");
-      break;
-    }
-
-    // verify that the existing logfile is in the correct format
-    for (int i = 0; i < bytesRead; ++i) {
-      if (buffer[i] == '\t') {
-        tabCount++;
-      } else if (buffer[i] == '\n') {
-        // check to see if there are correct # of tabs in the line
-        if (tabCount < 2 || tabCount > 4) {
-          errx(EXIT_FAILURE, "%s does not follow the correct format", logFileName);
-        }
-        tabCount = 0;
-      }
-    }
-
-    // reached the EOF
-    if (bytesRead < BUFFER_SIZE) {
-      break;
-    }
+  // verify that the existing logfile is in the correct format, counting its
+  // entries for /healthcheck on the way
+  struct LogScan scan;
+  if (logscan_file(file, sysconf(_SC_NPROCESSORS_ONLN), &scan) < 0) {
+    err(EXIT_FAILURE, "cannot read %s", logFileName);
   }
+  if (scan.badOffset != -1) {
+    errx(EXIT_FAILURE, "%s does not follow the correct format", logFileName);
+  }
+  numOfLogEntries = scan.entries;
+  numOfLogErrors = scan.errors;
 
   return file;
 }
@@ -840,7 +1913,7 @@ void parseServerArgs(int argc, char *argv[]) {
 	int opt;
   
   // parsing through the flags
-  while((opt = getopt(argc, argv, ":n:l:")) != -1) {
+  while((opt = getopt(argc, argv, ":n:l:e:upk:r:b:f:c:m:zat:")) != -1) {
     switch (opt) {
       case 'n':
         numOfThreads = atoi(optarg);
@@ -848,6 +1921,64 @@ void parseServerArgs(int argc, char *argv[]) {
       case 'l':
         logFileDesc = openLogFile(optarg);
         break;
+      case 'e':
+        numOfEventLoops = atoi(optarg);
+        if (numOfEventLoops <= 0) {
+          errx(EXIT_FAILURE, "option -e needs a positive number of event loops");
+        }
+        break;
+      case 'u':
+        useUring = 1;
+        break;
+      case 'p':
+        reusePort = 1;
+        break;
+      case 'k':
+        idleTimeout = atoi(optarg);
+        if (idleTimeout <= 0) {
+          errx(EXIT_FAILURE, "option -k needs a positive number of seconds");
+        }
+        break;
+      case 'r':
+        maxRequests = atoi(optarg);
+        if (maxRequests <= 0) {
+          errx(EXIT_FAILURE, "option -r needs a positive number of requests");
+        }
+        break;
+      case 'b':
+        logBatchBytes = atoi(optarg);
+        if (logBatchBytes <= 0) {
+          errx(EXIT_FAILURE, "option -b needs a positive number of bytes");
+        }
+        break;
+      case 'f':
+        logBatchMs = atoi(optarg);
+        if (logBatchMs < 0) {
+          errx(EXIT_FAILURE, "option -f needs a number of milliseconds");
+        }
+        break;
+      case 'c':
+        maxCachedFiles = atoi(optarg);
+        if (maxCachedFiles < 0) {
+          errx(EXIT_FAILURE, "option -c needs a number of files");
+        }
+        break;
+      case 'm':
+        objectCacheBytes = atol(optarg);
+        if (objectCacheBytes < 0) {
+          errx(EXIT_FAILURE, "option -m needs a number of bytes");
+        }
+        break;
+      case 'z':
+        makeSidecars = 1;
+        break;
+      case 'a':
+        atomicPuts = 1;
+        break;
+      case 't':
+        traceFileName = optarg;
+        traceEnabled = 1;
+        break;
       case ':':
         errx(EXIT_FAILURE, "option -%c needs a value", optopt);
       case '?':
@@ -855,6 +1986,11 @@ void parseServerArgs(int argc, char *argv[]) {
     }
   }
 
+  // io_uring replaces epoll in the event loops, one unless -e says otherwise
+  if (useUring && numOfEventLoops == 0) {
+    numOfEventLoops = 1;
+  }
+
   // getting the port number
   port = strtouint16(argv[optind]);
   if (port == 0) {
@@ -864,58 +2000,142 @@ void parseServerArgs(int argc, char *argv[]) {
 
 // main worker thread function
 void* t_wait_for_req(void* arg) {
-  // getting the thread number
-  int* p_threadNum = (int*) arg;
-  int threadNum = *p_threadNum;
+  (void) arg;
 
   while (1) {
-    // START CRITICAL REGION
-    int rc = pthread_mutex_lock(&m_queue);
-    if (rc) {
-      perror("pthread_mutex_lock failed");
-      pthread_exit(NULL);
+    // sleeps until a connection is pushed
+    uint64_t queuedNs;
+    int connfd = connqueue_pop_timed(&connQueue, &queuedNs);
+    metrics_queue_wait(queuedNs);
+    TRACE_PROBE(dequeue);
+    if (traceEnabled) {
+      uint64_t now = now_ns();
+      trace_connection(now - queuedNs, now);
     }
 
-    while (connQueueCount == 0){
-      pthread_cond_wait(&c_gotRequest, &m_queue);
-    }
+    process_request(connfd);
+  }
+  return NULL;
+}
 
-    // pop conndf off front of queue
-    int connfd = connQueue[0];
-    for (int i = 0; i < connQueueCount-1; ++i) {
-      connQueue[i] = connQueue[i+1];
-    }
-    connQueueCount--;
+/**
+   Worker thread function with -p and no event loops. The worker accepts
+   on a listener of its own and serves every connection it accepts
+   itself, so nothing goes through main or connQueue. The kernel hashes
+   connections across the listeners without knowing how busy each
+   worker is, so a worker held up by a kept-alive connection delays the
+   ones queued on its listener.
+ */
+void* t_accept_req(void* arg) {
+  int listenfd = (int) (intptr_t) arg;
 
-    // END CRITICAL REGION
-    pthread_mutex_unlock(&m_queue);
+  while (1) {
+    int connfd = accept(listenfd, NULL, NULL);
+    if (connfd < 0) {
+      warn("accept error");
+      continue;
+    }
 
-    process_request(connfd, threadNum);
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    TRACE_PROBE(accept);
+    if (traceEnabled) {
+      // the worker accepted it, so it never waited for one
+      uint64_t now = now_ns();
+      trace_connection(now, now);
+    }
+    process_request(connfd);
   }
   return NULL;
 }
 
-// producer function
-void handle_connection(int connfd) {
-  // wait if queue is full
-  while (connQueueCount == QUEUE_SIZE) {  }
+/**
+   Prints file lock contention and cache stats to stderr every time the
+   server gets SIGUSR1, and dumps the request trace every time it gets
+   SIGUSR2.
+ */
+void* t_report_stats(void* arg) {
+  sigset_t* signals = (sigset_t*) arg;
 
-  // START CRITICAL REGION
-  int rc = pthread_mutex_lock(&m_queue);
-  if (rc) {
-    perror("pthread_mutex_lock failed");
-    pthread_exit(NULL);
-  }
+  while (1) {
+    int sig;
+    if (sigwait(signals, &sig) != 0) {
+      continue;
+    }
+
+    if (sig == SIGUSR2) {
+      if (traceFileName == NULL)
+        warnx("not tracing, start the server with -t to trace requests");
+      else if (trace_dump(traceFileName) < 0)
+        warn("cannot dump the trace to %s", traceFileName);
+      continue;
+    }
+
+    struct FileLockStats stats;
+    filelock_get_stats(&stats);
+    fprintf(stderr, "file locks: %lu acquired, %lu waited, %.3f ms total wait, %.3f ms max wait, %lu active\n",
+        stats.acquisitions,
+        stats.contended,
+        stats.waitNs / 1e6,
+        stats.maxWaitNs / 1e6,
+        stats.active
+    );
 
-  // push connfd onto queue
-  connQueue[connQueueCount] = connfd;
-  connQueueCount++;
+    struct FdCacheStats cacheStats;
+    fdcache_get_stats(&cacheStats);
+    fprintf(stderr, "fd cache: %lu hits, %lu misses, %lu evicted, %lu invalidated, %lu cached\n",
+        cacheStats.hits,
+        cacheStats.misses,
+        cacheStats.evictions,
+        cacheStats.invalidations,
+        cacheStats.cached
+    );
+
+    struct ObjCacheStats objStats;
+    objcache_get_stats(&objStats);
+    uint64_t lookups = objStats.hits + objStats.misses;
+    fprintf(stderr, "object cache: %lu hits, %lu misses (%.1f%% hit ratio), %lu evicted, %lu invalidated, %lu objects in %lu of %lu bytes\n",
+        objStats.hits,
+        objStats.misses,
+        lookups > 0 ? 100.0 * objStats.hits / lookups : 0.0,
+        objStats.evictions,
+        objStats.invalidations,
+        objStats.objects,
+        objStats.bytes,
+        objStats.budget
+    );
 
-  // END CRITICAL REGION
-  pthread_mutex_unlock(&m_queue);
+    if (makeSidecars) {
+      struct SidecarStats sidecarStats;
+      sidecar_get_stats(&sidecarStats);
+      fprintf(stderr, "sidecars: %lu generated, %lu skipped, %lu failed, %lu dropped\n",
+          sidecarStats.generated,
+          sidecarStats.skipped,
+          sidecarStats.failed,
+          sidecarStats.dropped
+      );
+    }
 
-  // broadcast to worker threads that there is a connection(s) to grab
-  pthread_cond_broadcast(&c_gotRequest);
+    if (logFileDesc != -1) {
+      struct AccessLogStats logStats;
+      accesslog_get_stats(&logStats);
+      fprintf(stderr, "access log: %lu entries, %lu bytes in %lu writes, %lu stalls on a full buffer, %lu bytes pending\n",
+          logStats.entries,
+          logStats.bytes,
+          logStats.batches,
+          logStats.stalls,
+          logStats.pending
+      );
+    }
+  }
+  return NULL;
+}
+
+// producer function
+void handle_connection(int connfd) {
+  TRACE_PROBE(accept);
+  // waits if queue is full, and wakes a single worker thread to grab the connection
+  connqueue_push(&connQueue, connfd);
 }
 
 int main(int argc, char *argv[]) {
@@ -924,20 +2144,80 @@ int main(int argc, char *argv[]) {
   // move data from args into variables
   parseServerArgs(argc, argv);
 
-  // declare the length of the active files array
-  activeFiles = malloc(numOfThreads * sizeof *activeFiles);
+  // a client hanging up mid-response shows up as EPIPE instead of killing the server
+  signal(SIGPIPE, SIG_IGN);
+
+  connqueue_init(&connQueue, QUEUE_SIZE);
+  filelock_init();
+
+  // multipart boundaries shouldn't be guessable from one run to the next
+  uint64_t seed;
+  if (getrandom(&seed, sizeof seed, 0) != sizeof seed)
+    seed = time(NULL) ^ ((uint64_t) getpid() << 32);
+  atomic_store(&boundarySeed, seed);
+
+  // SIGUSR1 and SIGUSR2 are only handled by the stats thread, so block them before any thread is created
+  static sigset_t statsSignals;
+  sigemptyset(&statsSignals);
+  sigaddset(&statsSignals, SIGUSR1);
+  sigaddset(&statsSignals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &statsSignals, NULL);
+
+  if (logFileDesc != -1) {
+    accesslog_start(logFileDesc, logBatchBytes, logBatchMs);
+  }
+
+  // files are served from the working directory, and both caches count on
+  // inotify to hear about changes made to it from outside the server
+  fdcache_init(maxCachedFiles);
+  objcache_init(objectCacheBytes);
+  if ((maxCachedFiles > 0 || objectCacheBytes > 0) && fdcache_watch(".", &objcache_invalidate, &objcache_disable) < 0) {
+    warn("cannot watch the working directory for changes, not caching files");
+    objcache_init(0);
+  }
+  if (makeSidecars) {
+    sidecar_start();
+  }
+
+  pthread_t statsThread;
+  if (pthread_create(&statsThread, NULL, &t_report_stats, &statsSignals) != 0) {
+    perror("Failed to create thread");
+  }
+
+  listenfd = create_listen_socket(port, reusePort);
+
+  // with -p and no event loops, the workers accept for themselves
+  if (reusePort && numOfEventLoops == 0) {
+    pthread_t t_ids[numOfThreads];
+    for (int i = 0; i < numOfThreads; ++i) {
+      int workerfd = i == 0 ? listenfd : create_listen_socket(port, 1);
+      if (pthread_create(&t_ids[i], NULL, &t_accept_req, (void*) (intptr_t) workerfd) != 0) {
+        perror("Failed to create thread");
+      }
+    }
+    for (int i = 0; i < numOfThreads; ++i) {
+      pthread_join(t_ids[i], NULL);
+    }
+  }
 
   // create array of n threads
 	pthread_t t_ids[numOfThreads];
-  int args[numOfThreads]; // passes thread number to each thread
 	for (int i = 0; i < numOfThreads; ++i) {
-    args[i] = i;
-		if (pthread_create(&t_ids[i], NULL, &t_wait_for_req, &args[i]) != 0) {
+		if (pthread_create(&t_ids[i], NULL, &t_wait_for_req, NULL) != 0) {
 			perror("Failed to create thread");
 		}
 	}
 
-  listenfd = create_listen_socket(port);
+  // the event loops accept and buffer connections themselves, only
+  // handing them to the worker threads once a request has arrived.
+  // With -p each loop gets a listener of its own
+  if (numOfEventLoops > 0) {
+    int listenfds[numOfEventLoops];
+    for (int i = 0; i < numOfEventLoops; ++i) {
+      listenfds[i] = reusePort && i > 0 ? create_listen_socket(port, 1) : listenfd;
+    }
+    start_event_loops(listenfds, numOfEventLoops, idleTimeout, useUring, &handle_connection, &ringHandlers);
+  }
 
   while(1) {
     int connfd = accept(listenfd, NULL, NULL);
@@ -945,10 +2225,14 @@ int main(int argc, char *argv[]) {
       warn("accept error");
       continue;
     }
+
+    // responses go out as soon as they are written instead of waiting on the
+    // client's delayed ACK of the previous one on a kept-alive connection
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
     handle_connection(connfd);
   }
 
   close(logFileDesc);
-  free(activeFiles);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOGSCAN_X86
+#endif
+
+#include "logscan.h"
+
+#define MIN_CHUNK_SIZE (4 << 20) // smaller chunks aren't worth a thread
+#define MAX_THREADS 64
+
+// where a scan is within the current line
+struct ScanState {
+  long entries;
+  long errors;
+  long tabs;          // tabs in the current line so far
+  size_t lineStart;
+  long badOffset;
+};
+
+/*
+  Finishes the line ending at the newline at pos.
+  Returns 0 if the line is malformed and scanning has to stop.
+*/
+static inline __attribute__((always_inline))
+int end_line(const char* data, size_t pos, struct ScanState* state) {
+  if (state->tabs < 2 || state->tabs > 4) {
+    state->badOffset = state->lineStart;
+    return 0;
+  }
+  state->entries++;
+  if (pos - state->lineStart >= 4 && memcmp(data + state->lineStart, "FAIL", 4) == 0) {
+    state->errors++;
+  }
+  state->tabs = 0;
+  state->lineStart = pos + 1;
+  return 1;
+}
+
+/*
+  Handles one 64 byte block given the bit masks of its newlines and tabs.
+  Returns 0 if a malformed line ended in it.
+*/
+static inline __attribute__((always_inline))
+int scan_masks(const char* data, size_t base, uint64_t newlines, uint64_t tabs, struct ScanState* state) {
+  while (newlines != 0) {
+    int pos = __builtin_ctzll(newlines);
+    uint64_t before = (UINT64_C(1) << pos) - 1;
+    state->tabs += __builtin_popcountll(tabs & before);
+    tabs &= ~before;
+    if (!end_line(data, base + pos, state))
+      return 0;
+    newlines &= newlines - 1;
+  }
+  state->tabs += __builtin_popcountll(tabs);
+  return 1;
+}
+
+static void scan_scalar(const char* data, size_t pos, size_t len, struct ScanState* state) {
+  for (; pos < len; ++pos) {
+    if (data[pos] == '\t') {
+      state->tabs++;
+    } else if (data[pos] == '\n' && !end_line(data, pos, state)) {
+      return;
+    }
+  }
+}
+
+#ifndef LOGSCAN_X86
+static void scan_generic(const char* data, size_t len, struct ScanState* state) {
+  scan_scalar(data, 0, len, state);
+}
+#else
+static void scan_sse2(const char* data, size_t len, struct ScanState* state) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+
+  size_t pos = 0;
+  for (; pos + 64 <= len; pos += 64) {
+    uint64_t newlines = 0, tabs = 0;
+    for (int i = 0; i < 4; ++i) {
+      __m128i block = _mm_loadu_si128((const __m128i*) (data + pos + i * 16));
+      newlines |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)) << (i * 16);
+      tabs |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, tab)) << (i * 16);
+    }
+    if ((newlines | tabs) != 0 && !scan_masks(data, pos, newlines, tabs, state))
+      return;
+  }
+  scan_scalar(data, pos, len, state);
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+static void scan_avx2(const char* data, size_t len, struct ScanState* state) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i tab = _mm256_set1_epi8('\t');
+
+  size_t pos = 0;
+  for (; pos + 64 <= len; pos += 64) {
+    __m256i low = _mm256_loadu_si256((const __m256i*) (data + pos));
+    __m256i high = _mm256_loadu_si256((const __m256i*) (data + pos + 32));
+    uint64_t newlines = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline))
+        | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32;
+    uint64_t tabs = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, tab))
+        | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, tab)) << 32;
+    if ((newlines | tabs) != 0 && !scan_masks(data, pos, newlines, tabs, state))
+      return;
+  }
+  scan_scalar(data, pos, len, state);
+}
+#endif
+
+typedef void (*ScanFunc)(const char*, size_t, struct ScanState*);
+
+// picks the widest scanner the CPU supports
+static ScanFunc get_scanner(const char** name) {
+#ifdef LOGSCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi")) {
+    *name = "avx2";
+    return scan_avx2;
+  }
+  *name = "sse2";
+  return scan_sse2;
+#else
+  *name = "scalar";
+  return scan_generic;
+#endif
+}
+
+const char* logscan_impl() {
+  const char* name;
+  get_scanner(&name);
+  return name;
+}
+
+void logscan_buffer(const char* data, size_t len, struct LogScan* scan) {
+  const char* name;
+  struct ScanState state = { 0, 0, 0, 0, -1 };
+  get_scanner(&name)(data, len, &state);
+
+  scan->entries = state.entries;
+  scan->errors = state.errors;
+  scan->badOffset = state.badOffset;
+}
+
+struct Chunk {
+  const char* data;
+  size_t len;
+  struct LogScan scan;
+};
+
+// chunk scanning thread function
+static void* t_scan_chunk(void* arg) {
+  struct Chunk* chunk = arg;
+  logscan_buffer(chunk->data, chunk->len, &chunk->scan);
+  return NULL;
+}
+
+int logscan_file(int fd, int numOfThreads, struct LogScan* scan) {
+  scan->entries = 0;
+  scan->errors = 0;
+  scan->badOffset = -1;
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) < 0) {
+    return -1;
+  }
+  // pipes and devices have nothing to validate
+  if (!S_ISREG(fileStat.st_mode) || fileStat.st_size == 0) {
+    return 0;
+  }
+
+  size_t size = fileStat.st_size;
+  const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  madvise((void*) data, size, MADV_SEQUENTIAL);
+
+  // split the file into chunks that each start at the beginning of a line
+  size_t maxChunks = size / MIN_CHUNK_SIZE;
+  int numOfChunks = numOfThreads < 1 ? 1 : numOfThreads > MAX_THREADS ? MAX_THREADS : numOfThreads;
+  if ((size_t) numOfChunks > maxChunks)
+    numOfChunks = maxChunks > 0 ? maxChunks : 1;
+
+  struct Chunk chunks[MAX_THREADS];
+  size_t start = 0;
+  for (int i = 0; i < numOfChunks; ++i) {
+    size_t end = size;
+    if (i < numOfChunks - 1) {
+      size_t guess = size / numOfChunks * (i + 1);
+      if (guess < start)
+        guess = start;
+      const char* newline = memchr(data + guess, '\n', size - guess);
+      end = newline != NULL ? (size_t) (newline - data) + 1 : size;
+    }
+    chunks[i].data = data + start;
+    chunks[i].len = end - start;
+    start = end;
+  }
+
+  // the calling thread takes the first chunk itself
+  pthread_t threads[MAX_THREADS];
+  int started[MAX_THREADS] = { 0 };
+  for (int i = 1; i < numOfChunks; ++i) {
+    started[i] = pthread_create(&threads[i], NULL, &t_scan_chunk, &chunks[i]) == 0;
+  }
+  t_scan_chunk(&chunks[0]);
+  for (int i = 1; i < numOfChunks; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      t_scan_chunk(&chunks[i]);
+    }
+  }
+
+  // the totals stop at the first malformed line
+  for (int i = 0; i < numOfChunks; ++i) {
+    scan->entries += chunks[i].scan.entries;
+    scan->errors += chunks[i].scan.errors;
+    if (chunks[i].scan.badOffset != -1) {
+      scan->badOffset = (chunks[i].data - data) + chunks[i].scan.badOffset;
+      break;
+    }
+  }
+
+  munmap((void*) data, size);
+  return 0;
+}
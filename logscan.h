@@ -0,0 +1,27 @@
+#ifndef LOGSCAN_H
+#define LOGSCAN_H
+
+#include <stddef.h>
+
+struct LogScan {
+  long entries;     // newline terminated lines
+  long errors;      // lines among them that start with FAIL
+  long badOffset;   // offset of the first line without 2 to 4 tabs, -1 if there is none
+};
+
+/**
+   Validates an access log and counts its entries in one pass. The file is
+   mmapped and split into newline aligned chunks that are scanned in
+   parallel, numOfThreads at most, with SSE2 or AVX2 when the CPU has it.
+   An unterminated last line is neither checked nor counted.
+   Returns 0 on success, -1 if the file could not be mapped or read.
+ */
+int logscan_file(int fd, int numOfThreads, struct LogScan* scan);
+
+// scans one buffer on the calling thread, used by the benchmark and for small logs
+void logscan_buffer(const char* data, size_t len, struct LogScan* scan);
+
+// name of the scanner logscan_buffer dispatches to on this CPU
+const char* logscan_impl();
+
+#endif
@@ -0,0 +1,200 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+
+#define MIN_STATUS 100
+#define MAX_STATUS 599
+
+/*
+  One thread's counters. Only the owning thread writes them, so they are
+  bumped with a relaxed load and store instead of a locked add, and
+  scrapes read them with relaxed loads.
+*/
+struct ThreadMetrics {
+  atomic_uint_fast64_t latency[NUM_OF_METHODS][METRICS_BUCKETS];
+  atomic_uint_fast64_t latencySumNs[NUM_OF_METHODS];
+  atomic_uint_fast64_t statuses[MAX_STATUS - MIN_STATUS + 1];
+  atomic_uint_fast64_t bytesIn;
+  atomic_uint_fast64_t bytesOut;
+  atomic_uint_fast64_t queueWait[METRICS_BUCKETS];
+  atomic_uint_fast64_t queueWaitSumNs;
+  struct ThreadMetrics* next;
+};
+
+static const char* methodNames[NUM_OF_METHODS] = { "GET", "HEAD", "PUT", "other" };
+
+// every thread's counters, only ever added to
+static pthread_mutex_t m_threads = PTHREAD_MUTEX_INITIALIZER;
+static struct ThreadMetrics* _Atomic threads = NULL;
+static __thread struct ThreadMetrics* threadMetrics = NULL;
+
+static struct ThreadMetrics* get_thread_metrics() {
+  if (threadMetrics != NULL) {
+    return threadMetrics;
+  }
+
+  struct ThreadMetrics* metrics = calloc(1, sizeof *metrics);
+  if (metrics == NULL) {
+    err(EXIT_FAILURE, "cannot allocate metrics");
+  }
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&m_threads);
+  metrics->next = threads;
+  threads = metrics;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&m_threads);
+
+  threadMetrics = metrics;
+  return metrics;
+}
+
+static inline void add(atomic_uint_fast64_t* counter, uint64_t n) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline uint64_t get(atomic_uint_fast64_t* counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/*
+  Index of the bucket for a latency. Below 2 * METRICS_SUB_BUCKETS
+  microseconds every microsecond has a bucket of its own, above that
+  every power of two is split into METRICS_SUB_BUCKETS. The last bucket
+  takes whatever is too long for the others.
+*/
+static int bucket_of(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  if (us < 2 * METRICS_SUB_BUCKETS)
+    return us;
+  int shift = 63 - __builtin_clzll(us) - 2;   // 2 == log2(METRICS_SUB_BUCKETS)
+  int index = shift * METRICS_SUB_BUCKETS + (us >> shift);
+  return index < METRICS_BUCKETS ? index : METRICS_BUCKETS - 1;
+}
+
+// the latency every one in bucket index is below, in microseconds
+static uint64_t bucket_bound(int index) {
+  if (index < 2 * METRICS_SUB_BUCKETS)
+    return index + 1;
+  int shift = index / METRICS_SUB_BUCKETS - 1;
+  return (uint64_t) (index % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS + 1) << shift;
+}
+
+void metrics_request(enum MetricsMethod method, int statusCode, uint64_t latencyNs) {
+  struct ThreadMetrics* metrics = get_thread_metrics();
+  add(&metrics->latency[method][bucket_of(latencyNs)], 1);
+  add(&metrics->latencySumNs[method], latencyNs);
+  if (statusCode >= MIN_STATUS && statusCode <= MAX_STATUS)
+    add(&metrics->statuses[statusCode - MIN_STATUS], 1);
+}
+
+void metrics_bytes_in(uint64_t bytes) {
+  add(&get_thread_metrics()->bytesIn, bytes);
+}
+
+void metrics_bytes_out(uint64_t bytes) {
+  add(&get_thread_metrics()->bytesOut, bytes);
+}
+
+void metrics_queue_wait(uint64_t waitNs) {
+  struct ThreadMetrics* metrics = get_thread_metrics();
+  add(&metrics->queueWait[bucket_of(waitNs)], 1);
+  add(&metrics->queueWaitSumNs, waitNs);
+}
+
+/*
+  Writes the buckets of a histogram cumulatively, up to the last one that
+  isn't empty. The last bucket only counts towards +Inf.
+*/
+static void write_histogram(FILE* out, const char* name, const char* labels, uint64_t buckets[], uint64_t sumNs) {
+  int last = -1;
+  for (int i = 0; i < METRICS_BUCKETS - 1; ++i) {
+    if (buckets[i] > 0)
+      last = i;
+  }
+
+  uint64_t count = 0;
+  const char* comma = labels[0] != '\0' ? "," : "";
+  for (int i = 0; i <= last; ++i) {
+    count += buckets[i];
+    fprintf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, comma, bucket_bound(i) / 1e6, count);
+  }
+  for (int i = last + 1; i < METRICS_BUCKETS; ++i) {
+    count += buckets[i];
+  }
+  fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, comma, count);
+
+  // _sum and _count have no braces without labels
+  const char* open = labels[0] != '\0' ? "{" : "";
+  const char* close = labels[0] != '\0' ? "}" : "";
+  fprintf(out, "%s_sum%s%s%s %.9f\n", name, open, labels, close, sumNs / 1e9);
+  fprintf(out, "%s_count%s%s%s %lu\n", name, open, labels, close, count);
+}
+
+void metrics_write(FILE* out, const char* prefix) {
+  // add up every thread's counters, which keep changing meanwhile
+  uint64_t latency[NUM_OF_METHODS][METRICS_BUCKETS] = { { 0 } };
+  uint64_t latencySumNs[NUM_OF_METHODS] = { 0 };
+  uint64_t requests[NUM_OF_METHODS] = { 0 };
+  uint64_t statuses[MAX_STATUS - MIN_STATUS + 1] = { 0 };
+  uint64_t queueWait[METRICS_BUCKETS] = { 0 };
+  uint64_t bytesIn = 0, bytesOut = 0, queueWaitSumNs = 0;
+
+  for (struct ThreadMetrics* metrics = threads; metrics != NULL; metrics = metrics->next) {
+    for (int m = 0; m < NUM_OF_METHODS; ++m) {
+      for (int i = 0; i < METRICS_BUCKETS; ++i) {
+        uint64_t n = get(&metrics->latency[m][i]);
+        latency[m][i] += n;
+        requests[m] += n;
+      }
+      latencySumNs[m] += get(&metrics->latencySumNs[m]);
+    }
+    for (int i = 0; i <= MAX_STATUS - MIN_STATUS; ++i)
+      statuses[i] += get(&metrics->statuses[i]);
+    bytesIn += get(&metrics->bytesIn);
+    bytesOut += get(&metrics->bytesOut);
+    for (int i = 0; i < METRICS_BUCKETS; ++i)
+      queueWait[i] += get(&metrics->queueWait[i]);
+    queueWaitSumNs += get(&metrics->queueWaitSumNs);
+  }
+
+  fprintf(out, "# HELP %srequests_total Requests served, by method.\n", prefix);
+  fprintf(out, "# TYPE %srequests_total counter\n", prefix);
+  for (int m = 0; m < NUM_OF_METHODS; ++m) {
+    fprintf(out, "%srequests_total{method=\"%s\"} %lu\n", prefix, methodNames[m], requests[m]);
+  }
+
+  fprintf(out, "# HELP %sresponses_total Responses sent, by status code.\n", prefix);
+  fprintf(out, "# TYPE %sresponses_total counter\n", prefix);
+  for (int i = 0; i <= MAX_STATUS - MIN_STATUS; ++i) {
+    if (statuses[i] > 0)
+      fprintf(out, "%sresponses_total{code=\"%d\"} %lu\n", prefix, i + MIN_STATUS, statuses[i]);
+  }
+
+  fprintf(out, "# HELP %sreceived_bytes_total Bytes read off client connections.\n", prefix);
+  fprintf(out, "# TYPE %sreceived_bytes_total counter\n", prefix);
+  fprintf(out, "%sreceived_bytes_total %lu\n", prefix, bytesIn);
+  fprintf(out, "# HELP %ssent_bytes_total Bytes written to client connections.\n", prefix);
+  fprintf(out, "# TYPE %ssent_bytes_total counter\n", prefix);
+  fprintf(out, "%ssent_bytes_total %lu\n", prefix, bytesOut);
+
+  char name[128];
+  snprintf(name, sizeof name, "%srequest_duration_seconds", prefix);
+  fprintf(out, "# HELP %s Time from a request's head being parsed to its response being sent.\n", name);
+  fprintf(out, "# TYPE %s histogram\n", name);
+  for (int m = 0; m < NUM_OF_METHODS; ++m) {
+    char labels[32];
+    snprintf(labels, sizeof labels, "method=\"%s\"", methodNames[m]);
+    write_histogram(out, name, labels, latency[m], latencySumNs[m]);
+  }
+
+  snprintf(name, sizeof name, "%squeue_wait_seconds", prefix);
+  fprintf(out, "# HELP %s Time connections waited in the connection queue for a worker.\n", name);
+  fprintf(out, "# TYPE %s histogram\n", name);
+  write_histogram(out, name, "", queueWait, queueWaitSumNs);
+}
@@ -0,0 +1,46 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+   Request counters and latency histograms for /metrics. Every thread
+   counts into a block of its own that only it writes, so counting takes
+   no lock and no locked instruction, and a scrape adds the blocks up
+   while the threads carry on. A scrape can see one counter of a request
+   but not yet another, which Prometheus tolerates.
+
+   Latencies go into HDR-style log-linear buckets: every power of two of
+   microseconds is split into METRICS_SUB_BUCKETS equal parts, so a
+   bucket's bounds are within 25% of any latency in it from a
+   microsecond up to about two hours.
+ */
+enum MetricsMethod {
+  METHOD_GET,
+  METHOD_HEAD,
+  METHOD_PUT,
+  METHOD_OTHER,
+  NUM_OF_METHODS
+};
+
+#define METRICS_SUB_BUCKETS 4
+#define METRICS_BUCKETS 128
+
+// counts a request that was answered with statusCode after latencyNs
+void metrics_request(enum MetricsMethod method, int statusCode, uint64_t latencyNs);
+
+// counts bytes read off or written to connections
+void metrics_bytes_in(uint64_t bytes);
+void metrics_bytes_out(uint64_t bytes);
+
+// counts a connection that waited waitNs in the connection queue for a worker
+void metrics_queue_wait(uint64_t waitNs);
+
+/**
+   Writes every counter and histogram in the Prometheus text format, each
+   name prefixed with prefix, e.g. "httpserver_".
+ */
+void metrics_write(FILE* out, const char* prefix);
+
+#endif
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "httpparse.h"
+#include "objcache.h"
+
+#define NUM_OF_SHARDS 16          // must be a power of two
+#define BUCKETS_PER_SHARD 64      // must be a power of two
+#define GENERATION_DISABLED UINT64_MAX  // a shard's generation once the cache is disabled, never filled again
+#define HEAD_SIZE 128             // room for the status line, Content-Length and Last-Modified
+
+struct Shard;
+
+struct Object {
+  struct CachedObject object;   // first, so the public pointer converts back
+  char fileName[20];
+  int refCount;                 // the cache's reference plus its users, protected by the shard mutex
+  size_t cost;                  // bytes charged to the budget
+  struct Shard* shard;          // NULL for an uncached object, which only ever has one user
+  struct Object* next;          // bucket chain
+  struct Object* lruPrev;
+  struct Object* lruNext;
+};                              // followed by the head, then the body
+
+struct Shard {
+  pthread_mutex_t m_shard;
+  struct Object* buckets[BUCKETS_PER_SHARD];
+  struct Object lru;            // sentinel, lru.lruNext is the most recently used object
+  size_t bytesUsed;
+  size_t budget;
+  uint64_t generation;          // bumped by every invalidation, so a stale fill isn't cached
+                                // GENERATION_DISABLED once the cache is disabled
+};
+
+static struct Shard shards[NUM_OF_SHARDS];
+static atomic_int cacheEnabled = 0;
+static size_t totalBudget = 0;
+
+static atomic_uint_fast64_t hits, misses, evictions, invalidations, objects, bytes;
+
+// FNV-1a
+static uint32_t hash_name(const char* fileName) {
+  uint32_t hash = 2166136261u;
+  for (const char* c = fileName; *c != '\0'; ++c) {
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  }
+  return hash;
+}
+
+static struct Shard* get_shard(uint32_t hash) {
+  return &shards[hash & (NUM_OF_SHARDS - 1)];
+}
+
+static struct Object** get_bucket(struct Shard* shard, uint32_t hash) {
+  return &shard->buckets[(hash / NUM_OF_SHARDS) & (BUCKETS_PER_SHARD - 1)];
+}
+
+static void lru_unlink(struct Object* object) {
+  object->lruPrev->lruNext = object->lruNext;
+  object->lruNext->lruPrev = object->lruPrev;
+}
+
+static void lru_push_front(struct Shard* shard, struct Object* object) {
+  object->lruPrev = &shard->lru;
+  object->lruNext = shard->lru.lruNext;
+  shard->lru.lruNext->lruPrev = object;
+  shard->lru.lruNext = object;
+}
+
+static struct Object* find_object(struct Shard* shard, uint32_t hash, const char* fileName) {
+  struct Object* object = *get_bucket(shard, hash);
+  while (object != NULL && strcmp(object->fileName, fileName) != 0) {
+    object = object->next;
+  }
+  return object;
+}
+
+/*
+  Takes object out of the table and drops the cache's reference to it.
+  Must hold the shard mutex. Returns 1 if that was the last reference and
+  the caller has to free the object once the mutex is released.
+*/
+static int remove_object(struct Shard* shard, struct Object* object) {
+  struct Object** pObject = get_bucket(shard, hash_name(object->fileName));
+  while (*pObject != object) {
+    pObject = &(*pObject)->next;
+  }
+  *pObject = object->next;
+  lru_unlink(object);
+  shard->bytesUsed -= object->cost;
+  atomic_fetch_sub(&objects, 1);
+  atomic_fetch_sub(&bytes, object->cost);
+  return --object->refCount == 0;
+}
+
+static void free_list(struct Object* list) {
+  while (list != NULL) {
+    struct Object* next = list->next;
+    free(list);
+    list = next;
+  }
+}
+
+void objcache_init(size_t budgetBytes) {
+  cacheEnabled = budgetBytes > 0;
+  if (!cacheEnabled) {
+    return;
+  }
+  totalBudget = budgetBytes;
+  for (int i = 0; i < NUM_OF_SHARDS; ++i) {
+    struct Shard* shard = &shards[i];
+    pthread_mutex_init(&shard->m_shard, NULL);
+    memset(shard->buckets, 0, sizeof shard->buckets);
+    shard->lru.lruNext = shard->lru.lruPrev = &shard->lru;
+    shard->bytesUsed = 0;
+    shard->budget = budgetBytes / NUM_OF_SHARDS;
+    shard->generation = 0;
+  }
+}
+
+struct CachedObject* objcache_get(const char* fileName, uint64_t* generation) {
+  if (!cacheEnabled || strlen(fileName) >= sizeof ((struct Object*) 0)->fileName) {
+    return NULL;
+  }
+
+  uint32_t hash = hash_name(fileName);
+  struct Shard* shard = get_shard(hash);
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&shard->m_shard);
+  struct Object* object = find_object(shard, hash, fileName);
+  if (object != NULL) {
+    object->refCount++;
+    lru_unlink(object);
+    lru_push_front(shard, object);
+  }
+  *generation = shard->generation;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&shard->m_shard);
+
+  if (object == NULL) {
+    atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+    return NULL;
+  }
+  atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+  return &object->object;
+}
+
+struct CachedObject* objcache_fill(const char* fileName, uint64_t generation, int fd, off_t size, time_t mtime) {
+  if (!cacheEnabled || size > OBJCACHE_MAX_OBJECT || strlen(fileName) >= sizeof ((struct Object*) 0)->fileName) {
+    return NULL;
+  }
+  uint32_t hash = hash_name(fileName);
+  struct Shard* shard = get_shard(hash);
+  size_t cost = sizeof (struct Object) + HEAD_SIZE + size;
+  if (cost > shard->budget) {
+    return NULL;
+  }
+
+  struct Object* filled = malloc(cost);
+  if (filled == NULL) {
+    return NULL;
+  }
+  char* head = (char*) (filled + 1);
+  char lastModified[HTTP_DATE_SIZE];
+  http_format_date(mtime, lastModified);
+  int headLen = sprintf(head, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\nLast-Modified: %s\r\n", (long) size, lastModified);
+  char* body = head + headLen;
+
+  // read the whole body up front, a file that shrank in the meantime isn't cached
+  off_t offset = 0;
+  while (offset < size) {
+    ssize_t bytesRead = pread(fd, body + offset, size - offset, offset);
+    if (bytesRead < 0 && errno == EINTR)
+      continue;
+    if (bytesRead <= 0) {
+      free(filled);
+      return NULL;
+    }
+    offset += bytesRead;
+  }
+
+  filled->object.head = head;
+  filled->object.headLen = headLen;
+  filled->object.body = body;
+  filled->object.bodyLen = size;
+  filled->object.mtime = mtime;
+  strcpy(filled->fileName, fileName);
+  filled->refCount = 1;
+  filled->cost = cost;
+  filled->shard = NULL;
+
+  struct Object* evicted = NULL;
+  struct Object* object = NULL;
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&shard->m_shard);
+  object = find_object(shard, hash, fileName);
+  if (object != NULL) {
+    // another request cached it in the meantime
+    object->refCount++;
+  } else if (shard->generation == generation && generation != GENERATION_DISABLED) {
+    object = filled;
+    filled = NULL;
+    object->shard = shard;
+    object->refCount = 2;
+    struct Object** bucket = get_bucket(shard, hash);
+    object->next = *bucket;
+    *bucket = object;
+    lru_push_front(shard, object);
+    shard->bytesUsed += cost;
+    atomic_fetch_add(&objects, 1);
+    atomic_fetch_add(&bytes, cost);
+
+    // make room by dropping the least recently used objects
+    while (shard->bytesUsed > shard->budget) {
+      struct Object* victim = shard->lru.lruPrev;
+      if (remove_object(shard, victim)) {
+        victim->next = evicted;
+        evicted = victim;
+      }
+      atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+    }
+  }
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&shard->m_shard);
+
+  free_list(evicted);
+
+  // the file changed while it was being read, so this copy is served but not cached
+  if (object == NULL) {
+    return &filled->object;
+  }
+  free(filled);
+  return &object->object;
+}
+
+void objcache_release(struct CachedObject* cachedObject) {
+  struct Object* object = (struct Object*) cachedObject;
+  if (object->shard == NULL) {
+    free(object);
+    return;
+  }
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&object->shard->m_shard);
+  int last = --object->refCount == 0;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&object->shard->m_shard);
+
+  if (last) {
+    free(object);
+  }
+}
+
+/*
+  Drops every object in shard that matches fileName, or all of them if it
+  is NULL. With disable, the shard is never filled again.
+*/
+static void invalidate_shard(struct Shard* shard, uint32_t hash, const char* fileName, int disable) {
+  struct Object* dropped = NULL;
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&shard->m_shard);
+  if (disable)
+    shard->generation = GENERATION_DISABLED;
+  else if (shard->generation != GENERATION_DISABLED)
+    shard->generation++;
+  if (fileName != NULL) {
+    struct Object* object = find_object(shard, hash, fileName);
+    if (object != NULL) {
+      if (remove_object(shard, object)) {
+        object->next = NULL;
+        dropped = object;
+      }
+      atomic_fetch_add_explicit(&invalidations, 1, memory_order_relaxed);
+    }
+  } else {
+    while (shard->lru.lruNext != &shard->lru) {
+      struct Object* object = shard->lru.lruNext;
+      if (remove_object(shard, object)) {
+        object->next = dropped;
+        dropped = object;
+      }
+      atomic_fetch_add_explicit(&invalidations, 1, memory_order_relaxed);
+    }
+  }
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&shard->m_shard);
+
+  free_list(dropped);
+}
+
+void objcache_invalidate(const char* fileName) {
+  if (!cacheEnabled) {
+    return;
+  }
+  if (fileName == NULL) {
+    for (int i = 0; i < NUM_OF_SHARDS; ++i) {
+      invalidate_shard(&shards[i], 0, NULL, 0);
+    }
+    return;
+  }
+  uint32_t hash = hash_name(fileName);
+  invalidate_shard(get_shard(hash), hash, fileName, 0);
+}
+
+void objcache_disable() {
+  if (!cacheEnabled) {
+    return;
+  }
+  cacheEnabled = 0;
+  // a fill that got its generation before this is turned away by the sentinel
+  for (int i = 0; i < NUM_OF_SHARDS; ++i) {
+    invalidate_shard(&shards[i], 0, NULL, 1);
+  }
+}
+
+void objcache_get_stats(struct ObjCacheStats* stats) {
+  stats->hits = atomic_load(&hits);
+  stats->misses = atomic_load(&misses);
+  stats->evictions = atomic_load(&evictions);
+  stats->invalidations = atomic_load(&invalidations);
+  stats->objects = atomic_load(&objects);
+  stats->bytes = atomic_load(&bytes);
+  stats->budget = cacheEnabled ? totalBudget : 0;
+}
@@ -0,0 +1,70 @@
+#ifndef OBJCACHE_H
+#define OBJCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define OBJCACHE_MAX_OBJECT (256 << 10) // largest file body that is kept in memory
+
+/**
+   Cache of small hot files kept in memory as a ready-made response: the
+   status line, Content-Length and Last-Modified followed by the body, so a hit
+   is answered with a single writev. Objects are hashed by file name into
+   shards that each get an equal share of the byte budget and drop their
+   least recently used objects to stay within it.
+
+   Objects never change once they are cached. Invalidating one only takes
+   it out of the table, and requests already sending it keep their
+   reference until they are done, so nobody ever sees torn content.
+ */
+struct CachedObject {
+  const char* head;     // "HTTP/1.1 200 OK\r\nContent-Length: n\r\nLast-Modified: date\r\n"
+  size_t headLen;
+  const char* body;
+  size_t bodyLen;
+  time_t mtime;
+};
+
+// budgetBytes == 0 turns the cache off
+void objcache_init(size_t budgetBytes);
+
+/**
+   Returns the cached object for fileName with a reference held, or NULL
+   on a miss, in which case *generation is set for objcache_fill.
+ */
+struct CachedObject* objcache_get(const char* fileName, uint64_t* generation);
+
+/**
+   Reads the first size bytes of fd, last modified at mtime, into a new
+   object for fileName and caches it, unless the file is too big or was invalidated since the
+   objcache_get that returned generation. The object is returned with a
+   reference held even if it wasn't cached, or NULL if it can't be built.
+ */
+struct CachedObject* objcache_fill(const char* fileName, uint64_t generation, int fd, off_t size, time_t mtime);
+
+void objcache_release(struct CachedObject* object);
+
+// drops the object for fileName, or every object if fileName is NULL
+void objcache_invalidate(const char* fileName);
+
+/**
+   Drops every object and stops caching for good, for when changes to the
+   files can no longer be noticed. Requests already sending an object
+   finish with it, but no fill started before this is cached.
+ */
+void objcache_disable();
+
+struct ObjCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;       // objects dropped to stay within the budget
+  uint64_t invalidations;   // objects dropped because the file changed
+  uint64_t objects;         // objects in the cache now
+  uint64_t bytes;           // bytes they take up, including bookkeeping
+  uint64_t budget;
+};
+void objcache_get_stats(struct ObjCacheStats* stats);
+
+#endif
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "fdcache.h"
+#include "sidecar.h"
+
+#define QUEUE_SIZE 64     // files waiting to be compressed
+#define MIN_SIZE 256      // smaller files fit in a packet or two either way
+#define TEMP_NAME_SIZE 32
+
+const struct SidecarEncoding sidecarEncodings[] = {
+  { "zstd", ".zst" },
+  { "gzip", ".gz" },
+};
+
+// how each encoding's sidecar is made, compressing stdin to stdout
+static char* zstdArgs[] = { "zstd", "-q", "-15", "-c", NULL };
+static char* gzipArgs[] = { "gzip", "-9", "-n", "-c", NULL };
+static char** tools[NUM_OF_SIDECAR_ENCODINGS] = { zstdArgs, gzipArgs };
+static int toolMissing[NUM_OF_SIDECAR_ENCODINGS];   // only touched by the job
+
+static pthread_mutex_t m_queue = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t c_queue = PTHREAD_COND_INITIALIZER;
+static char queue[QUEUE_SIZE][SIDECAR_NAME_SIZE];
+static int queueHead = 0;
+static int queueLen = 0;
+static atomic_int running = 0;
+
+static atomic_uint_fast64_t generated, skipped, failed, dropped;
+static unsigned long tempSeq = 0;   // only touched by the job
+
+void sidecar_name(char* out, const char* fileName, int encoding) {
+  snprintf(out, SIDECAR_NAME_SIZE, "%s%s", fileName, sidecarEncodings[encoding].suffix);
+}
+
+// sidecars don't get sidecars of their own
+static int is_sidecar(const char* fileName) {
+  size_t len = strlen(fileName);
+  for (int i = 0; i < NUM_OF_SIDECAR_ENCODINGS; ++i) {
+    size_t suffixLen = strlen(sidecarEncodings[i].suffix);
+    if (len > suffixLen && strcmp(fileName + len - suffixLen, sidecarEncodings[i].suffix) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Runs the tool for encoding with in as its stdin and out as its stdout,
+  and waits for it. Returns 0 if it succeeded, -1 if not.
+*/
+static int run_tool(int encoding, int in, int out) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+  // the tool mustn't hold on to the listener or client connections
+  posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+  // the server blocks and ignores signals the tool should get as usual
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t signals;
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigaddset(&signals, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  pid_t pid;
+  int rc = posix_spawnp(&pid, tools[encoding][0], &actions, &attr, tools[encoding], environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  int status = 0;
+  if (rc == 0) {
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      ;
+  }
+  // 127 is what a child that couldn't exec the tool exits with
+  if (rc != 0 || (WIFEXITED(status) && WEXITSTATUS(status) == 127)) {
+    warnx("cannot run %s, no longer generating %s sidecars", tools[encoding][0], sidecarEncodings[encoding].coding);
+    toolMissing[encoding] = 1;
+    return -1;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+  Creates the file a sidecar is written to before it replaces the old
+  one: an unnamed O_TMPFILE where the file system supports one, else a
+  file under a temporary name, which goes in temp. The '-' in such names
+  keeps them out of reach of requests, like those of atomic PUTs.
+*/
+static int open_temp(char* temp) {
+  temp[0] = '\0';
+  int out = open(".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+  if (out < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+    do {
+      sprintf(temp, ".sidecar-%lu", tempSeq++);
+      out = open(temp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    } while (out < 0 && errno == EEXIST);
+  }
+  if (out < 0) {
+    temp[0] = '\0';
+    return -1;
+  }
+  fchmod(out, 0644);
+  return out;
+}
+
+static void discard_temp(int out, const char* temp) {
+  close(out);
+  if (temp[0] != '\0')
+    unlink(temp);
+}
+
+/*
+  Puts the finished temporary file out in place of sidecar with rename(2).
+  An unnamed one is linked in under a temporary name first, since linkat
+  won't replace an existing file. Returns 0, or -1 with errno set.
+*/
+static int publish_temp(int out, char* temp, const char* sidecar) {
+  if (temp[0] == '\0') {
+    char procPath[32];
+    sprintf(procPath, "/proc/self/fd/%d", out);
+    int rc;
+    do {
+      sprintf(temp, ".sidecar-%lu", tempSeq++);
+      rc = linkat(AT_FDCWD, procPath, AT_FDCWD, temp, AT_SYMLINK_FOLLOW);
+    } while (rc < 0 && errno == EEXIST);
+    if (rc < 0) {
+      temp[0] = '\0';
+      return -1;
+    }
+  }
+  return rename(temp, sidecar);
+}
+
+static int same_version(const struct stat* a, const struct stat* b) {
+  return a->st_size == b->st_size
+      && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+      && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// (re)generates fileName's sidecars, or drops those that aren't worth keeping
+static void compress_file(const char* fileName) {
+  int in = open(fileName, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return;
+  }
+  struct stat before;
+  if (fstat(in, &before) < 0 || !S_ISREG(before.st_mode)) {
+    close(in);
+    return;
+  }
+  if (before.st_size < MIN_SIZE) {
+    atomic_fetch_add(&skipped, 1);
+    close(in);
+    return;
+  }
+
+  for (int i = 0; i < NUM_OF_SIDECAR_ENCODINGS; ++i) {
+    if (toolMissing[i])
+      continue;
+
+    // written where requests can't see it until it is complete
+    char sidecar[SIDECAR_NAME_SIZE];
+    char temp[TEMP_NAME_SIZE];
+    sidecar_name(sidecar, fileName, i);
+    int out = open_temp(temp);
+    if (out < 0) {
+      warn("cannot create a sidecar for %s", fileName);
+      atomic_fetch_add(&failed, 1);
+      continue;
+    }
+
+    lseek(in, 0, SEEK_SET);
+    int rc = run_tool(i, in, out);
+    struct stat after, compressed;
+    if (rc == 0 && (fstat(in, &after) < 0 || fstat(out, &compressed) < 0))
+      rc = -1;
+
+    // a PUT that changed the file meanwhile has queued it again
+    if (rc < 0 || !same_version(&before, &after)) {
+      atomic_fetch_add(&failed, 1);
+      discard_temp(out, temp);
+      continue;
+    }
+
+    // a sidecar has to save at least a tenth to be worth the extra lookups
+    if (compressed.st_size * 10 > before.st_size * 9) {
+      atomic_fetch_add(&skipped, 1);
+      discard_temp(out, temp);
+      if (unlink(sidecar) == 0)
+        fdcache_invalidate(sidecar);
+      continue;
+    }
+
+    // the sidecar carries the mtime of the version it was made from, which is how it is matched to it
+    struct timespec times[2] = { before.st_atim, before.st_mtim };
+    if (futimens(out, times) < 0 || publish_temp(out, temp, sidecar) < 0) {
+      warn("cannot write sidecar %s", sidecar);
+      atomic_fetch_add(&failed, 1);
+      discard_temp(out, temp);
+      continue;
+    }
+    close(out);
+    // don't wait for inotify to tell the fd cache
+    fdcache_invalidate(sidecar);
+    atomic_fetch_add(&generated, 1);
+  }
+  close(in);
+}
+
+// sidecar thread function
+static void* t_compress(void* arg) {
+  (void) arg;
+  while (1) {
+    char fileName[SIDECAR_NAME_SIZE];
+
+    // START CRITICAL REGION
+    pthread_mutex_lock(&m_queue);
+    while (queueLen == 0) {
+      pthread_cond_wait(&c_queue, &m_queue);
+    }
+    strcpy(fileName, queue[queueHead]);
+    queueHead = (queueHead + 1) % QUEUE_SIZE;
+    queueLen--;
+    // END CRITICAL REGION
+    pthread_mutex_unlock(&m_queue);
+
+    compress_file(fileName);
+  }
+  return NULL;
+}
+
+void sidecar_start() {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &t_compress, NULL) != 0) {
+    warnx("cannot start the sidecar job");
+    return;
+  }
+  pthread_detach(thread);
+  running = 1;
+}
+
+void sidecar_queue(const char* fileName) {
+  if (!running || is_sidecar(fileName) || strlen(fileName) >= SIDECAR_NAME_SIZE) {
+    return;
+  }
+
+  int queued = 1;
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&m_queue);
+  for (int i = 0; i < queueLen; ++i) {
+    if (strcmp(queue[(queueHead + i) % QUEUE_SIZE], fileName) == 0) {
+      queued = 0;
+      break;
+    }
+  }
+  if (queued && queueLen == QUEUE_SIZE) {
+    queued = 0;
+    atomic_fetch_add(&dropped, 1);
+  }
+  if (queued) {
+    strcpy(queue[(queueHead + queueLen) % QUEUE_SIZE], fileName);
+    queueLen++;
+    pthread_cond_signal(&c_queue);
+  }
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&m_queue);
+}
+
+void sidecar_get_stats(struct SidecarStats* stats) {
+  stats->generated = atomic_load(&generated);
+  stats->skipped = atomic_load(&skipped);
+  stats->failed = atomic_load(&failed);
+  stats->dropped = atomic_load(&dropped);
+}
@@ -0,0 +1,49 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stdint.h>
+
+#define SIDECAR_NAME_SIZE 24  // longest file name, longest suffix and the terminator
+
+/**
+   Compressed copies of files kept next to them, e.g. "r1.txt.gz" for
+   "r1.txt", so a client that accepts the encoding can be sent one with
+   sendfile instead of compressing anything per request. A sidecar carries
+   the modification time of the version it was made from, and only stands
+   for its file while the two match.
+ */
+struct SidecarEncoding {
+  const char* coding;   // as it appears in Accept-Encoding and Content-Encoding
+  const char* suffix;
+};
+
+// in order of preference when a client accepts several equally
+extern const struct SidecarEncoding sidecarEncodings[];
+#define NUM_OF_SIDECAR_ENCODINGS 2
+
+// writes the name of fileName's sidecar for sidecarEncodings[encoding] to out
+void sidecar_name(char* out, const char* fileName, int encoding);
+
+/**
+   Starts the background job that (re)generates the sidecars of the files
+   passed to sidecar_queue by running gzip and zstd on them. An encoding
+   whose tool can't be run is skipped from then on.
+ */
+void sidecar_start();
+
+/**
+   Asks the job to compress fileName, e.g. once a PUT has written it. A
+   file that is already waiting isn't queued twice, and nothing happens if
+   the job isn't running or is too far behind.
+ */
+void sidecar_queue(const char* fileName);
+
+struct SidecarStats {
+  uint64_t generated;   // sidecars written
+  uint64_t skipped;     // files too small or too incompressible to be worth one
+  uint64_t failed;      // files that changed while they were compressed, or tool failures
+  uint64_t dropped;     // requests lost because the queue was full
+};
+void sidecar_get_stats(struct SidecarStats* stats);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+  Tests for what the file caches do once their inotify watch is lost.
+
+  The watched directory is removed while the files it stood for stay
+  around, so nothing reports changes to them anymore. From then on every
+  open has to go to the file system, even for a file that was cached
+  before, and a file changed behind the server's back is seen as it is.
+  The object cache is wired up the way httpserver does it, and has to
+  drop its objects and refuse new ones, including a fill that looked the
+  file up while the watch was still there.
+
+  usage: ./cache-test
+*/
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "../fdcache.h"
+#include "../objcache.h"
+
+#define WAIT_TRIES 500          // of 10 ms each
+
+int fails = 0;
+uint64_t staleGeneration;   // looked up for "c" before the watch was lost
+
+static void write_file(const char* fileName, const char* text) {
+  int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, text, strlen(text)) != (ssize_t) strlen(text)) {
+    err(EXIT_FAILURE, "cannot write %s", fileName);
+  }
+  close(fd);
+}
+
+// opens fileName through the cache and returns its size, -1 if it can't be opened
+static off_t cached_size(const char* fileName) {
+  struct CachedFile* file = fdcache_open(fileName);
+  if (file == NULL) {
+    return -1;
+  }
+  off_t size = file->size;
+  fdcache_release(file);
+  return size;
+}
+
+// waits for the watch thread to drop every cached entry
+static int wait_for_empty_cache() {
+  for (int i = 0; i < WAIT_TRIES; ++i) {
+    struct FdCacheStats stats;
+    fdcache_get_stats(&stats);
+    if (stats.cached == 0)
+      return 1;
+    usleep(10000);
+  }
+  return 0;
+}
+
+// caches fileName's body as an object, returns whether that was a hit
+static int get_object(const char* fileName, uint64_t* generation) {
+  struct CachedObject* object = objcache_get(fileName, generation);
+  if (object != NULL) {
+    objcache_release(object);
+    return 1;
+  }
+  struct CachedFile* file = fdcache_open(fileName);
+  if (file != NULL) {
+    object = objcache_fill(fileName, *generation, file->fd, file->size, file->mtime.tv_sec);
+    if (object != NULL)
+      objcache_release(object);
+    fdcache_release(file);
+  }
+  return 0;
+}
+
+// a file is cached while the watch is up
+int test_cached() {
+  struct FdCacheStats before, after;
+  fdcache_get_stats(&before);
+  int passed = cached_size("a") == 5 && cached_size("a") == 5;
+  fdcache_get_stats(&after);
+  return passed && after.hits == before.hits + 1 && after.cached == 1;
+}
+
+// an object is cached while the watch is up
+int test_object_cached() {
+  uint64_t generation;
+  struct ObjCacheStats stats;
+  int passed = !get_object("b", &generation) && get_object("b", &generation);
+  objcache_get_stats(&stats);
+  return passed && stats.objects == 1;
+}
+
+// once the watch is lost nothing is cached and changes are seen right away
+int test_fd_cache_after_loss() {
+  if (rmdir("watched") < 0) {
+    warn("cannot remove the watched directory");
+    return 0;
+  }
+  if (!wait_for_empty_cache()) {
+    return 0;
+  }
+
+  write_file("a", "changed");
+  struct FdCacheStats stats;
+  int passed = cached_size("a") == 7 && cached_size("a") == 7;
+  write_file("a", "changed again");
+  passed = passed && cached_size("a") == 13;
+  fdcache_get_stats(&stats);
+  return passed && stats.cached == 0;
+}
+
+// after the loss no object is kept, not even one looked up before it
+int test_object_cache_after_loss() {
+  struct ObjCacheStats stats;
+  objcache_get_stats(&stats);
+  if (stats.objects != 0 || stats.budget != 0) {
+    return 0;
+  }
+
+  struct CachedFile* file = fdcache_open("c");
+  if (file == NULL) {
+    return 0;
+  }
+  // served uncached or not at all, never kept
+  struct CachedObject* object = objcache_fill("c", staleGeneration, file->fd, file->size, file->mtime.tv_sec);
+  int passed = object == NULL || object->bodyLen == 5;
+  if (object != NULL)
+    objcache_release(object);
+  fdcache_release(file);
+
+  uint64_t generation;
+  passed = passed && !get_object("b", &generation) && !get_object("b", &generation);
+  objcache_get_stats(&stats);
+  return passed && stats.objects == 0;
+}
+
+void report(int testCase, int passed) {
+  printf("Test %d: %s\n", testCase, passed ? "PASS" : "FAIL");
+  if (!passed)
+    fails++;
+}
+
+int main() {
+  char dir[] = "/tmp/cache-test.XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) < 0 || mkdir("watched", 0755) < 0) {
+    err(EXIT_FAILURE, "cannot set up %s", dir);
+  }
+  write_file("a", "hello");
+  write_file("b", "hello");
+  write_file("c", "hello");
+
+  fdcache_init(16);
+  objcache_init(1 << 20);
+  if (fdcache_watch("watched", &objcache_invalidate, &objcache_disable) < 0) {
+    errx(EXIT_FAILURE, "cannot watch %s/watched", dir);
+  }
+
+  int testCase = 1;
+  report(testCase++, test_cached());
+  report(testCase++, test_object_cached());
+  if (objcache_get("c", &staleGeneration) != NULL) {
+    errx(EXIT_FAILURE, "c is cached before it was ever filled");
+  }
+  report(testCase++, test_fd_cache_after_loss());
+  report(testCase++, test_object_cache_after_loss());
+
+  unlink("a");
+  unlink("b");
+  unlink("c");
+  rmdir(dir);
+  printf("%d of %d tests failed\n", fails, testCase - 1);
+  return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -29,11 +29,16 @@ check_GET_Diff () {
 	fi
 }
 
+# the Last-Modified date the server sends for a file
+last_modified () {
+	TZ=GMT LC_ALL=C date -r "$1" '+%a, %d %b %Y %H:%M:%S GMT'
+}
+
 check_HEAD_Diff () {
 	i=0
 	while [ $i -lt $3 ]
 	do
-		out=$(diff <(printf "HTTP/1.1 200 OK\r\nContent-Length: $1\r\n\r\n") <(timeout 5 curl -sI localhost:$port/r"$(($2 + $i))".txt))
+		out=$(diff <(printf "HTTP/1.1 200 OK\r\nContent-Length: $1\r\nLast-Modified: $(last_modified r"$(($2 + $i))".txt)\r\n\r\n") <(timeout 5 curl -sI localhost:$port/r"$(($2 + $i))".txt))
 
 		if [ ! "$out" = "" ]; then
 			break
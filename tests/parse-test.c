@@ -0,0 +1,328 @@
+/*
+  Tests for the request parser in httpparse.c.
+
+  Every request in the corpus is parsed whole, then again split at every
+  byte into two reads, then fed one byte at a time, and each way has to
+  give the same result. A head is never reported complete early, and
+  whatever follows it (a body or a pipelined request) is left alone.
+  Range headers and dates are checked against the values they stand for,
+  and chunked bodies are decoded in pieces of every size.
+
+  usage: ./parse-test
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../httpparse.h"
+
+struct Case {
+  const char* raw;          // request bytes, possibly followed by more
+  long headLen;             // expected result of parsing the whole thing
+  const char* method;
+  const char* target;
+  const char* version;
+  int numOfHeaders;
+  const char* header;       // a header to look up, and its expected value
+  const char* value;
+};
+
+struct Case corpus[] = {
+  { "GET /r1.txt HTTP/1.1\r\nHost: localhost:8080\r\n\r\n",
+    46, "GET", "/r1.txt", "1.1", 1, "host", "localhost:8080" },
+  { "HEAD /a HTTP/1.0\r\n\r\n",
+    20, "HEAD", "/a", "1.0", 0, "Host", NULL },
+  { "PUT /f HTTP/1.1\r\nHost: localhost:1\r\nContent-Length: 5\r\n\r\nhello",
+    57, "PUT", "/f", "1.1", 2, "CONTENT-LENGTH", "5" },
+  { "GET /x HTTP/1.1\r\nHost:localhost:2\r\nConnection:   keep-alive, Upgrade \t\r\nX-Empty:\r\n\r\n",
+    84, "GET", "/x", "1.1", 3, "Connection", "keep-alive, Upgrade" },
+  { "GET /x HTTP/1.1\r\nX-Empty:\r\n\r\n", 29, "GET", "/x", "1.1", 1, "x-empty", "" },
+  // pipelined: only the first head is parsed
+  { "GET /one HTTP/1.1\r\nHost: h\r\n\r\nGET /two HTTP/1.1\r\nHost: h\r\n\r\n",
+    30, "GET", "/one", "1.1", 1, "Host", "h" },
+  { "TEAPOT /pot HTTP/1.1\r\nHost: h\r\nContent-Length: 12\r\n\r\n",
+    53, "TEAPOT", "/pot", "1.1", 2, "Content-Length", "12" },
+
+  // malformed heads
+  { "GET /x HTTP/1.1\r\nHost localhost\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "GET /x HTTP/1.1\r\nHo st: h\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "GET  /x HTTP/1.1\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "GET /x\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "GET /x HTTP/11\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "GET /x FTP/1.1\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "G(T /x HTTP/1.1\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "GET /x HTTP/1.1\r\n folded: value\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "GET /x HTTP/1.1\r\nA: b\rc\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "GET /x HTTP/1.1\r\nA: b\nc: d\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+  { "\r\n\r\n", .headLen = HTTP_PARSE_ERROR },
+
+  // not a full head yet
+  { "GET /x HTTP/1.1\r\nHost: h\r\n", .headLen = HTTP_PARSE_INCOMPLETE },
+  { "GET /x HTTP/1.1\r\nHost: h\r\n\r", .headLen = HTTP_PARSE_INCOMPLETE },
+};
+#define CORPUS_SIZE ((int) (sizeof corpus / sizeof corpus[0]))
+
+int fails = 0;
+
+int slice_is(struct HttpSlice slice, const char* str) {
+  return slice.len == strlen(str) && memcmp(slice.data, str, slice.len) == 0;
+}
+
+// checks the result of one way of parsing, returns 1 if it matches the case
+int check_result(struct Case* c, long result, struct HttpRequest* request, const char* how) {
+  if (result != c->headLen) {
+    printf("  %s: returned %ld, expected %ld\n", how, result, c->headLen);
+    return 0;
+  }
+  if (result < 0) {
+    return 1;
+  }
+
+  const struct HttpSlice* value = http_find_header(request, c->header);
+  if (!slice_is(request->method, c->method) || !slice_is(request->target, c->target)
+      || !slice_is(request->version, c->version) || request->numOfHeaders != c->numOfHeaders
+      || (c->value == NULL ? value != NULL : value == NULL || !slice_is(*value, c->value))) {
+    printf("  %s: wrong request line or headers\n", how);
+    return 0;
+  }
+  return 1;
+}
+
+int test_case(struct Case* c) {
+  size_t len = strlen(c->raw);
+  struct HttpRequest request;
+  size_t scanned = 0;
+
+  long result = http_parse_request(c->raw, len, &scanned, &request);
+  if (!check_result(c, result, &request, "whole")) {
+    return 0;
+  }
+  size_t complete = result >= 0 ? (size_t) result : len;
+
+  // two reads, split after every byte
+  for (size_t split = 1; split < len; ++split) {
+    scanned = 0;
+    long first = http_parse_request(c->raw, split, &scanned, &request);
+    long expected = split >= complete ? c->headLen : HTTP_PARSE_INCOMPLETE;
+    if (first != expected) {
+      printf("  split at %zu: first read returned %ld, expected %ld\n", split, first, expected);
+      return 0;
+    }
+    char how[32];
+    sprintf(how, "split at %zu", split);
+    if (!check_result(c, http_parse_request(c->raw, len, &scanned, &request), &request, how)) {
+      return 0;
+    }
+  }
+
+  // one byte at a time, carrying the scan position along like a connection does
+  scanned = 0;
+  for (size_t i = 1; i <= len; ++i) {
+    result = http_parse_request(c->raw, i, &scanned, &request);
+    if (result != HTTP_PARSE_INCOMPLETE) {
+      break;
+    }
+  }
+  return check_result(c, result, &request, "byte at a time");
+}
+
+// pipelined requests come out one at a time, in order, through a ReadBuffer
+int test_pipeline() {
+  const char* raw =
+      "PUT /a HTTP/1.1\r\nHost: h\r\nContent-Length: 3\r\n\r\nabc"
+      "GET /a HTTP/1.1\r\nHost: h\r\n\r\n"
+      "HEAD /b HTTP/1.0\r\nConnection: keep-alive\r\n\r\n";
+  const char* targets[] = { "/a", "/a", "/b" };
+  size_t bodies[] = { 3, 0, 0 };
+
+  struct ReadBuffer buffer;
+  readbuf_init(&buffer);
+  size_t len = strlen(raw);
+  while (buffer.len < len) {
+    size_t space = readbuf_reserve(&buffer);
+    size_t n = len - buffer.len < space ? len - buffer.len : space;
+    memcpy(buffer.data + buffer.len, raw + buffer.len, n);
+    buffer.len += n;
+  }
+
+  int ok = 1;
+  for (int i = 0; i < 3 && ok; ++i) {
+    struct HttpRequest request;
+    long headLen = http_parse_request(buffer.data, buffer.len, &buffer.scanned, &request);
+    ok = headLen > 0 && slice_is(request.target, targets[i]);
+    if (ok)
+      readbuf_consume(&buffer, headLen + bodies[i]);
+  }
+  ok = ok && buffer.len == 0;
+  readbuf_free(&buffer);
+  return ok;
+}
+
+// heads that never end are rejected once they outgrow the limit
+int test_too_large() {
+  char raw[HTTP_MAX_HEAD_SIZE + 64];
+  strcpy(raw, "GET /x HTTP/1.1\r\nX-Long: ");
+  size_t len = strlen(raw);
+  memset(raw + len, 'a', sizeof raw - len);
+
+  struct HttpRequest request;
+  size_t scanned = 0;
+  return http_parse_request(raw, HTTP_MAX_HEAD_SIZE - 1, &scanned, &request) == HTTP_PARSE_INCOMPLETE
+      && http_parse_request(raw, sizeof raw, &scanned, &request) == HTTP_PARSE_ERROR;
+}
+
+int test_tokens() {
+  struct HttpSlice value = { "Keep-Alive , Upgrade,close", 26 };
+  struct HttpSlice partial = { "closed", 6 };
+  return http_has_token(value, "keep-alive") && http_has_token(value, "upgrade")
+      && http_has_token(value, "close") && !http_has_token(partial, "close");
+}
+
+// parses value as a Range header for a file of size bytes and compares the result with expected, "" for none
+int range_is(const char* value, long long size, int result, const char* expected) {
+  struct HttpSlice slice = { value, strlen(value) };
+  struct HttpRange ranges[4];
+  if (http_parse_ranges(slice, size, ranges, 4) != result)
+    return 0;
+
+  char text[128] = "";
+  for (int i = 0; i < result; ++i) {
+    sprintf(text + strlen(text), "%s%lld-%lld", i > 0 ? "," : "", ranges[i].first, ranges[i].last);
+  }
+  return strcmp(text, expected) == 0;
+}
+
+int test_ranges() {
+  return range_is("bytes=0-99", 1000, 1, "0-99")
+      && range_is("bytes=0-99, 200-,-50", 1000, 3, "0-99,200-999,950-999")
+      && range_is("Bytes=500-5000", 1000, 1, "500-999")
+      && range_is("bytes=-5000", 1000, 1, "0-999")
+      && range_is("bytes=0-0,,", 1, 1, "0-0")
+      && range_is("bytes=99999999999999999999-", 1000, 0, "")
+      && range_is("bytes=1000-", 1000, 0, "")
+      && range_is("bytes=-0", 1000, 0, "")
+      && range_is("bytes=0-", 0, 0, "")
+      && range_is("bytes=5-10,2000-", 1000, 1, "5-10")
+      && range_is("bytes=10-5", 1000, -1, "")
+      && range_is("bytes=", 1000, -1, "")
+      && range_is("bytes=a-b", 1000, -1, "")
+      && range_is("bytes=1-2 3", 1000, -1, "")
+      && range_is("items=0-1", 1000, -1, "")
+      && range_is("bytes=0-1,2-3,4-5,6-7,8-9", 1000, -1, "");
+}
+
+int date_is(const char* value, time_t expected) {
+  struct HttpSlice slice = { value, strlen(value) };
+  time_t date;
+  if (expected == -1)
+    return http_parse_date(slice, &date) == -1;
+  return http_parse_date(slice, &date) == 0 && date == expected;
+}
+
+int test_dates() {
+  return date_is("Sun, 06 Nov 1994 08:49:37 GMT", 784111777)
+      && date_is("Sunday, 06-Nov-94 08:49:37 GMT", 784111777)
+      && date_is("Sun Nov  6 08:49:37 1994", 784111777)
+      && date_is("Sun, 06 Nov 1994 08:49:37", -1)
+      && date_is("\"abc\"", -1)
+      && date_is("", -1);
+}
+
+// formatted dates have to read back as the same time
+int test_format_date() {
+  char text[HTTP_DATE_SIZE];
+  int len = http_format_date(784111777, text);
+  if (len != HTTP_DATE_SIZE - 1 || strcmp(text, "Sun, 06 Nov 1994 08:49:37 GMT") != 0)
+    return 0;
+  http_format_date(0, text);
+  return date_is(text, 0);
+}
+
+/**
+   Decodes a chunked body handed over step bytes at a time, the way it
+   comes off a connection. Returns 1 if it decodes to expected and ends
+   after used bytes, or if it is malformed and expected is NULL.
+ */
+int chunks_are(const char* raw, size_t step, const char* expected, size_t used) {
+  struct ChunkDecoder decoder;
+  http_chunks_init(&decoder);
+  char out[256];
+  size_t outLen = 0, len = strlen(raw), pos = 0;
+
+  for (size_t available = step; pos < len && decoder.state != CHUNK_DONE; available += step) {
+    if (available > len)
+      available = len;
+    // whatever a call didn't use is fed again with the next piece
+    while (pos < available && decoder.state != CHUNK_DONE) {
+      struct HttpSlice data;
+      long n = http_decode_chunks(&decoder, raw + pos, available - pos, &data);
+      if (n == HTTP_PARSE_ERROR)
+        return expected == NULL;
+      memcpy(out + outLen, data.data, data.len);
+      outLen += data.len;
+      pos += n;
+    }
+  }
+  return expected != NULL && decoder.state == CHUNK_DONE && pos == used
+      && outLen == strlen(expected) && memcmp(out, expected, outLen) == 0;
+}
+
+int test_chunks() {
+  const char* body = "5\r\nhello\r\n6;name=\"v\"\r\n world\r\n0\r\nX-Checksum: 1\r\n\r\nGET /next";
+  for (size_t step = 1; step <= strlen(body); ++step) {
+    if (!chunks_are(body, step, "hello world", strlen(body) - 9))
+      return 0;
+  }
+  return chunks_are("A\r\n0123456789\r\n0\r\n\r\n", 7, "0123456789", 20)
+      && chunks_are("0\r\n\r\n", 1, "", 5)
+      && chunks_are("x\r\n", 1, NULL, 0)
+      && chunks_are("\r\n", 1, NULL, 0)
+      && chunks_are("5\r\nhelloX\r\n0\r\n\r\n", 3, NULL, 0)
+      && chunks_are("5\nhello\r\n0\r\n\r\n", 3, NULL, 0)
+      && chunks_are("10000000000000000\r\n", 4, NULL, 0)
+      && !chunks_are("5\r\nhel", 2, "hel", 8);
+}
+
+int quality_is(const char* value, const char* coding, int expected) {
+  struct HttpSlice slice = { value, strlen(value) };
+  return http_accept_quality(slice, coding) == expected;
+}
+
+int test_accept_encoding() {
+  return quality_is("gzip, deflate, br, zstd", "zstd", 1000)
+      && quality_is("gzip;q=0.8, zstd;q=0.5", "gzip", 800)
+      && quality_is("gzip;q=0.8, zstd;q=0.5", "zstd", 500)
+      && quality_is("GZIP ; Q=0.125", "gzip", 125)
+      && quality_is("br;q=1.0, *;q=0.1", "gzip", 100)
+      && quality_is("*, gzip;q=0", "gzip", 0)
+      && quality_is("gzip;level=9;q=0.3", "gzip", 300)
+      && quality_is("gzip;q=2", "gzip", 0)
+      && quality_is("gzip;q=0.1234", "gzip", 0)
+      && quality_is("xgzip, gzipx", "gzip", 0)
+      && quality_is("identity", "gzip", 0)
+      && quality_is("", "gzip", 0);
+}
+
+void report(int testCase, int passed) {
+  printf("Test %d: %s\n", testCase, passed ? "PASS" : "FAIL");
+  if (!passed)
+    fails++;
+}
+
+int main() {
+  int testCase = 1;
+  for (int i = 0; i < CORPUS_SIZE; ++i) {
+    report(testCase++, test_case(&corpus[i]));
+  }
+  report(testCase++, test_pipeline());
+  report(testCase++, test_too_large());
+  report(testCase++, test_tokens());
+  report(testCase++, test_ranges());
+  report(testCase++, test_dates());
+  report(testCase++, test_format_date());
+  report(testCase++, test_chunks());
+  report(testCase++, test_accept_encoding());
+
+  printf("%d of %d tests failed\n", fails, testCase - 1);
+  return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
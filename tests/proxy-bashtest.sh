@@ -1,10 +1,109 @@
 #!/bin/bash
 
-time curl http://localhost:3000/largefile1 & \
-time curl http://localhost:3000/largefile2 & \
-time curl http://localhost:3000/largefile3 & \
-time curl http://localhost:3000/largefile4 & \
-time curl http://localhost:3000/largefile5 & \
-time curl http://localhost:3000/largefile6 & \
-time curl http://localhost:3000/largefile7 & \
-time curl http://localhost:3000/largefile8
\ No newline at end of file
+# Runs ./httpproxy on the given port in front of one ./httpserver on the
+# port after it, both started from the current directory, and checks what
+# the proxy caches: a 200 is kept and revalidated with a conditional GET,
+# the answer to a Range never is, and Range is recognized whatever the case
+# of its name.
+
+port=3000
+if (( "$#" == 1 )) && (( "$1" > 1023 )); then
+	port="$1"
+elif [[ "$#" -ne 0 ]]; then
+	echo "proxy-bashtest: Program takes up to 1 argument (port number). Exiting..."
+	exit 1
+fi
+serverPort=$(($port + 1))
+
+# the proxy only caches files last modified before the current second
+make_file () {
+	head -c $2 /dev/urandom | base64 -w 0 | head -c $2 > $1
+	touch -d '2020-01-01' $1
+}
+
+# the body length the server logged for the last request for file
+logged_length () {
+	sleep 0.5
+	grep -P "^GET\t/$1\t" proxy_log | tail -n 1 | cut -f 4
+}
+
+report () {
+	printf "Test $testCase: "
+	if [ "$1" = "" ]; then
+		printf "PASS\n"
+	else
+		printf "FAIL. $2\n"
+	fi
+	((++testCase))
+}
+
+> proxy_log
+make_file p1.txt 600
+make_file p2.txt 600
+for i in {1..8}; do
+	make_file largefile$i 4000000
+done
+
+./httpserver -l proxy_log $serverPort > /dev/null 2>&1 &
+serverPid=$!
+sleep 0.3
+./httpproxy $port $serverPort > /dev/null 2>&1 &
+proxyPid=$!
+sleep 0.5
+
+testCase=1
+
+echo "====Running proxy cache tests===="
+
+# the first GET is cached, the second is revalidated and answered from the cache
+out=$(diff p1.txt <(timeout 5 curl -s localhost:$port/p1.txt))
+report "$out" "diff p1.txt <(curl -s localhost:$port/p1.txt)"
+
+out=$(diff p1.txt <(timeout 5 curl -s localhost:$port/p1.txt))
+if [ "$out" = "" ] && [ "$(logged_length p1.txt)" != "0" ]; then
+	out="the server sent the body again instead of a 304"
+fi
+report "$out" "second GET of p1.txt wasn't answered from the cache: $out"
+
+# a changed file is sent in full and replaces the cached copy
+make_file p1.txt 500
+touch -d '2021-01-01' p1.txt
+out=$(diff p1.txt <(timeout 5 curl -s localhost:$port/p1.txt))
+report "$out" "diff p1.txt <(curl -s localhost:$port/p1.txt) after p1.txt changed"
+
+# the answer to a Range goes through as it is and isn't cached
+out=$(diff <(timeout 5 curl -s -w '%{http_code}\n' -H "Range: bytes=0-3" localhost:$port/p2.txt) <(head -c 4 p2.txt; printf "206\n"))
+report "$out" "diff <(curl -s -H \"Range: bytes=0-3\" localhost:$port/p2.txt) <(head -c 4 p2.txt)"
+
+out=$(diff p2.txt <(timeout 5 curl -s localhost:$port/p2.txt))
+if [ "$out" = "" ] && [ "$(logged_length p2.txt)" != "600" ]; then
+	out="the proxy revalidated a cached 206"
+fi
+report "$out" "GET of p2.txt after a Range: $out"
+
+# a Range for a cached file isn't answered with the whole cached copy
+out=$(diff <(timeout 5 curl -s -w '%{http_code}\n' -H "range: bytes=0-3" localhost:$port/p1.txt) <(head -c 4 p1.txt; printf "206\n"))
+report "$out" "diff <(curl -s -H \"range: bytes=0-3\" localhost:$port/p1.txt) <(head -c 4 p1.txt)"
+
+out=$(diff <(timeout 5 curl -s -w '%{http_code}\n' -H "RANGE:bytes=-4" localhost:$port/p1.txt) <(tail -c 4 p1.txt; printf "206\n"))
+report "$out" "diff <(curl -s -H \"RANGE:bytes=-4\" localhost:$port/p1.txt) <(tail -c 4 p1.txt)"
+
+echo "====Running concurrent large file GETs===="
+
+pids=()
+for i in {1..8}; do
+	timeout 20 curl -s localhost:$port/largefile$i > largefile$i.out &
+	pids+=($!)
+done
+wait ${pids[@]}
+out=""
+for i in {1..8}; do
+	if ! cmp -s largefile$i largefile$i.out; then
+		out="largefile$i differs"
+		break
+	fi
+done
+report "$out" "$out"
+
+kill $proxyPid $serverPid
+rm -f p1.txt p2.txt largefile*
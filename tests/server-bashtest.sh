@@ -29,11 +29,16 @@ check_GET_Diff () {
 	fi
 }
 
+# the Last-Modified date the server sends for a file
+last_modified () {
+	TZ=GMT LC_ALL=C date -r "$1" '+%a, %d %b %Y %H:%M:%S GMT'
+}
+
 check_HEAD_Diff () {
 	i=0
 	while [ $i -lt $3 ]
 	do
-		out=$(diff <(printf "HTTP/1.1 200 OK\r\nContent-Length: $1\r\n\r\n") <(timeout 5 curl -sI localhost:$port/r"$(($2 + $i))".txt))
+		out=$(diff <(printf "HTTP/1.1 200 OK\r\nContent-Length: $1\r\nLast-Modified: $(last_modified r"$(($2 + $i))".txt)\r\n\r\n") <(timeout 5 curl -sI localhost:$port/r"$(($2 + $i))".txt))
 
 		if [ ! "$out" = "" ]; then
 			break
@@ -79,6 +84,19 @@ mixedCalls() {
 	curl -sT $1 localhost:$port/$2 > /dev/null & curl -I localhost:$port/$3 >/dev/null & wget -qO - localhost:$port/$4 >/dev/null & curl -sT $1 localhost:$port/$5 
 }
 
+# PUTs $1 and $2 to $3 by turns while GETting it $4 times, saving what each GET got to get$i.out
+getDuringPutCalls() {
+	for i in $(seq 1 $4); do
+		if (( i % 2 )); then
+			timeout 20 curl -sT $1 localhost:$port/$3 > /dev/null &
+		else
+			timeout 20 curl -sT $2 localhost:$port/$3 > /dev/null &
+		fi
+		timeout 20 curl -s localhost:$port/$3 > get$i.out &
+	done
+	wait
+}
+
 #################################################################################################
 #### Run C Test suite written by @Burning on discord. If you do not have their test script,  ####
 #### this particular suite will not execute, but I highly encourage you to get them.         ####
@@ -184,8 +202,79 @@ while [ $iter -le $NUM_IN_FILES ]; do
 	((++testCase))
 done
 
+#### Ask for parts of a file and for it only if it changed ####
+#### Tests 8-12                                            ####
+echo "====Running Range and If-Modified-Since tests===="
+
+FILE=r1.txt
+SIZE=$(wc -c < $FILE)
+
+# a single range is sent as it is, with the part it is in Content-Range
+timeout 5 curl -s -D range_head.out -o range_body.out -H "Range: bytes=0-99" localhost:$port/$FILE
+out=$(diff <(tr -d '\r' < range_head.out | grep -v "^Last-Modified") \
+	<(printf "HTTP/1.1 206 Partial Content\nContent-Range: bytes 0-99/$SIZE\nContent-Length: 100\n\n"); \
+	cmp range_body.out <(head -c 100 $FILE) 2>&1)
+rm -f range_head.out range_body.out
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Difference found. Command run: curl -s -D - -H \"Range: bytes=0-99\" localhost:$port/$FILE\n"
+fi
+((++testCase))
+
+# a suffix range is the end of the file
+out=$(diff <(timeout 5 curl -s -w '%{http_code}' -H "Range: bytes=-100" localhost:$port/$FILE) <(tail -c 100 $FILE; printf 206))
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Difference found. Command run: curl -s -H \"Range: bytes=-100\" localhost:$port/$FILE\n"
+fi
+((++testCase))
+
+# a range that starts past the end can't be satisfied, and says how long the file is
+out=$(diff <(timeout 5 curl -s -D - -H "Range: bytes=$SIZE-" localhost:$port/$FILE | tr -d '\r') \
+	<(printf "HTTP/1.1 416 Range Not Satisfiable\nContent-Range: bytes */$SIZE\nContent-Length: 22\n\nRange Not Satisfiable\n"))
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Difference found. Command run: curl -s -D - -H \"Range: bytes=$SIZE-\" localhost:$port/$FILE\n"
+fi
+((++testCase))
+
+# several ranges are parts of a multipart/byteranges body, each after a boundary
+timeout 5 curl -s -D range_head.out -o range_body.out -H "Range: bytes=0-9,20-29" localhost:$port/$FILE
+BOUNDARY=$(tr -d '\r' < range_head.out | grep "^Content-Type: multipart/byteranges; boundary=" | cut -d= -f2)
+out=$(cmp range_body.out <(printf "\r\n--$BOUNDARY\r\nContent-Range: bytes 0-9/$SIZE\r\n\r\n"; head -c 10 $FILE; \
+	printf "\r\n--$BOUNDARY\r\nContent-Range: bytes 20-29/$SIZE\r\n\r\n"; head -c 30 $FILE | tail -c 10; printf "\r\n--$BOUNDARY--\r\n") 2>&1)
+if [ "$BOUNDARY" = "" ] || ! grep -q "^HTTP/1.1 206 " range_head.out \
+	|| ! grep -q "^Content-Length: $(wc -c < range_body.out)"$'\r'"$" range_head.out; then
+	out="bad head"
+fi
+rm -f range_head.out range_body.out
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. $out. Command run: curl -s -D - -H \"Range: bytes=0-9,20-29\" localhost:$port/$FILE\n"
+fi
+((++testCase))
+
+# a copy that is still current gets a 304 without a body
+out=$(diff <(timeout 5 curl -s -D - -H "If-Modified-Since: $(last_modified $FILE)" localhost:$port/$FILE | tr -d '\r') \
+	<(printf "HTTP/1.1 304 Not Modified\nLast-Modified: $(last_modified $FILE)\n\n"))
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Difference found. Command run: curl -s -D - -H \"If-Modified-Since: $(last_modified $FILE)\" localhost:$port/$FILE\n"
+fi
+((++testCase))
+
 #### Call HEAD on each test file and diff it with wc of file ####
-#### Tests 8-14                                              ####
+#### Tests 13-19                                             ####
 echo "====Running HEAD tests===="
 
 iter=1
@@ -207,7 +296,7 @@ while [ $iter -le $NUM_IN_FILES ]; do
 done
 
 #### PUT file into another file, then diff the resulting files ####
-#### Tests 15-21                                               ####
+#### Tests 20-26                                               ####
 echo "====Running PUT tests===="
 
 iter=1
@@ -226,7 +315,7 @@ while [ $iter -le $NUM_IN_FILES ]; do
 done
 
 #### Call GET on the files created in the above loop and diff them with OG file ####
-#### Test 22                                                                    ####
+#### Test 27                                                                    ####
 echo "====Running GETs on files created/updated with PUTs above===="
 
 out=$(check_GET_Diff $INFILE 8 4)
@@ -241,7 +330,7 @@ fi
 
 
 #### Call HEAD on each test file and diff it with wc and expected return of file ####
-#### Tests 23                                                                    ####
+#### Test 28                                                                     ####
 echo "====Running HEADs on files created/updated with PUTs above===="
 
 WC_OUT=$(wc $INFILE)
@@ -259,7 +348,7 @@ fi
 ((++testCase))
 
 #### Call put on same file twice then check output of GET ####
-#### Tests 24-30                                          ####
+#### Tests 29-35                                          ####
 echo "====Calling GET after truncation===="
 
 iter=1
@@ -286,7 +375,7 @@ done
 
 
 #### Call put on same file twice then check output of HEAD ####
-#### Tests 31-37                                           ####
+#### Tests 36-42                                           ####
 echo "====Calling HEAD after truncation===="
 
 iter=1
@@ -321,7 +410,7 @@ do
 done
 
 #### Check for invalid resource names, content-lengths, hosts among other things ####
-#### Tests 38-50                                                                 ####
+#### Tests 43-56                                                                 ####
 echo "====Running Bad Request tests===="
 FILE1=r1.txt
 FILE2=r2.txt
@@ -356,14 +445,25 @@ else
 fi
 ((++testCase))
 
-out=$(diff <(printf "TEAPOT /$FILE1 HTTP/1.1\r\nHost: localhost:$port\r\nContent-Length: 12\r\n\r\n" | nc -C localhost "$port") <(printf 'HTTP/1.1 501 Not Implemented\r\nContent-Length: 16\r\n\r\nNot Implemented\n'))
+out=$(diff <(printf "TEAPOT /$FILE1 HTTP/1.1\r\nHost: localhost:$port\r\nContent-Length: 12\r\n\r\n" | nc -C localhost "$port") <(printf 'HTTP/1.1 501 Not Implemented\r\nContent-Length: 16\r\nConnection: close\r\n\r\nNot Implemented\n'))
 printf "Test $testCase: "
 
 if [ "$out" = "" ]; then
 	printf "PASS\n"
 else
 	echo out is $out
-	printf 'FAIL. Difference found. Command run: diff <(printf \"TEAPOT /%s HTTP/1.1\\r\\nHost: localhost:%s\\r\\nContent-Length: 12\\r\\n\\r\\n" | nc -C localhost %s) <(printf \"HTTP/1.1 501 Not Implemented\\r\\nContent-Length: 16\\r\\n\\r\\nNot Implemented\\n\")\n' $FILE1 $port $port
+	printf 'FAIL. Difference found. Command run: diff <(printf \"TEAPOT /%s HTTP/1.1\\r\\nHost: localhost:%s\\r\\nContent-Length: 12\\r\\n\\r\\n" | nc -C localhost %s) <(printf \"HTTP/1.1 501 Not Implemented\\r\\nContent-Length: 16\\r\\nConnection: close\\r\\n\\r\\nNot Implemented\\n\")\n' $FILE1 $port $port
+fi
+((++testCase))
+
+# both requests should be served over a single kept-alive connection
+out=$(diff <(curl -s -o /dev/null -o /dev/null -w '%{num_connects}\n' localhost:$port/$FILE1 localhost:$port/$FILE1) <(printf '1\n0\n'))
+printf "Test $testCase: "
+
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf 'FAIL. Difference found. Command run: diff <(curl -s -o /dev/null -o /dev/null -w \"%%{num_connects}\\n\" localhost:%s/%s localhost:%s/%s) <(printf \"1\\n0\\n\")\n' $port $FILE1 $port $FILE1
 fi
 ((++testCase))
 
@@ -466,7 +566,7 @@ fi
 ((++testCase))
 
 #### Checking for a file that does not exist ####
-#### Tests 51-52                             ####
+#### Tests 57-58                             ####
 echo ====Running File Not Found tests====
 FILE=non_existent.txt
 
@@ -490,7 +590,7 @@ fi
 ((++testCase))
 
 #### Checking on a file that you do not have access to ####
-#### Tests 53-55                                       ####
+#### Tests 59-61                                       ####
 echo ====Running Forbidden tests====
 FILE=forbidden.txt
 
@@ -530,7 +630,7 @@ fi
 ((++testCase))
 
 #### Performing health check ####
-#### Test 56                 ####
+#### Test 62                 ####
 echo ====Healthcheck Test====
 line_count=$(cat log_file | wc)
 err_count=$(cat log_file | grep FAIL | wc)
@@ -552,7 +652,7 @@ fi
 ((++testCase))
 
 #### Checking to see whether or not your program will hang ####
-#### Tests 57-63                                           ####
+#### Tests 63-70                                           ####
 echo ====CL Arguments Test====
 timeout 2 ./httpserver -N 5 -l log_file
 if [ $? -eq 124 ]; then
@@ -647,4 +747,186 @@ else
 fi
 ((++testCase))
 
+#### A PUT that is turned away leaves the file as it was ####
+#### Test 72                                            ####
+echo ====Bad PUT Test====
+
+OUTFILE=r12.txt
+cp r3.txt $OUTFILE
+timeout 5 curl -sT r1.txt localhost:$port/$OUTFILE -H "Content-Length: a" > /dev/null
+timeout 5 curl -sT r1.txt localhost:$port/$OUTFILE -H "Host: a a" > /dev/null
+out=$(diff r3.txt $OUTFILE)
+
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Difference found. Calling PUT on $OUTFILE with a bad Content-Length and Host, then diff r3.txt $OUTFILE\n"
+fi
+((++testCase))
+
+#### GETs while PUTs replace the file each get one whole version of it ####
+#### Test 73                                                            ####
+echo ====GET during PUT Test====
+
+OUTFILE=r13.txt
+cp r1.txt $OUTFILE
+getDuringPutCalls r1.txt r5.txt $OUTFILE 20
+
+out=""
+for i in {1..20}; do
+	if ! cmp -s get$i.out r1.txt && ! cmp -s get$i.out r5.txt; then
+		out="GET $i got neither r1.txt nor r5.txt"
+		break
+	fi
+done
+rm -f get*.out
+
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. $out while PUTs of r1.txt and r5.txt replaced $OUTFILE\n"
+fi
+((++testCase))
+
+#### PUT chunked bodies, with and without trailers, then diff the stored file ####
+#### Tests 74-75                                                               ####
+echo ====Chunked PUT Test====
+
+OUTFILE=r14.txt
+timeout 10 curl -sT r5.txt -H "Transfer-Encoding: chunked" localhost:$port/$OUTFILE > /dev/null
+out=$(diff r5.txt $OUTFILE)
+
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Difference found. Calling curl -sT r5.txt -H \"Transfer-Encoding: chunked\" on $OUTFILE, then diff r5.txt $OUTFILE\n"
+fi
+((++testCase))
+
+# curl can't send trailers, so this request is written out by hand. It is
+# written from a subshell, which a server that hangs up early kills with
+# SIGPIPE instead of this script
+exec 3<>/dev/tcp/localhost/$port
+(
+	printf "PUT /$OUTFILE HTTP/1.1\r\nHost: localhost:$port\r\nTransfer-Encoding: chunked\r\nTrailer: X-Checksum\r\nConnection: close\r\n\r\n"
+	printf "6;name=value\r\nHello \r\n19\r\nfrom a chunked body with \r\n9\r\ntrailers\n\r\n0\r\nX-Checksum: 1234\r\nX-Other: a\r\n\r\n"
+) >&3
+response=$(timeout 5 cat <&3 | head -n 1 | tr -d '\r')
+exec 3<&-
+out=$(diff <(printf "Hello from a chunked body with trailers\n") $OUTFILE)
+if [ "$response" != "HTTP/1.1 200 OK" ]; then
+	out="answered $response"
+fi
+
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Difference found. Sending a chunked PUT with trailers to $OUTFILE: $out\n"
+fi
+((++testCase))
+
+#### Scrape /metrics around a few requests ####
+#### Tests 76-78                            ####
+echo ====Metrics Test====
+
+# prints "name{labels} value" for every sample, or the first line that isn't valid exposition text
+check_metrics () {
+	awk '
+		/^# HELP [a-zA-Z_:][a-zA-Z0-9_:]* / { next }
+		/^# TYPE [a-zA-Z_:][a-zA-Z0-9_:]* (counter|gauge|histogram|summary|untyped)$/ { typed[$3] = 1; next }
+		/^[a-zA-Z_:][a-zA-Z0-9_:]*(\{[a-zA-Z_][a-zA-Z0-9_]*="[^"]*"(,[a-zA-Z_][a-zA-Z0-9_]*="[^"]*")*\})? ([-+]?[0-9.]+([eE][-+]?[0-9]+)?|[-+]Inf|NaN)$/ {
+			name = $1
+			sub(/\{.*/, "", name)
+			base = name
+			sub(/_(bucket|sum|count)$/, "", base)
+			if (!(name in typed) && !(base in typed)) {
+				print "BAD no TYPE for " $0
+				exit
+			}
+			print
+			next
+		}
+		{ print "BAD " $0; exit }
+	' "$1"
+}
+
+# prints the value of a sample, 0 if it is missing
+metric_value () {
+	awk -v sample="$2" '$1 == sample { print $2; found = 1 } END { if (!found) print 0 }' "$1"
+}
+
+timeout 5 curl -s localhost:$port/metrics > metrics_before.out
+for i in 1 2 3; do
+	timeout 5 curl -s localhost:$port/r1.txt > /dev/null
+done
+timeout 5 curl -sI localhost:$port/r1.txt > /dev/null
+timeout 5 curl -sT r3.txt localhost:$port/r15.txt > /dev/null
+timeout 5 curl -s localhost:$port/metrics > metrics_after.out
+
+out=$(check_metrics metrics_before.out | grep "^BAD"; check_metrics metrics_after.out | grep "^BAD")
+printf "Test $testCase: "
+if [ "$out" = "" ] && [ -s metrics_after.out ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. /metrics isn't valid Prometheus text: $out\n"
+fi
+((++testCase))
+
+out=""
+for method in GET:3 HEAD:1 PUT:1; do
+	sample="httpserver_requests_total{method=\"${method%:*}\"}"
+	before=$(metric_value metrics_before.out $sample)
+	after=$(metric_value metrics_after.out $sample)
+	if (( after < before + ${method#*:} )); then
+		out="$out $sample went from $before to $after."
+	fi
+done
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Counters didn't go up with the requests:$out\n"
+fi
+((++testCase))
+
+# buckets are cumulative: they never go down, and the +Inf one is the count
+out=$(check_metrics metrics_after.out | awk '
+	$1 ~ /_bucket\{/ {
+		series = $1
+		sub(/,?le="[^"]*"/, "", series)
+		sub(/_bucket/, "", series)
+		if (series in last && $2 < last[series])
+			print "bucket went down: " $0
+		last[series] = $2
+		if ($1 ~ /le="\+Inf"/)
+			inf[series] = $2
+		next
+	}
+	$1 ~ /_count(\{|$)/ {
+		series = $1
+		sub(/_count/, "", series)
+		count[series] = $2
+	}
+	END {
+		for (series in count) {
+			key = series
+			if (!(key in inf))
+				key = series "{}"
+			if (!(key in inf) || inf[key] != count[series])
+				print "no +Inf bucket matching " series "_count " count[series]
+		}
+	}')
+rm -f metrics_before.out metrics_after.out
+printf "Test $testCase: "
+if [ "$out" = "" ]; then
+	printf "PASS\n"
+else
+	printf "FAIL. Histogram buckets don't add up: $out\n"
+fi
+((++testCase))
+
 printf "====All Done====\n"
@@ -0,0 +1,225 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct TraceRecord {
+  uint64_t ts[NUM_OF_TRACE_PHASES];   // 0 for phases the request didn't go through
+  int connfd;
+  int statusCode;
+  char method[8];
+  char target[24];
+};
+
+/*
+  One thread's last TRACE_RING_SIZE requests. The thread fills in the
+  record at index count and only then bumps count, so a dump can tell
+  which records are complete: everything before count except whatever
+  the thread has overwritten since.
+*/
+struct TraceRing {
+  struct TraceRecord records[TRACE_RING_SIZE];
+  atomic_uint_fast64_t count;
+  int threadNum;
+  struct TraceRing* next;
+};
+
+int traceEnabled = 0;
+
+// every thread's ring, only ever added to
+static pthread_mutex_t m_rings = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceRing* _Atomic rings = NULL;
+static int numOfRings = 0;   // protected by m_rings
+static __thread struct TraceRing* threadRing = NULL;
+
+// the connection the thread is on, until its first request takes them
+static __thread uint64_t nextAcceptNs = 0;
+static __thread uint64_t nextDequeueNs = 0;
+
+static const char* phaseNames[NUM_OF_TRACE_PHASES] = {
+  "accept", "wait for worker", "read head", "wait for lock", "first byte", "send", "log"
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct TraceRing* get_thread_ring() {
+  if (threadRing != NULL) {
+    return threadRing;
+  }
+
+  struct TraceRing* ring = calloc(1, sizeof *ring);
+  if (ring == NULL) {
+    err(EXIT_FAILURE, "cannot allocate trace ring");
+  }
+
+  // START CRITICAL REGION
+  pthread_mutex_lock(&m_rings);
+  ring->threadNum = ++numOfRings;
+  ring->next = rings;
+  rings = ring;
+  // END CRITICAL REGION
+  pthread_mutex_unlock(&m_rings);
+
+  threadRing = ring;
+  return ring;
+}
+
+static struct TraceRecord* current_record(struct TraceRing* ring) {
+  return &ring->records[atomic_load_explicit(&ring->count, memory_order_relaxed) & (TRACE_RING_SIZE - 1)];
+}
+
+void trace_record_phase(enum TracePhase phase) {
+  struct TraceRecord* record = current_record(get_thread_ring());
+  // only the first send of a response counts
+  if (record->ts[phase] == 0)
+    record->ts[phase] = now_ns();
+}
+
+void trace_connection(uint64_t acceptNs, uint64_t dequeueNs) {
+  nextAcceptNs = acceptNs;
+  nextDequeueNs = dequeueNs;
+}
+
+static void copy_slice(char* out, size_t size, struct HttpSlice slice) {
+  size_t len = slice.len < size - 1 ? slice.len : size - 1;
+  memcpy(out, slice.data, len);
+  out[len] = '\0';
+}
+
+void trace_begin_request(int connfd, const struct HttpRequest* request) {
+  struct TraceRecord* record = current_record(get_thread_ring());
+  memset(record, 0, sizeof *record);
+  record->ts[TRACE_ACCEPT] = nextAcceptNs;
+  record->ts[TRACE_DEQUEUE] = nextDequeueNs;
+  record->ts[TRACE_PARSED] = now_ns();
+  nextAcceptNs = nextDequeueNs = 0;
+
+  record->connfd = connfd;
+  copy_slice(record->method, sizeof record->method, request->method);
+  copy_slice(record->target, sizeof record->target, request->target);
+}
+
+void trace_end_request(int statusCode) {
+  struct TraceRing* ring = get_thread_ring();
+  struct TraceRecord* record = current_record(ring);
+  record->ts[TRACE_LAST_BYTE] = now_ns();
+  record->statusCode = statusCode;
+  atomic_fetch_add_explicit(&ring->count, 1, memory_order_release);
+}
+
+/*
+  Writes text into a JSON string. Targets are only checked after they are
+  recorded, so quotes, backslashes, control bytes and bytes that may not
+  be UTF-8 are all escaped, the latter as the Latin-1 characters.
+*/
+static void write_json_text(FILE* out, const char* text) {
+  for (const unsigned char* c = (const unsigned char*) text; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\')
+      fprintf(out, "\\%c", *c);
+    else if (*c < 0x20 || *c >= 0x7f)
+      fprintf(out, "\\u%04x", *c);
+    else
+      fputc(*c, out);
+  }
+}
+
+/*
+  Writes a request as one span covering all of it, with a span under it
+  for each phase, running from the phase before it in time. Phases can
+  be reached out of order, e.g. a GET is logged before its body is sent.
+*/
+static void write_record(FILE* out, const struct TraceRecord* record, int threadNum, int* first) {
+  int order[NUM_OF_TRACE_PHASES];
+  int numOfPhases = 0;
+  for (int phase = 0; phase < NUM_OF_TRACE_PHASES; ++phase) {
+    if (record->ts[phase] == 0)
+      continue;
+    int i = numOfPhases++;
+    while (i > 0 && record->ts[order[i - 1]] > record->ts[phase]) {
+      order[i] = order[i - 1];
+      i--;
+    }
+    order[i] = phase;
+  }
+  if (numOfPhases < 2)
+    return;
+
+  uint64_t start = record->ts[order[0]];
+  uint64_t end = record->ts[order[numOfPhases - 1]];
+  fprintf(out, "%s{\"name\":\"", *first ? "" : ",\n");
+  write_json_text(out, record->method);
+  fputc(' ', out);
+  write_json_text(out, record->target);
+  fprintf(out, " %d\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"connfd\":%d}}",
+      record->statusCode,
+      getpid(),
+      threadNum,
+      start / 1e3,
+      (end - start) / 1e3,
+      record->connfd
+  );
+  *first = 0;
+
+  for (int i = 1; i < numOfPhases; ++i) {
+    uint64_t from = record->ts[order[i - 1]];
+    fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+        phaseNames[order[i]],
+        getpid(),
+        threadNum,
+        from / 1e3,
+        (record->ts[order[i]] - from) / 1e3
+    );
+  }
+}
+
+int trace_dump(const char* fileName) {
+  // written next to the old dump and renamed over it, so a reader never sees half of one
+  char tempName[4096];
+  snprintf(tempName, sizeof tempName, "%s.tmp", fileName);
+  FILE* out = fopen(tempName, "w");
+  if (out == NULL) {
+    return -1;
+  }
+
+  struct TraceRecord* copy = malloc(TRACE_RING_SIZE * sizeof *copy);
+  if (copy == NULL) {
+    err(EXIT_FAILURE, "cannot allocate trace dump");
+  }
+
+  int first = 1;
+  fprintf(out, "{\"traceEvents\":[\n");
+  for (struct TraceRing* ring = rings; ring != NULL; ring = ring->next) {
+    // copy the ring while its thread keeps going, then drop whatever it
+    // may have overwritten meanwhile, including the record in progress
+    uint64_t before = atomic_load_explicit(&ring->count, memory_order_acquire);
+    memcpy(copy, ring->records, TRACE_RING_SIZE * sizeof *copy);
+    uint64_t after = atomic_load_explicit(&ring->count, memory_order_acquire);
+
+    uint64_t oldest = after >= TRACE_RING_SIZE - 1 ? after - (TRACE_RING_SIZE - 1) : 0;
+    for (uint64_t i = oldest; i < before; ++i) {
+      write_record(out, &copy[i & (TRACE_RING_SIZE - 1)], ring->threadNum, &first);
+    }
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  free(copy);
+
+  if (fclose(out) != 0) {
+    int saved = errno;
+    unlink(tempName);
+    errno = saved;
+    return -1;
+  }
+  return rename(tempName, fileName);
+}
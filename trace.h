@@ -0,0 +1,69 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "httpparse.h"
+
+/**
+   Per-request phase tracing. With tracing on, every thread records the
+   time each request reaches each phase into a ring of its own, keeping
+   its last TRACE_RING_SIZE requests, and trace_dump writes all of the
+   rings out as Chrome trace-event JSON for chrome://tracing or Perfetto.
+
+   Every phase is also a USDT probe in the "httpserver" provider when
+   the build finds <sys/sdt.h>, e.g. for
+     bpftrace -e 'usdt:./httpserver:httpserver:lock_acquired { @[tid] = count(); }'
+   The probes are single nops until something attaches to them, and the
+   ring costs one predictable branch per phase while tracing is off.
+ */
+enum TracePhase {
+  TRACE_ACCEPT,       // the connection was accepted, or handed over by an event loop
+  TRACE_DEQUEUE,      // a worker took it off the connection queue
+  TRACE_PARSED,       // the request head was parsed
+  TRACE_LOCKED,       // the file was locked, or opened for an atomic PUT
+  TRACE_FIRST_BYTE,   // the response started going out
+  TRACE_LAST_BYTE,    // the response was sent
+  TRACE_LOGGED,       // the log entry was queued
+  NUM_OF_TRACE_PHASES
+};
+
+#define TRACE_RING_SIZE 4096  // requests kept per thread, must be a power of two
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name) DTRACE_PROBE(httpserver, name)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(name)
+#endif
+
+extern int traceEnabled;   // set once before any thread starts serving
+
+void trace_record_phase(enum TracePhase phase);
+
+// marks that the current request reached phase, which fires the USDT probe name
+#define TRACE_POINT(phase, name) do { \
+    TRACE_PROBE(name); \
+    if (traceEnabled) \
+      trace_record_phase(phase); \
+  } while (0)
+
+/**
+   Notes when a worker's next connection was accepted and dequeued, in
+   CLOCK_MONOTONIC nanoseconds, for the first request read off it.
+ */
+void trace_connection(uint64_t acceptNs, uint64_t dequeueNs);
+
+// starts the record of a parsed request, which is also TRACE_PARSED
+void trace_begin_request(int connfd, const struct HttpRequest* request);
+
+// finishes the current record, which is also TRACE_LAST_BYTE
+void trace_end_request(int statusCode);
+
+// writes every thread's recorded requests to fileName. Returns 0, or -1 with errno set
+int trace_dump(const char* fileName);
+
+#endif
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+// there is no liburing to lean on, so these are the bare system calls
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned numOfArgs) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, numOfArgs);
+}
+
+int uring_init(struct Uring* ring, unsigned entries, unsigned cqEntries, unsigned flags) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+  params.flags = flags | IORING_SETUP_CQSIZE;
+  params.cq_entries = cqEntries;
+
+  int fd = io_uring_setup(entries, &params);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // both queues share one mapping since 5.4, and waiting with a timeout
+  // needs IORING_ENTER_EXT_ARG from 5.11, so older kernels aren't worth
+  // the extra code
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  ring->ringSize = sqSize > cqSize ? sqSize : cqSize;
+  ring->ringMem = mmap(NULL, ring->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->ringMem == MAP_FAILED) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+
+  ring->sqesSize = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    int saved = errno;
+    munmap(ring->ringMem, ring->ringSize);
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+
+  char* mem = ring->ringMem;
+  ring->fd = fd;
+  ring->sqHead = (unsigned*) (mem + params.sq_off.head);
+  ring->sqTail = (unsigned*) (mem + params.sq_off.tail);
+  ring->sqMask = *(unsigned*) (mem + params.sq_off.ring_mask);
+  ring->sqEntries = *(unsigned*) (mem + params.sq_off.ring_entries);
+  ring->sqeTail = *ring->sqTail;
+  ring->cqHead = (unsigned*) (mem + params.cq_off.head);
+  ring->cqTail = (unsigned*) (mem + params.cq_off.tail);
+  ring->cqMask = *(unsigned*) (mem + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (mem + params.cq_off.cqes);
+
+  // slot i of the queue always holds sqe i, so the array never changes again
+  unsigned* array = (unsigned*) (mem + params.sq_off.array);
+  for (unsigned i = 0; i < ring->sqEntries; ++i) {
+    array[i] = i;
+  }
+  return 0;
+}
+
+void uring_exit(struct Uring* ring) {
+  munmap(ring->sqes, ring->sqesSize);
+  munmap(ring->ringMem, ring->ringSize);
+  close(ring->fd);
+}
+
+int uring_register_buffers(struct Uring* ring, const struct iovec* buffers, unsigned count) {
+  return io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, buffers, count) < 0 ? -1 : 0;
+}
+
+// publishes the queued sqes and returns how many the kernel hasn't consumed yet
+static unsigned publish(struct Uring* ring) {
+  __atomic_store_n(ring->sqTail, ring->sqeTail, __ATOMIC_RELEASE);
+  return ring->sqeTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+}
+
+int uring_make_room(struct Uring* ring, unsigned count) {
+  if (ring->sqeTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) + count > ring->sqEntries) {
+    unsigned toSubmit = publish(ring);
+    while (io_uring_enter(ring->fd, toSubmit, 0, 0, NULL, 0) < 0) {
+      if (errno != EINTR)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct Uring* ring) {
+  if (uring_make_room(ring, 1) < 0) {
+    return NULL;
+  }
+
+  struct io_uring_sqe* sqe = &ring->sqes[ring->sqeTail & ring->sqMask];
+  ring->sqeTail++;
+  memset(sqe, 0, sizeof *sqe);
+  return sqe;
+}
+
+int uring_submit_and_wait(struct Uring* ring, int timeoutMs) {
+  struct __kernel_timespec timeout = {
+    .tv_sec = timeoutMs / 1000,
+    .tv_nsec = (timeoutMs % 1000) * 1000000L
+  };
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof arg);
+  arg.ts = (unsigned long) &timeout;
+
+  unsigned toSubmit = publish(ring);
+  if (io_uring_enter(ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+struct io_uring_cqe* uring_peek_cqe(struct Uring* ring) {
+  unsigned head = *ring->cqHead;
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cqMask];
+}
+
+void uring_cqe_seen(struct Uring* ring) {
+  __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
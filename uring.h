@@ -0,0 +1,79 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**
+   Minimal io_uring ring on top of the raw system calls: the submission
+   and completion queues mapped into memory, with just enough around them
+   to queue requests, submit them and reap their completions. A ring must
+   only be used by the thread that created it.
+ */
+struct Uring {
+  int fd;
+
+  // submission queue
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned sqeTail;             // next free sqe, published to *sqTail on submit
+  struct io_uring_sqe* sqes;
+
+  // completion queue
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+
+  void* ringMem;
+  size_t ringSize;
+  size_t sqesSize;
+};
+
+/**
+   Sets up a ring with room for entries submissions and cqEntries
+   completions, and flags on top of IORING_SETUP_CQSIZE. Returns 0, or -1
+   with errno set, e.g. to ENOSYS or EPERM when the kernel has no io_uring
+   or doesn't allow it, or EINVAL when it lacks one of the flags.
+ */
+int uring_init(struct Uring* ring, unsigned entries, unsigned cqEntries, unsigned flags);
+void uring_exit(struct Uring* ring);
+
+/**
+   Registers count buffers with the ring, so READ_FIXED and WRITE_FIXED
+   requests can name them by index and the kernel doesn't have to pin
+   their pages for every request. Returns 0, or -1 with errno set, e.g.
+   to ENOMEM when they would lock more memory than RLIMIT_MEMLOCK allows.
+ */
+int uring_register_buffers(struct Uring* ring, const struct iovec* buffers, unsigned count);
+
+/**
+   Returns a cleared sqe to fill in, submitting what is already queued
+   to make room if the submission queue is full.
+ */
+struct io_uring_sqe* uring_get_sqe(struct Uring* ring);
+
+/**
+   Submits what is already queued if fewer than count more sqes fit, so
+   the next count calls to uring_get_sqe go out in one submission, as the
+   requests of a linked chain have to. Returns 0, or -1 with errno set.
+ */
+int uring_make_room(struct Uring* ring, unsigned count);
+
+/**
+   Submits the queued sqes and waits up to timeoutMs for at least one
+   completion. Returns 0, or -1 with errno set, ETIME if nothing completed
+   in time.
+ */
+int uring_submit_and_wait(struct Uring* ring, int timeoutMs);
+
+// returns the oldest completion, or NULL if there is none
+struct io_uring_cqe* uring_peek_cqe(struct Uring* ring);
+
+// hands the completion returned by uring_peek_cqe back to the kernel
+void uring_cqe_seen(struct Uring* ring);
+
+#endif